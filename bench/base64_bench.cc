@@ -0,0 +1,147 @@
+// Checks that every SIMD base64 kernel this cpu supports is bit-exact with the
+// scalar one, then prints the encode/decode throughput of each.
+//
+//   make bench        or        ./bench/base64_bench [MB]
+//
+// Exits with 1 and the first mismatch when a kernel differs from scalar.
+
+#include "base64.hpp"
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+static std::mt19937 rng(20240611);
+
+static string random_bytes(size_t len) {
+    string s(len, '\0');
+    for (auto &c : s) {
+        c = (char)(rng() & 0xff);
+    }
+    return s;
+}
+
+static string encode(const Base64Kernel &k, const string &src) {
+    string out(base64_encoded_size(src.size()), '\0');
+    out.resize(k.encode((const uint8_t *)src.data(), src.size(), &out[0]));
+    return out;
+}
+
+// -1 stays -1, otherwise only the decoded bytes are compared
+static bool decode(const Base64Kernel &k, const string &text, string *out) {
+    out->assign(base64_decode_capacity(text.size()), '\0');
+    long long n = k.decode((const uint8_t *)text.data(), text.size(), &(*out)[0]);
+    if (n < 0) {
+        out->clear();
+        return false;
+    }
+    out->resize((size_t)n);
+    return true;
+}
+
+static int failures = 0;
+
+static void report(const Base64Kernel &k, const char *what, const string &input) {
+    if (failures++ < 10) {
+        printf("MISMATCH %s %s, input length %d\n", k.name, what, (int)input.size());
+    }
+}
+
+static void check(const Base64Kernel &scalar, const Base64Kernel &k, const string &bytes) {
+    string expect = encode(scalar, bytes);
+    if (encode(k, bytes) != expect) {
+        report(k, "encode", bytes);
+    }
+    string want, got;
+    bool wantOk = decode(scalar, expect, &want);
+    bool gotOk = decode(k, expect, &got);
+    if (!wantOk || want != bytes || gotOk != wantOk || got != want) {
+        report(k, "decode", expect);
+    }
+}
+
+// base64 text broken by line breaks, stray characters and misplaced padding
+static string mangle(const string &text) {
+    static const char noise[] = "\r\n \t=*.-_";
+    string out;
+    for (char c : text) {
+        if (rng() % 37 == 0) {
+            out += noise[rng() % (sizeof(noise) - 1)];
+        }
+        out += c;
+    }
+    return out;
+}
+
+static void check_text(const Base64Kernel &scalar, const Base64Kernel &k, const string &text) {
+    string want, got;
+    bool wantOk = decode(scalar, text, &want);
+    bool gotOk = decode(k, text, &got);
+    if (gotOk != wantOk || got != want) {
+        report(k, "decode of mangled text", text);
+    }
+}
+
+static double mbps(size_t bytes, std::chrono::high_resolution_clock::duration d) {
+    double secs = std::chrono::duration<double>(d).count();
+    return secs > 0 ? bytes / secs / (1024 * 1024) : 0;
+}
+
+int main(int argc, char **argv) {
+    vector<Base64Kernel> kernels = base64_kernels();
+    const Base64Kernel &scalar = kernels.front();
+    printf("kernels:");
+    for (auto &k : kernels) {
+        printf(" %s", k.name);
+    }
+    printf(" (in use: %s)\n", base64_kernel());
+
+    for (size_t i = 1; i < kernels.size(); i++) {
+        const Base64Kernel &k = kernels[i];
+        // every length around the 12/24 byte vector steps and their tails
+        for (size_t len = 0; len <= 1024; len++) {
+            check(scalar, k, random_bytes(len));
+        }
+        for (int n = 0; n < 200; n++) {
+            check(scalar, k, random_bytes(rng() % (256 * 1024)));
+        }
+        for (int n = 0; n < 2000; n++) {
+            check_text(scalar, k, mangle(encode(scalar, random_bytes(rng() % 600))));
+        }
+        // every character value in every position of a vector block
+        for (int pos = 0; pos < 64; pos++) {
+            for (int c = 0; c < 256; c++) {
+                string text = encode(scalar, random_bytes(96));
+                text[pos] = (char)c;
+                check_text(scalar, k, text);
+            }
+        }
+    }
+    if (failures) {
+        printf("%d mismatches\n", failures);
+        return 1;
+    }
+    printf("all kernels are bit-exact with scalar\n");
+
+    size_t size = (argc > 1 ? (size_t)atoi(argv[1]) : 64) * 1024 * 1024;
+    string data = random_bytes(size);
+    string text = encode(scalar, data);
+    printf("%-8s %14s %14s\n", "kernel", "encode MB/s", "decode MB/s");
+    for (auto &k : kernels) {
+        string out(base64_encoded_size(size), '\0');
+        string back(base64_decode_capacity(text.size()), '\0');
+        auto t0 = std::chrono::high_resolution_clock::now();
+        k.encode((const uint8_t *)data.data(), data.size(), &out[0]);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        k.decode((const uint8_t *)text.data(), text.size(), &back[0]);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        printf("%-8s %14.0f %14.0f\n", k.name, mbps(size, t1 - t0), mbps(size, t2 - t1));
+    }
+    return 0;
+}
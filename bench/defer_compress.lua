@@ -0,0 +1,62 @@
+-- Deferred (pool-parallel) vs inline value compression of a batch write.
+--
+--   make bench    or    lua bench/defer_compress.lua [db path] [MB per size]
+--
+-- For each value size a batch of about the same total bytes is filled with
+-- compress=true puts and written, once compressing every value inside put and
+-- once with set_defer_compress(true) so the values are compressed on the
+-- worker pool right before the write.
+
+local leveldb = require "lualeveldb"
+
+local path = arg[1] or "/tmp/lvldb_bench_defer"
+local total = (tonumber(arg[2]) or 32) * 1024 * 1024
+local sizes = { 1024, 4096, 16384, 65536 }
+local rounds = 3
+
+-- compressible but not trivially so, like typical serialized records
+local function make_value(size, seed)
+    local parts, n = {}, 0
+    local x = seed
+    while n < size do
+        x = (x * 1103515245 + 12345) % 2147483648
+        local s = string.format("field%d=%d;", x % 97, x)
+        parts[#parts + 1] = s
+        n = n + #s
+    end
+    return table.concat(parts):sub(1, size)
+end
+
+local opt = leveldb.options()
+opt.createIfMissing = true
+local db = leveldb.open(opt, path)
+
+local function run(values, defer)
+    local best
+    for r = 1, rounds do
+        local batch = db:batch()
+        batch:set_defer_compress(defer)
+        local t = leveldb.now()
+        for i, v in ipairs(values) do
+            batch:put(string.format("k%02d%08d", r, i), v, true)
+        end
+        db:write(batch)
+        local ms = leveldb.elapsed(t)
+        batch:close()
+        best = best and math.min(best, ms) or ms
+    end
+    return math.max(best, 1)
+end
+
+print(string.format("%-8s %8s %12s %12s %8s", "value", "count", "inline ms", "deferred ms", "speedup"))
+for _, size in ipairs(sizes) do
+    local values = {}
+    for i = 1, math.floor(total / size) do
+        values[i] = make_value(size, i)
+    end
+    local inline = run(values, false)
+    local deferred = run(values, true)
+    print(string.format("%-8s %8d %12d %12d %7.2fx", math.floor(size / 1024) .. "KB", #values, inline, deferred, inline / deferred))
+end
+
+db:close()
@@ -0,0 +1,82 @@
+-- get/put/iteration loops through lualeveldb_ffi against the plain bindings.
+--
+--   make bench-jit    or    luajit bench/ffi_loop.lua [db path] [keys]
+--
+-- Meant for LuaJIT with lualeveldb.so built against its headers; elsewhere the
+-- FFI module falls back to the bindings and both columns measure the same thing.
+
+local leveldb = require "lualeveldb"
+local fast = require "lualeveldb_ffi"
+
+local path = arg[1] or "/tmp/lvldb_bench_ffi"
+local n = tonumber(arg[2]) or 200000
+
+local opt = leveldb.options()
+opt.createIfMissing = true
+local db = leveldb.open(opt, path)
+
+local keys, value = {}, string.rep("v", 100)
+for i = 1, n do
+    keys[i] = string.format("key%09d", i)
+end
+
+local function timed(fn)
+    local t = leveldb.now()
+    fn()
+    return math.max(leveldb.elapsed(t), 1)
+end
+
+local loops = {
+    {
+        "put",
+        function()
+            for i = 1, n do
+                db:put(keys[i], value)
+            end
+        end,
+        function()
+            for i = 1, n do
+                fast.put(db, keys[i], value)
+            end
+        end,
+    },
+    {
+        "get",
+        function()
+            for i = 1, n do
+                db:get(keys[i])
+            end
+        end,
+        function()
+            for i = 1, n do
+                fast.get(db, keys[i])
+            end
+        end,
+    },
+    {
+        "iterate",
+        function()
+            local it = db:iterator()
+            it:seekToFirst()
+            while it:valid() do
+                local _, _ = it:key(), it:value()
+                it:next()
+            end
+            it:del()
+        end,
+        function()
+            for _, _ in fast.pairs(db) do
+            end
+        end,
+    },
+}
+
+print(string.format("ffi: %s, %d keys", tostring(fast.jit), n))
+print(string.format("%-8s %14s %14s %8s", "loop", "binding op/s", "ffi op/s", "speedup"))
+for _, loop in ipairs(loops) do
+    local plain = timed(loop[2])
+    local jit = timed(loop[3])
+    print(string.format("%-8s %14d %14d %7.2fx", loop[1], math.floor(n * 1000 / plain), math.floor(n * 1000 / jit), plain / jit))
+end
+
+db:close()
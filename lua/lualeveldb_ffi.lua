@@ -0,0 +1,163 @@
+-- Fast path for get/put/delete/iteration under LuaJIT, calling the plain C
+-- entry points of lualeveldb.so through the FFI instead of the Lua C API.
+-- On other interpreters the same functions fall back to the regular bindings.
+--
+--   local lvldb = require "lualeveldb_ffi"
+--   lvldb.put(db, "k", "v")
+--   local v = lvldb.get(db, "k")
+--   for k, v in lvldb.pairs(db, "prefix") do ... end
+
+local leveldb = require "lualeveldb"
+
+local M = setmetatable({}, { __index = leveldb })
+
+local ok, ffi = pcall(require, "ffi")
+local path = ok and package.searchpath and package.searchpath("lualeveldb", package.cpath)
+
+if not path then
+    M.jit = false
+
+    function M.get(db, key)
+        return db:get(key)
+    end
+
+    function M.put(db, key, value, sync)
+        local wopt
+        if sync then
+            wopt = leveldb.writeOptions()
+            wopt.sync = true
+        end
+        return db:put(key, value, wopt)
+    end
+
+    function M.delete(db, key, sync)
+        local wopt
+        if sync then
+            wopt = leveldb.writeOptions()
+            wopt.sync = true
+        end
+        return db:delete(key, wopt)
+    end
+
+    function M.pairs(db, from)
+        local it = db:iterator()
+        if from then
+            it:seek(from)
+        else
+            it:seekToFirst()
+        end
+        local first = true
+        return function()
+            if not first then
+                it:next()
+            end
+            first = false
+            if not it:valid() then
+                it:del()
+                return nil
+            end
+            return it:key(), it:value()
+        end
+    end
+
+    return M
+end
+
+ffi.cdef [[
+int lvldb_ffi_get(void *handle, const char *key, size_t klen, char *buf, size_t cap, size_t *vlen, int fillCache);
+int lvldb_ffi_put(void *handle, const char *key, size_t klen, const char *val, size_t vlen, int sync);
+int lvldb_ffi_delete(void *handle, const char *key, size_t klen, int sync);
+void *lvldb_ffi_iter_new(void *handle, int fillCache);
+void lvldb_ffi_iter_seek(void *iter, const char *key, size_t klen);
+int lvldb_ffi_iter_step(void *iter, const char **key, size_t *klen, const char **val, size_t *vlen);
+void lvldb_ffi_iter_free(void *iter);
+]]
+
+local C = ffi.load(path)
+
+local FFI_OK, FFI_NOT_FOUND, FFI_TRUNCATED, FFI_CLOSED = 0, 1, 2, -1
+
+local cap = 4096
+local buf = ffi.new("char[?]", cap)
+local vlen = ffi.new("size_t[1]")
+local kp, vp = ffi.new("const char *[1]"), ffi.new("const char *[1]")
+local klen = ffi.new("size_t[1]")
+
+local dbmt = debug.getregistry()["leveldb.db"]
+
+-- the userdata payload is the handle the C side expects, anything else would
+-- be read as a LuaDB by the C side
+local function handle(db)
+    if type(db) ~= "userdata" or debug.getmetatable(db) ~= dbmt then
+        error("bad argument #1 (leveldb.db expected, got " .. type(db) .. ")", 3)
+    end
+    return ffi.cast("void *", db)
+end
+
+local function check(rc, what)
+    if rc == FFI_CLOSED then
+        error(what .. ": database is closed", 3)
+    end
+    error(what .. " failed", 3)
+end
+
+M.jit = true
+
+function M.get(db, key)
+    local h = handle(db)
+    local rc = C.lvldb_ffi_get(h, key, #key, buf, cap, vlen, 1)
+    if rc == FFI_TRUNCATED then
+        cap = tonumber(vlen[0]) * 2
+        buf = ffi.new("char[?]", cap)
+        rc = C.lvldb_ffi_get(h, key, #key, buf, cap, vlen, 1)
+    end
+    if rc == FFI_OK then
+        return ffi.string(buf, vlen[0])
+    elseif rc == FFI_NOT_FOUND then
+        return nil
+    end
+    check(rc, "get")
+end
+
+function M.put(db, key, value, sync)
+    local rc = C.lvldb_ffi_put(handle(db), key, #key, value, #value, sync and 1 or 0)
+    if rc == FFI_CLOSED then
+        check(rc, "put")
+    end
+    return rc == FFI_OK
+end
+
+function M.delete(db, key, sync)
+    local rc = C.lvldb_ffi_delete(handle(db), key, #key, sync and 1 or 0)
+    if rc == FFI_CLOSED then
+        check(rc, "delete")
+    end
+    return rc == FFI_OK
+end
+
+function M.pairs(db, from)
+    local it = C.lvldb_ffi_iter_new(handle(db), 1)
+    if it == nil then
+        check(FFI_CLOSED, "pairs")
+    end
+    it = ffi.gc(it, C.lvldb_ffi_iter_free)
+    if from then
+        C.lvldb_ffi_iter_seek(it, from, #from)
+    end
+    -- db is an upvalue of the closure, so the db cannot be collected and
+    -- closed under the iterator while the loop is running
+    return function()
+        if it == nil then
+            return nil
+        end
+        if C.lvldb_ffi_iter_step(it, kp, klen, vp, vlen) == 0 then
+            C.lvldb_ffi_iter_free(ffi.gc(it, nil))
+            it = nil
+            db = nil
+            return nil
+        end
+        return ffi.string(kp[0], klen[0]), ffi.string(vp[0], vlen[0])
+    end
+end
+
+return M
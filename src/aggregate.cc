@@ -0,0 +1,141 @@
+﻿#include "aggregate.hpp"
+#include "db.hpp"
+#include "pool.hpp"
+#include "range.hpp"
+#include "state.hpp"
+#include <memory>
+
+enum AggregateOp { AGG_COUNT, AGG_BYTES, AGG_MINMAX };
+
+struct AggregateResult {
+    AggregateResult() : count(0), keyBytes(0), valueBytes(0), minValueSize(0), maxValueSize(0) {}
+
+    void Merge(const AggregateResult &o) {
+        if (o.count == 0) {
+            return;
+        }
+        if (count == 0 || o.minKey < minKey) {
+            minKey = o.minKey;
+        }
+        if (count == 0 || o.maxKey > maxKey) {
+            maxKey = o.maxKey;
+        }
+        if (count == 0 || o.minValueSize < minValueSize) {
+            minValueSize = o.minValueSize;
+        }
+        if (o.maxValueSize > maxValueSize) {
+            maxValueSize = o.maxValueSize;
+        }
+        count += o.count;
+        keyBytes += o.keyBytes;
+        valueBytes += o.valueBytes;
+    }
+
+    uint64_t count;
+    uint64_t keyBytes;
+    uint64_t valueBytes;
+    string minKey;
+    string maxKey;
+    uint64_t minValueSize;
+    uint64_t maxValueSize;
+    Status status;
+};
+
+static void aggregate_range(DB *db, DbState *state, const ReadOptions &ropt, const string &from, const string &to, AggregateOp op, AggregateResult &r) {
+    std::unique_ptr<Iterator> it(db->NewIterator(ropt));
+    for (it->Seek(from); it->Valid(); it->Next()) {
+        Slice key = it->key();
+        if (!to.empty() && key.compare(to) >= 0) {
+            break;
+        }
+        if (op == AGG_COUNT) {
+            r.count++;
+            continue;
+        }
+        // separated values are sized from their pointer, without reading the log
+        uint64_t vsize = state->m_vlog ? ValueLog::ValueSize(it->value()) : it->value().size();
+        if (op == AGG_MINMAX) {
+            // keys come in order, the first one is the smallest
+            if (r.count == 0) {
+                r.minKey = key.ToString();
+                r.minValueSize = vsize;
+            } else if (vsize < r.minValueSize) {
+                r.minValueSize = vsize;
+            }
+            if (vsize > r.maxValueSize) {
+                r.maxValueSize = vsize;
+            }
+            r.maxKey.assign(key.data(), key.size());
+        }
+        r.count++;
+        r.keyBytes += key.size();
+        r.valueBytes += vsize;
+    }
+    r.status = it->status();
+}
+
+// ldb:aggregate{from=, to=, prefix=, op="count"|"bytes"|"minmax", parallel=N}
+int lvldb_database_aggregate(lua_State *L) {
+    static const char *const ops[] = { "count", "bytes", "minmax", NULL };
+    DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    string from = opt_string_field(L, 2, "from");
+    string to = opt_string_field(L, 2, "to");
+    string prefix = opt_string_field(L, 2, "prefix");
+    if (!prefix.empty()) {
+        from = prefix;
+        to = prefix_successor(prefix);
+    }
+    lua_getfield(L, 2, "op");
+    AggregateOp op = (AggregateOp)luaL_checkoption(L, -1, "count", ops);
+    lua_pop(L, 1);
+    size_t parallel = (size_t)opt_int_field(L, 2, "parallel", WorkerPool::Instance().Size() + 1);
+    if (parallel == 0) {
+        parallel = 1;
+    }
+
+    ReadOptions ropt;
+    ropt.fill_cache = false;
+    ropt.snapshot = state->GetSnapshot(db);
+    auto bounds = split_range(db, ropt, from, to, parallel);
+    vector<AggregateResult> results(bounds.size() - 1);
+    WorkerPool::Instance().ParallelFor(results.size(), [&](size_t i) {
+        aggregate_range(db, state, ropt, bounds[i], bounds[i + 1], op, results[i]);
+    }, parallel);
+    state->ReleaseSnapshot(db, ropt.snapshot);
+
+    AggregateResult total;
+    for (auto &r : results) {
+        if (!r.status.ok()) {
+            return luaL_error(L, "lvldb_aggregate: %s", r.status.ToString().c_str());
+        }
+        total.Merge(r);
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L, total.count);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, results.size());
+    lua_setfield(L, -2, "parts");
+    if (op == AGG_COUNT) {
+        return 1;
+    }
+    lua_pushinteger(L, total.keyBytes);
+    lua_setfield(L, -2, "keyBytes");
+    lua_pushinteger(L, total.valueBytes);
+    lua_setfield(L, -2, "valueBytes");
+    lua_pushinteger(L, total.keyBytes + total.valueBytes);
+    lua_setfield(L, -2, "bytes");
+    if (op == AGG_MINMAX && total.count > 0) {
+        lua_pushlstring(L, total.minKey.data(), total.minKey.size());
+        lua_setfield(L, -2, "minKey");
+        lua_pushlstring(L, total.maxKey.data(), total.maxKey.size());
+        lua_setfield(L, -2, "maxKey");
+        lua_pushinteger(L, total.minValueSize);
+        lua_setfield(L, -2, "minValueSize");
+        lua_pushinteger(L, total.maxValueSize);
+        lua_setfield(L, -2, "maxValueSize");
+    }
+    return 1;
+}
@@ -0,0 +1,5 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "utils.hpp"
+
+int lvldb_database_aggregate(lua_State *L);
@@ -0,0 +1,411 @@
+﻿#include "base64.hpp"
+#include "utils.hpp"
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define LVLDB_B64_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define B64_TARGET(x)
+#else
+#define B64_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+// SIMD decoders store a full vector per step, the output needs this much slack
+#define B64_DECODE_SLACK 32
+// scratch buffers above this size are released after use
+#define B64_SCRATCH_KEEP (1024 * 1024)
+
+static const char b64_encoding[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// -1 for characters that are skipped, -2 for padding
+struct Base64DecodeTable {
+    int8_t v[256];
+    Base64DecodeTable() {
+        for (int i = 0; i < 256; i++) {
+            v[i] = -1;
+        }
+        for (int i = 0; i < 64; i++) {
+            v[(uint8_t)b64_encoding[i]] = (int8_t)i;
+        }
+        v['='] = -2;
+    }
+};
+static const Base64DecodeTable b64_decoding;
+
+static size_t encode_scalar(const uint8_t *src, size_t len, char *dst) {
+    size_t i = 0;
+    char *out = dst;
+    for (; i + 3 <= len; i += 3) {
+        uint32_t v = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+        out[0] = b64_encoding[v >> 18];
+        out[1] = b64_encoding[(v >> 12) & 0x3f];
+        out[2] = b64_encoding[(v >> 6) & 0x3f];
+        out[3] = b64_encoding[v & 0x3f];
+        out += 4;
+    }
+    uint32_t v;
+    switch (len - i) {
+    case 1:
+        v = src[i];
+        out[0] = b64_encoding[v >> 2];
+        out[1] = b64_encoding[(v & 3) << 4];
+        out[2] = '=';
+        out[3] = '=';
+        out += 4;
+        break;
+    case 2:
+        v = src[i] << 8 | src[i + 1];
+        out[0] = b64_encoding[v >> 10];
+        out[1] = b64_encoding[(v >> 4) & 0x3f];
+        out[2] = b64_encoding[(v & 0xf) << 2];
+        out[3] = '=';
+        out += 4;
+        break;
+    }
+    return out - dst;
+}
+
+// same rules as the original decoder: unknown characters are skipped, padding ends a group
+static long long decode_scalar(const uint8_t *src, size_t len, char *dst) {
+    size_t i = 0;
+    long long output = 0;
+    while (i < len) {
+        int padding = 0;
+        int c[4];
+        for (int j = 0; j < 4;) {
+            if (i >= len) {
+                return -1;
+            }
+            c[j] = b64_decoding.v[src[i++]];
+            if (c[j] == -1) {
+                continue;
+            }
+            if (c[j] == -2) {
+                ++padding;
+            }
+            ++j;
+        }
+        uint32_t v;
+        switch (padding) {
+        case 0:
+            v = (unsigned)c[0] << 18 | c[1] << 12 | c[2] << 6 | c[3];
+            dst[output] = v >> 16;
+            dst[output + 1] = (v >> 8) & 0xff;
+            dst[output + 2] = v & 0xff;
+            output += 3;
+            break;
+        case 1:
+            if (c[3] != -2 || (c[2] & 3) != 0) {
+                return -1;
+            }
+            v = (unsigned)c[0] << 10 | c[1] << 4 | c[2] >> 2;
+            dst[output] = v >> 8;
+            dst[output + 1] = v & 0xff;
+            output += 2;
+            break;
+        case 2:
+            if (c[3] != -2 || c[2] != -2 || (c[1] & 0xf) != 0) {
+                return -1;
+            }
+            v = (unsigned)c[0] << 2 | c[1] >> 4;
+            dst[output] = v;
+            ++output;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return output;
+}
+
+#ifdef LVLDB_B64_X86
+// 12 input bytes per 128-bit lane to 16 characters (pshufb lookup, W. Mula / D. Lemire)
+B64_TARGET("ssse3")
+static inline __m128i enc_translate_128(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                  '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    result = _mm_shuffle_epi8(shift, result);
+    return _mm_add_epi8(result, indices);
+}
+
+B64_TARGET("ssse3")
+static size_t encode_ssse3(const uint8_t *src, size_t len, char *dst) {
+    size_t i = 0;
+    char *out = dst;
+    // each load reads 16 bytes and consumes 12
+    for (; i + 16 <= len; i += 12) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)out, enc_translate_128(in));
+        out += 16;
+    }
+    return (out - dst) + encode_scalar(src + i, len - i, out);
+}
+
+B64_TARGET("avx2")
+static size_t encode_avx2(const uint8_t *src, size_t len, char *dst) {
+    size_t i = 0;
+    char *out = dst;
+    const __m256i shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    // two 16 byte loads, 12 bytes apart, one per lane
+    for (; i + 28 <= len; i += 24) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(src + i + 12));
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        in = _mm256_shuffle_epi8(in, shuffle);
+        __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t1, t3);
+        __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_add_epi8(_mm256_shuffle_epi8(shift, result), indices);
+        _mm256_storeu_si256((__m256i *)out, result);
+        out += 32;
+    }
+    return (out - dst) + encode_ssse3(src + i, len - i, out);
+}
+
+// 16 characters to 12 bytes, returns false when the block holds anything but the 64 symbols
+B64_TARGET("ssse3")
+static inline bool dec_translate_128(__m128i in, __m128i *out) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    __m128i lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()))) {
+        return false;
+    }
+    __m128i eq_slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_slash, hi_nibbles));
+    __m128i values = _mm_add_epi8(in, roll);
+    __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    *out = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+B64_TARGET("ssse3")
+static long long decode_ssse3(const uint8_t *src, size_t len, char *dst) {
+    size_t i = 0;
+    char *out = dst;
+    // stops at the first block with padding or skipped characters, the scalar tail handles the rest
+    for (; i + 16 <= len; i += 16) {
+        __m128i block;
+        if (!dec_translate_128(_mm_loadu_si128((const __m128i *)(src + i)), &block)) {
+            break;
+        }
+        _mm_storeu_si128((__m128i *)out, block);
+        out += 12;
+    }
+    long long tail = decode_scalar(src + i, len - i, out);
+    return tail < 0 ? -1 : (out - dst) + tail;
+}
+
+B64_TARGET("avx2")
+static long long decode_avx2(const uint8_t *src, size_t len, char *dst) {
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+    char *out = dst;
+    for (; i + 32 <= len; i += 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+        __m256i lo_nibbles = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256()))) {
+            break;
+        }
+        __m256i eq_slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_slash, hi_nibbles));
+        __m256i values = _mm256_add_epi8(in, roll);
+        __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack);
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)out, merged);
+        out += 24;
+    }
+    long long tail = decode_ssse3(src + i, len - i, out);
+    return tail < 0 ? -1 : (out - dst) + tail;
+}
+
+static int cpu_level() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool ssse3 = (info[2] & (1 << 9)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx2 = false;
+    if (max_leaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+    return avx2 ? 2 : (ssse3 ? 1 : 0);
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return 2;
+    }
+    return __builtin_cpu_supports("ssse3") ? 1 : 0;
+#endif
+}
+#endif
+
+vector<Base64Kernel> base64_kernels() {
+    vector<Base64Kernel> k{ { "scalar", encode_scalar, decode_scalar } };
+#ifdef LVLDB_B64_X86
+    int level = cpu_level();
+    if (level >= 1) {
+        k.push_back(Base64Kernel{ "ssse3", encode_ssse3, decode_ssse3 });
+    }
+    if (level >= 2) {
+        k.push_back(Base64Kernel{ "avx2", encode_avx2, decode_avx2 });
+    }
+#endif
+    return k;
+}
+
+static const Base64Kernel &kernels() {
+    static const Base64Kernel k = base64_kernels().back();
+    return k;
+}
+
+size_t base64_encoded_size(size_t len) {
+    return (len + 2) / 3 * 4;
+}
+
+size_t base64_decode_capacity(size_t len) {
+    return (len + 3) / 4 * 3 + B64_DECODE_SLACK;
+}
+
+size_t base64_encode(const uint8_t *src, size_t len, char *dst) {
+    return kernels().encode(src, len, dst);
+}
+
+long long base64_decode(const uint8_t *src, size_t len, char *dst) {
+    return kernels().decode(src, len, dst);
+}
+
+const char *base64_kernel() {
+    return kernels().name;
+}
+
+// per thread output buffer, so large strings don't allocate a temporary userdata each call
+static char *scratch(size_t size) {
+    static thread_local vector<char> buffer;
+    size = size > 0 ? size : 1;
+    if (buffer.size() < size || (buffer.size() > B64_SCRATCH_KEEP && size <= B64_SCRATCH_KEEP)) {
+        vector<char>(size).swap(buffer);
+    }
+    return buffer.data();
+}
+
+int lvldb_base64_encode(lua_State *L) {
+    size_t sz = 0;
+    const uint8_t *text = (const uint8_t *)luaL_checklstring(L, 1, &sz);
+    char *buffer = scratch(base64_encoded_size(sz));
+    lua_pushlstring(L, buffer, base64_encode(text, sz, buffer));
+    return 1;
+}
+
+int lvldb_base64_decode(lua_State *L) {
+    size_t sz = 0;
+    const uint8_t *text = (const uint8_t *)luaL_checklstring(L, 1, &sz);
+    char *buffer = scratch(base64_decode_capacity(sz));
+    long long output = base64_decode(text, sz, buffer);
+    if (output < 0) {
+        return luaL_error(L, "Invalid base64 text");
+    }
+    lua_pushlstring(L, buffer, (size_t)output);
+    return 1;
+}
+
+static Base64Encoder *check_base64_encoder(lua_State *L, int index) {
+    return (Base64Encoder *)luaL_checkudata(L, index, LVLDB_MT_B64_ENC);
+}
+
+int lvldb_base64_encoder(lua_State *L) {
+    Base64Encoder *enc = (Base64Encoder *)lua_newuserdata(L, sizeof(Base64Encoder));
+    enc->carry_len = 0;
+    luaL_getmetatable(L, LVLDB_MT_B64_ENC);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// encodes every complete 3 byte group seen so far, up to 2 bytes are held for the next call
+int lvldb_base64_encoder_update(lua_State *L) {
+    Base64Encoder *enc = check_base64_encoder(L, 1);
+    size_t sz = 0;
+    const uint8_t *text = (const uint8_t *)luaL_checklstring(L, 2, &sz);
+    char *buffer = scratch(base64_encoded_size(sz + enc->carry_len));
+    size_t output = 0;
+    if (enc->carry_len > 0) {
+        if (enc->carry_len + sz < 3) {
+            memcpy(enc->carry + enc->carry_len, text, sz);
+            enc->carry_len += (int)sz;
+            lua_pushliteral(L, "");
+            return 1;
+        }
+        uint8_t group[3];
+        size_t used = 3 - enc->carry_len;
+        memcpy(group, enc->carry, enc->carry_len);
+        memcpy(group + enc->carry_len, text, used);
+        output = base64_encode(group, 3, buffer);
+        text += used;
+        sz -= used;
+    }
+    size_t whole = sz / 3 * 3;
+    output += base64_encode(text, whole, buffer + output);
+    enc->carry_len = (int)(sz - whole);
+    memcpy(enc->carry, text + whole, enc->carry_len);
+    lua_pushlstring(L, buffer, output);
+    return 1;
+}
+
+// flushes the held bytes with padding, the encoder can be reused afterwards
+int lvldb_base64_encoder_finish(lua_State *L) {
+    Base64Encoder *enc = check_base64_encoder(L, 1);
+    char buffer[4];
+    size_t output = base64_encode(enc->carry, enc->carry_len, buffer);
+    enc->carry_len = 0;
+    lua_pushlstring(L, buffer, output);
+    return 1;
+}
@@ -0,0 +1,32 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <vector>
+
+// streaming encoder state, lives inside the leveldb.b64enc userdata
+struct Base64Encoder {
+    uint8_t carry[2];
+    int carry_len;
+};
+
+// encodes len bytes into dst, which must hold base64_encoded_size(len) bytes
+size_t base64_encode(const uint8_t *src, size_t len, char *dst);
+// decodes into dst, which must hold base64_decode_capacity(len) bytes, returns -1 on invalid text
+long long base64_decode(const uint8_t *src, size_t len, char *dst);
+size_t base64_encoded_size(size_t len);
+size_t base64_decode_capacity(size_t len);
+// name of the kernel chosen at runtime: avx2, ssse3 or scalar
+const char *base64_kernel();
+
+struct Base64Kernel {
+    const char *name;
+    size_t (*encode)(const uint8_t *, size_t, char *);
+    long long (*decode)(const uint8_t *, size_t, char *);
+};
+// every kernel this cpu can run, scalar first and the one in use last
+std::vector<Base64Kernel> base64_kernels();
+
+int lvldb_base64_encode(lua_State *L);
+int lvldb_base64_decode(lua_State *L);
+int lvldb_base64_encoder(lua_State *L);
+int lvldb_base64_encoder_update(lua_State *L);
+int lvldb_base64_encoder_finish(lua_State *L);
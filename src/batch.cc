@@ -1,14 +1,126 @@
 ﻿#include "batch.hpp"
+#include "counter.hpp"
+#include "locks.hpp"
+#include "pool.hpp"
+#include "sharded.hpp"
+#include "state.hpp"
+#include <algorithm>
 
-Batch::Batch(DB *db) {
+bool compress_pending_ops(vector<PendingOp> &ops) {
+    vector<size_t> idx;
+    size_t bytes = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (ops[i].compress && !ops[i].del) {
+            idx.push_back(i);
+            bytes += ops[i].value.size();
+        }
+    }
+    std::atomic<bool> ok(true);
+    auto fn = [&](size_t i) {
+        auto &op = ops[idx[i]];
+        size_t outLen = 0;
+        void *p = tdefl_compress_mem_to_heap(op.value.data(), op.value.size(), &outLen, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+        if (!p) {
+            ok = false;
+            return;
+        }
+        op.value.assign((const char *)p, outLen);
+        op.compress = false;
+        mz_free(p);
+    };
+    if (idx.size() > 1 && bytes >= DEFER_PARALLEL_MIN_BYTES) {
+        WorkerPool::Instance().ParallelFor(idx.size(), fn);
+    } else {
+        for (size_t i = 0; i < idx.size(); i++) {
+            fn(i);
+        }
+    }
+    return ok;
+}
+
+void append_pending_ops(vector<PendingOp> &ops, WriteBatch &batch) {
+    for (auto &op : ops) {
+        if (op.del) {
+            batch.Delete(op.key);
+        } else {
+            batch.Put(op.key, op.value);
+        }
+    }
+    ops.clear();
+}
+
+bool RawBatch::Flush() {
+    if (m_pending.empty()) {
+        return true;
+    }
+    if (!compress_pending_ops(m_pending)) {
+        return false;
+    }
+    append_pending_ops(m_pending, *this);
+    m_pending_bytes = 0;
+    Account();
+    return true;
+}
+
+void RawBatch::Clear() {
+    WriteBatch::Clear();
+    m_pending.clear();
+    m_pending_bytes = 0;
+    Account();
+}
+
+RawBatch::~RawBatch() {
+    MemoryAccountant::Instance().Account(MEM_BATCH, -m_mem_bytes);
+}
+
+void RawBatch::Account() {
+    int64_t bytes = (int64_t)ApproximateSize() + m_pending_bytes;
+    MemoryAccountant::Instance().Account(MEM_BATCH, bytes - m_mem_bytes);
+    m_mem_bytes = bytes;
+}
+
+Slice RawBatch::Key(const Slice &key) {
+    if (m_prefix.empty()) {
+        return key;
+    }
+    m_key.assign(m_prefix);
+    m_key.append(key.data(), key.size());
+    return m_key;
+}
+
+Batch::Batch(DB *db)
+    : m_defer_compress(false), m_coalesce(false), m_coalesce_ordered(false), m_ops(0), m_op_bytes(0), m_logged_ops(0), m_logged_bytes(0), m_emitted_ops(0), m_emitted_bytes(0),
+      m_sharded(nullptr), m_overlay_bytes(0), m_pending_bytes(0), m_mem_bytes(0) {
     m_db = db;
+    m_state = l_get_db_state(db);
     l_ref_db(db);
     for (int i = 0; i < MAX_PARAM_NUM; i++) {
         m_int_param[i] = 0;
     }
+    MemoryAccountant::Instance().Register(this, "batch@" + pointer_tostring(this), false);
+}
+
+Batch::Batch(ShardedDB *db)
+    : m_defer_compress(false), m_coalesce(false), m_coalesce_ordered(false), m_ops(0), m_op_bytes(0), m_logged_ops(0), m_logged_bytes(0), m_emitted_ops(0), m_emitted_bytes(0),
+      m_sharded(db), m_overlay_bytes(0), m_pending_bytes(0), m_mem_bytes(0) {
+    m_db = nullptr;
+    m_state = nullptr;
+    l_ref_db(db);
+    for (int i = 0; i < MAX_PARAM_NUM; i++) {
+        m_int_param[i] = 0;
+    }
+    MemoryAccountant::Instance().Register(this, "batch@" + pointer_tostring(this), false);
 }
 
 Batch::~Batch() {
+    MemoryAccountant::Instance().Unregister(this);
+    MemoryAccountant::Instance().Account(MEM_BATCH, -m_mem_bytes);
+    if (m_sharded) {
+        l_unregister_db(m_sharded, [](void *db) {
+            delete (ShardedDB *)db;
+        });
+        return;
+    }
     l_unregister_db(m_db, [](void *db) {
         delete (DB *)db;
     });
@@ -17,42 +129,114 @@ Batch::~Batch() {
 void Batch::Put(lua_State *L, const Slice &key, Slice &val, bool compress) {
     std::lock_guard<MyMutex> guard(m_mutex);
     string value;
-    if (compress) {
+    auto key_ = key.ToString();
+    if (m_defer_compress) {
+        value = val.ToString();
+        // coalesced values are compressed at Write, only the last one of each key
+        if (!m_coalesce) {
+            m_pending.push_back(PendingOp{ key_, value, compress, false });
+        }
+        if (compress) {
+            m_raws.insert(key_);
+        } else {
+            m_raws.erase(key_);
+        }
+    } else if (compress) {
         size_t outLen = 0;
         void *p = tdefl_compress_mem_to_heap(val.data(), val.size(), &outLen, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
         if (!p) {
             luaL_error(L, "compress failed");
         }
-        m_batch.Put(key, Slice((const char *)p, outLen));
+        if (!m_coalesce) {
+            m_batch.Put(key, Slice((const char *)p, outLen));
+        }
         value = string((const char *)p, outLen);
         mz_free(p);
+        m_raws.erase(key_);
     } else {
-        m_batch.Put(key, val);
+        if (!m_coalesce) {
+            m_batch.Put(key, val);
+        }
         value = val.ToString();
+        m_raws.erase(key_);
     }
 
     lua_pushinteger(L, value.size());
-    auto key_ = key.ToString();
     auto it = m_dels.find(key_);
     if (it != m_dels.end()) {
         m_dels.erase(it);
+        m_overlay_bytes -= key_.size() + MEM_ENTRY_OVERHEAD;
+    }
+    if (m_defer_compress && !m_coalesce) {
+        m_pending_bytes += key_.size() + value.size() + MEM_ENTRY_OVERHEAD;
+    }
+    if (m_coalesce) {
+        m_ops++;
+        m_op_bytes += key_.size() + value.size();
     }
     auto it1 = m_upds.find(key_);
     if (it1 == m_upds.end()) {
+        m_overlay_bytes += key_.size() + value.size() + MEM_ENTRY_OVERHEAD;
         m_upds.emplace(key_, value);
     } else {
+        // the overlay keeps one value per key, the replaced operations stay counted in m_batch or m_pending_bytes
+        m_overlay_bytes += (int64_t)value.size() - (int64_t)it1->second.size();
         it1->second = std::move(value);
     }
+    Account();
 }
 
 void Batch::Delete(const Slice &key) {
     std::lock_guard<MyMutex> guard(m_mutex);
-    m_batch.Delete(key);
     auto key_ = key.ToString();
-    auto it = m_dels.find(key_);
-    if (it == m_dels.end()) {
-        m_dels.emplace(key_);
+    if (m_coalesce) {
+        m_raws.erase(key_);
+        m_ops++;
+        m_op_bytes += key_.size();
+    } else if (m_defer_compress) {
+        m_pending.push_back(PendingOp{ key_, string(), false, true });
+        m_raws.erase(key_);
+    } else {
+        m_batch.Delete(key);
+    }
+    if (m_dels.insert(key_).second) {
+        m_overlay_bytes += key_.size() + MEM_ENTRY_OVERHEAD;
     }
+    if (m_defer_compress && !m_coalesce) {
+        m_pending_bytes += key_.size() + MEM_ENTRY_OVERHEAD;
+    }
+    Account();
+}
+
+Status Batch::CounterBase(const string &key, int64_t *value) {
+    if (m_dels.count(key)) {
+        *value = 0;
+        return Status::OK();
+    }
+    auto it = m_upds.find(key);
+    if (it != m_upds.end()) {
+        return decode_counter(it->second, value) ? Status::OK() : Status::InvalidArgument("value is not a counter");
+    }
+    return m_state->m_counters->Load(key, value);
+}
+
+Status Batch::Incr(const Slice &key, int64_t delta, int64_t *result) {
+    std::lock_guard<MyMutex> guard(m_mutex);
+    auto key_ = key.ToString();
+    int64_t base;
+    Status s = CounterBase(key_, &base);
+    if (!s.ok()) {
+        return s;
+    }
+    auto it = m_incrs.find(key_);
+    if (it == m_incrs.end()) {
+        it = m_incrs.emplace(key_, 0).first;
+        m_overlay_bytes += key_.size() + sizeof(int64_t) + MEM_ENTRY_OVERHEAD;
+        Account();
+    }
+    it->second = (int64_t)((uint64_t)it->second + (uint64_t)delta);
+    *result = (int64_t)((uint64_t)base + (uint64_t)it->second);
+    return s;
 }
 
 void Batch::Clear() {
@@ -60,11 +244,40 @@ void Batch::Clear() {
     m_batch.Clear();
     m_dels.clear();
     m_upds.clear();
+    m_raws.clear();
+    m_incrs.clear();
+    m_pending.clear();
+    m_overlay_bytes = 0;
+    m_pending_bytes = 0;
+    m_ops = 0;
+    m_op_bytes = 0;
+    Account();
+}
+
+void Batch::Account() {
+    int64_t bytes = (int64_t)m_batch.ApproximateSize() + m_overlay_bytes + m_pending_bytes;
+    MemoryAccountant::Instance().Account(MEM_BATCH, bytes - m_mem_bytes);
+    m_mem_bytes = bytes;
 }
 
-int Batch::Get(lua_State *L, const Slice &key, bool uncompress) {
+void Batch::MemoryUsage(int64_t *bytes) {
+    bytes[MEM_BATCH] += m_mem_bytes;
+}
+
+int Batch::Get(lua_State *L, const Slice &key, bool uncompress, size_t inflateLimit) {
     std::lock_guard<MyMutex> guard(m_mutex);
     auto key_ = key.ToString();
+    auto incr = m_incrs.find(key_);
+    if (incr != m_incrs.end()) {
+        int64_t base;
+        if (!CounterBase(key_, &base).ok()) {
+            return 0;
+        }
+        string value;
+        encode_counter((int64_t)((uint64_t)base + (uint64_t)incr->second), &value);
+        lua_pushlstring(L, value.c_str(), value.size());
+        return 1;
+    }
     auto it = m_dels.find(key_);
     if (it != m_dels.end()) {
         return 0;
@@ -72,18 +285,31 @@ int Batch::Get(lua_State *L, const Slice &key, bool uncompress) {
     auto it1 = m_upds.find(key_);
     if (it1 != m_upds.end()) {
         auto &val = it1->second;
-        if (uncompress) {
-            miniz_uncompress(L, val.c_str(), val.size());
+        if (m_raws.count(key_)) {
+            // still waiting for compression, the overlay holds the raw value
+            if (uncompress) {
+                lua_pushlstring(L, val.c_str(), val.size());
+            } else {
+                miniz_compress(L, val.c_str(), val.size());
+            }
+        } else if (uncompress) {
+            if (!miniz_uncompress(L, val.c_str(), val.size(), inflateLimit)) {
+                lua_pushliteral(L, "inflateLimit exceeded");
+                return 2;
+            }
         } else {
             lua_pushlstring(L, val.c_str(), val.size());
         }
         return 1;
     }
     string value;
-    Status s = m_db->Get(ReadOptions(), key, &value);
+    Status s = m_sharded ? m_sharded->Shard(key)->Get(ReadOptions(), key, &value) : m_state->Get(m_db, ReadOptions(), key, &value);
     if (s.ok()) {
         if (uncompress) {
-            miniz_uncompress(L, value.c_str(), value.size());
+            if (!miniz_uncompress(L, value.c_str(), value.size(), inflateLimit)) {
+                lua_pushliteral(L, "inflateLimit exceeded");
+                return 2;
+            }
         } else {
             lua_pushlstring(L, value.c_str(), value.size());
         }
@@ -92,9 +318,121 @@ int Batch::Get(lua_State *L, const Slice &key, bool uncompress) {
     return 0;
 }
 
-void Batch::Write(lua_State *L, DB *db) {
+bool Batch::Flush() {
+    if (m_pending.empty()) {
+        return true;
+    }
+    if (!compress_pending_ops(m_pending)) {
+        return false;
+    }
+    // the last pending put of a key is the one visible in the overlay
+    unordered_map<string, size_t> last;
+    for (size_t i = 0; i < m_pending.size(); i++) {
+        if (!m_pending[i].del && m_raws.count(m_pending[i].key)) {
+            last[m_pending[i].key] = i;
+        }
+    }
+    for (auto &it : last) {
+        string &value = m_upds[it.first];
+        m_overlay_bytes += (int64_t)m_pending[it.second].value.size() - (int64_t)value.size();
+        value = m_pending[it.second].value;
+    }
+    m_raws.clear();
+    append_pending_ops(m_pending, m_batch);
+    m_pending_bytes = 0;
+    Account();
+    return true;
+}
+
+bool Batch::Coalesce() {
+    vector<PendingOp> ops;
+    ops.reserve(m_upds.size() + m_dels.size());
+    // increments are resolved against the overlay after this, otherwise its values can be moved out
+    bool keep = !m_incrs.empty();
+    uint64_t bytes = 0;
+    for (auto &key : m_dels) {
+        ops.push_back(PendingOp{ key, string(), false, true });
+        bytes += key.size();
+    }
+    for (auto &it : m_upds) {
+        if (m_dels.count(it.first)) {
+            continue;
+        }
+        bytes += it.first.size() + it.second.size();
+        ops.push_back(PendingOp{ it.first, keep ? it.second : std::move(it.second), m_raws.count(it.first) > 0, false });
+    }
+    // the memtable inserts in key order walk its skiplist forward instead of jumping around
+    if (m_coalesce_ordered) {
+        std::sort(ops.begin(), ops.end(), [](const PendingOp &a, const PendingOp &b) {
+            return a.key < b.key;
+        });
+    }
+    if (!compress_pending_ops(ops)) {
+        return false;
+    }
+    append_pending_ops(ops, m_batch);
+    m_logged_ops += m_ops;
+    m_logged_bytes += m_op_bytes;
+    m_emitted_ops += ops.size();
+    m_emitted_bytes += bytes;
+    return true;
+}
+
+void Batch::Write(lua_State *L, DB *db, const WriteOptions &wopt) {
     std::lock_guard<MyMutex> guard(m_mutex);
-    db->Write(lvldb_wopt(L, 3), &m_batch);
+    if (!Flush() || (m_coalesce && !Coalesce())) {
+        luaL_error(L, "compress failed");
+    }
+    DbState *state = l_get_db_state(db);
+    if (m_incrs.empty()) {
+        state->Write(db, wopt, &m_batch);
+        Clear();
+        return;
+    }
+    if (state != m_state) {
+        luaL_error(L, "batch with increments must be written to its own db");
+    }
+    // the increments apply on top of the batch's own writes, with their keys locked until the batch is written
+    uint64_t mask = state->KeyMask(&m_batch);
+    for (auto &it : m_incrs) {
+        mask |= state->m_key_locks.Mask(it.first);
+    }
+    Status s;
+    {
+        StripeGuard stripes(state->m_key_locks, mask);
+        vector<pair<string, int64_t>> values;
+        string data;
+        for (auto &it : m_incrs) {
+            int64_t base;
+            s = CounterBase(it.first, &base);
+            if (!s.ok()) {
+                break;
+            }
+            values.emplace_back(it.first, (int64_t)((uint64_t)base + (uint64_t)it.second));
+            encode_counter(values.back().second, &data);
+            m_batch.Put(it.first, data);
+        }
+        if (s.ok()) {
+            s = state->WriteLocked(db, wopt, &m_batch);
+        }
+        if (s.ok()) {
+            for (auto &it : values) {
+                state->m_counters->Store(it.first, it.second, false);
+            }
+        }
+    }
+    Clear();
+    if (!s.ok()) {
+        luaL_error(L, "lvldb_batch_write: %s", s.ToString().c_str());
+    }
+}
+
+void Batch::Write(lua_State *L, ShardedDB *db, const WriteOptions &wopt) {
+    std::lock_guard<MyMutex> guard(m_mutex);
+    if (!Flush() || (m_coalesce && !Coalesce())) {
+        luaL_error(L, "compress failed");
+    }
+    db->Write(wopt, &m_batch);
     Clear();
 }
 
@@ -131,6 +469,25 @@ void Batch::SetStringParam(lua_State *L, int idx, string &&value) {
     }
 }
 
+// false when the put must be rejected, in flush mode the batch is written out instead
+static bool check_memory_budget(lua_State *L, Batch &batch) {
+    MemoryAccountant &acct = MemoryAccountant::Instance();
+    if (batch.m_mem_bytes < BUDGET_BATCH_MIN_BYTES || !acct.OverBudget()) {
+        return true;
+    }
+    if (!acct.FlushOnBudget()) {
+        acct.RecordReject();
+        return false;
+    }
+    if (batch.m_sharded) {
+        batch.Write(L, batch.m_sharded, WriteOptions());
+    } else {
+        batch.Write(L, batch.m_db, WriteOptions());
+    }
+    acct.RecordFlush();
+    return true;
+}
+
 int lvldb_batch_put(lua_State *L) {
     Batch &batch = *(check_writebatch(L, 1));
     Slice key = lua_to_slice(L, 2);
@@ -140,22 +497,65 @@ int lvldb_batch_put(lua_State *L) {
         luaL_checktype(L, 4, LUA_TBOOLEAN);
         compress = lua_toboolean(L, 4);
     }
+    if (!check_memory_budget(L, batch)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "memory budget exceeded");
+        return 2;
+    }
     batch.Put(L, key, value, compress);
     return 1;
 }
 
+// batch:putMany({key = value, ...}, [compress]), returns the entry count
+int lvldb_batch_put_many(lua_State *L) {
+    Batch &batch = *(check_writebatch(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    bool compress = false;
+    if (lua_gettop(L) >= 3) {
+        luaL_checktype(L, 3, LUA_TBOOLEAN);
+        compress = lua_toboolean(L, 3);
+    }
+    if (!check_memory_budget(L, batch)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "memory budget exceeded");
+        return 2;
+    }
+    // held across the table so other threads see all of it or none
+    std::lock_guard<MyMutex> guard(batch.m_mutex);
+    lua_Integer count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+        Slice key = lua_to_entry_key(L, -2);
+        Slice value = lua_to_slice(L, -1);
+        batch.Put(L, key, value, compress);
+        count++;
+        lua_pop(L, 2);
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
 int lvldb_batch_get(lua_State *L) {
     Batch &batch = *(check_writebatch(L, 1));
     Slice key = lua_to_slice(L, 2);
     bool uncompress = false;
+    size_t inflateLimit = 0;
+    // batch:get(key, [decompress]) or batch:get(key, [readopts]) for decompress with inflateLimit
     if (lua_gettop(L) >= 3 && !lua_isnil(L, 3)) {
-        luaL_checktype(L, 3, LUA_TBOOLEAN);
-        uncompress = lua_toboolean(L, 3);
+        if (lua_type(L, 3) == LUA_TBOOLEAN) {
+            uncompress = lua_toboolean(L, 3);
+        } else {
+            MyReadOptions *ropt = check_read_options(L, 3);
+            uncompress = ropt->UnCompress;
+            inflateLimit = ropt->InflateLimit;
+        }
     }
-    if (!batch.Get(L, key, uncompress)) {
+    int n = batch.Get(L, key, uncompress, inflateLimit);
+    if (!n) {
         lua_pushnil(L);
+        return 1;
     }
-    return 1;
+    return n;
 }
 
 int traceback(lua_State *L) {
@@ -194,6 +594,57 @@ int lvldb_batch_set_need_lock(lua_State *L) {
     return 0;
 }
 
+int lvldb_batch_set_defer_compress(lua_State *L) {
+    Batch &batch = *(check_writebatch(L, 1));
+    luaL_checktype(L, 2, LUA_TBOOLEAN);
+    bool b = lua_toboolean(L, 2);
+    std::lock_guard<MyMutex> guard(batch.m_mutex);
+    if (!b && !batch.Flush()) {
+        luaL_error(L, "compress failed");
+    }
+    batch.m_defer_compress = b;
+    return 0;
+}
+
+// batch:set_coalesce(bool, [ordered]), only the final state of each key is written
+int lvldb_batch_set_coalesce(lua_State *L) {
+    Batch &batch = *(check_writebatch(L, 1));
+    luaL_checktype(L, 2, LUA_TBOOLEAN);
+    bool b = lua_toboolean(L, 2);
+    bool ordered = lua_toboolean(L, 3) != 0;
+    std::lock_guard<MyMutex> guard(batch.m_mutex);
+    // the ops logged so far would be written twice or lost
+    if (b != batch.m_coalesce && (!batch.m_upds.empty() || !batch.m_dels.empty() || !batch.m_incrs.empty())) {
+        return luaL_error(L, "coalescing can only be switched on an empty batch");
+    }
+    batch.m_coalesce = b;
+    batch.m_coalesce_ordered = ordered;
+    return 0;
+}
+
+int lvldb_batch_coalesce_stats(lua_State *L) {
+    Batch &batch = *(check_writebatch(L, 1));
+    std::lock_guard<MyMutex> guard(batch.m_mutex);
+    lua_createtable(L, 0, 8);
+    lua_pushboolean(L, batch.m_coalesce);
+    lua_setfield(L, -2, "enabled");
+    lua_pushboolean(L, batch.m_coalesce_ordered);
+    lua_setfield(L, -2, "ordered");
+    lua_pushinteger(L, (lua_Integer)batch.m_logged_ops);
+    lua_setfield(L, -2, "loggedOps");
+    lua_pushinteger(L, (lua_Integer)batch.m_emitted_ops);
+    lua_setfield(L, -2, "emittedOps");
+    lua_pushinteger(L, (lua_Integer)batch.m_logged_bytes);
+    lua_setfield(L, -2, "loggedBytes");
+    lua_pushinteger(L, (lua_Integer)batch.m_emitted_bytes);
+    lua_setfield(L, -2, "emittedBytes");
+    lua_pushinteger(L, (lua_Integer)(batch.m_logged_ops - batch.m_emitted_ops));
+    lua_setfield(L, -2, "savedOps");
+    lua_pushinteger(L, (lua_Integer)(batch.m_logged_bytes - batch.m_emitted_bytes));
+    lua_setfield(L, -2, "savedBytes");
+    return 1;
+}
+
 int lvldb_batch_int_param(lua_State *L) {
     Batch &batch = *(check_writebatch(L, 1));
     int idx = (int)luaL_checkinteger(L, 2);
@@ -230,6 +681,38 @@ int lvldb_batch_del(lua_State *L) {
     return 0;
 }
 
+// batch:deleteMany({key, ...}), returns the key count
+int lvldb_batch_del_many(lua_State *L) {
+    Batch &batch = *(check_writebatch(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    std::lock_guard<MyMutex> guard(batch.m_mutex);
+    lua_Integer n = (lua_Integer)lvldb_rawlen(L, 2);
+    for (lua_Integer i = 1; i <= n; i++) {
+        lua_rawgeti(L, 2, i);
+        batch.Delete(lua_to_slice(L, -1));
+        lua_pop(L, 1);
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+// batch:incr(key, [delta]), returns the value the counter will have once the batch is written
+int lvldb_batch_incr(lua_State *L) {
+    Batch &batch = *(check_writebatch(L, 1));
+    Slice key = lua_to_slice(L, 2);
+    int64_t delta = (int64_t)luaL_optinteger(L, 3, 1);
+    if (batch.m_sharded) {
+        return luaL_error(L, "incr is not supported by sharded batches");
+    }
+    int64_t value = 0;
+    Status s = batch.Incr(key, delta, &value);
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_batch_incr: %s", s.ToString().c_str());
+    }
+    lua_pushinteger(L, (lua_Integer)value);
+    return 1;
+}
+
 int lvldb_batch_clear(lua_State *L) {
     Batch &batch = *(check_writebatch(L, 1));
     batch.Clear();
@@ -257,46 +740,132 @@ int lvdb_batch_gc(lua_State *L) {
     return 0;
 }
 
+// a raw batch has no db to flush to, so over the budget it can only be rejected
+static bool raw_batch_over_budget(RawBatch &batch) {
+    if (batch.m_mem_bytes >= BUDGET_BATCH_MIN_BYTES && MemoryAccountant::Instance().OverBudget()) {
+        MemoryAccountant::Instance().RecordReject();
+        return true;
+    }
+    return false;
+}
+
+// returns the size of the value as stored
+static size_t raw_batch_put(lua_State *L, RawBatch &batch, const Slice &key, const Slice &val, bool compress) {
+    if (batch.m_defer_compress) {
+        batch.m_pending.push_back(PendingOp{ key.ToString(), val.ToString(), compress, false });
+        batch.m_pending_bytes += key.size() + val.size() + MEM_ENTRY_OVERHEAD;
+        return val.size();
+    }
+    if (!compress) {
+        batch.Put(key, val);
+        return val.size();
+    }
+    size_t outLen = 0;
+    void *p = tdefl_compress_mem_to_heap(val.data(), val.size(), &outLen, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+    if (!p) {
+        luaL_error(L, "compress failed");
+    }
+    batch.Put(key, Slice((const char *)p, outLen));
+    mz_free(p);
+    return outLen;
+}
+
+static void raw_batch_del(RawBatch &batch, const Slice &key) {
+    if (batch.m_defer_compress) {
+        batch.m_pending.push_back(PendingOp{ key.ToString(), string(), false, true });
+        batch.m_pending_bytes += key.size() + MEM_ENTRY_OVERHEAD;
+    } else {
+        batch.Delete(key);
+    }
+}
+
 int lvldb_raw_batch_put(lua_State *L) {
-    WriteBatch &batch = *(check_raw_writebatch(L, 1));
-    Slice key = lua_to_slice(L, 2);
+    RawBatch &batch = *(check_raw_writebatch(L, 1));
+    Slice key = batch.Key(lua_to_slice(L, 2));
     Slice val = lua_to_slice(L, 3);
     bool compress = false;
     if (lua_gettop(L) >= 4) {
         luaL_checktype(L, 4, LUA_TBOOLEAN);
         compress = lua_toboolean(L, 4);
     }
-    if (compress) {
-        size_t outLen = 0;
-        void *p = tdefl_compress_mem_to_heap(val.data(), val.size(), &outLen, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
-        if (!p) {
-            luaL_error(L, "compress failed");
-        }
-        batch.Put(key, Slice((const char *)p, outLen));
-        lua_pushinteger(L, outLen);
-        mz_free(p);
-    } else {
-        batch.Put(key, val);
-        lua_pushinteger(L, val.size());
+    if (raw_batch_over_budget(batch)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "memory budget exceeded");
+        return 2;
+    }
+    lua_pushinteger(L, raw_batch_put(L, batch, key, val, compress));
+    batch.Account();
+    return 1;
+}
+
+// rawbatch:putMany({key = value, ...}, [compress]), returns the entry count
+int lvldb_raw_batch_put_many(lua_State *L) {
+    RawBatch &batch = *(check_raw_writebatch(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    bool compress = false;
+    if (lua_gettop(L) >= 3) {
+        luaL_checktype(L, 3, LUA_TBOOLEAN);
+        compress = lua_toboolean(L, 3);
+    }
+    if (raw_batch_over_budget(batch)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "memory budget exceeded");
+        return 2;
+    }
+    lua_Integer count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+        Slice key = batch.Key(lua_to_entry_key(L, -2));
+        raw_batch_put(L, batch, key, lua_to_slice(L, -1), compress);
+        count++;
+        lua_pop(L, 1);
     }
+    batch.Account();
+    lua_pushinteger(L, count);
     return 1;
 }
 
 int lvldb_raw_batch_del(lua_State *L) {
-    WriteBatch &batch = *(check_raw_writebatch(L, 1));
-    Slice key = lua_to_slice(L, 2);
-    batch.Delete(key);
+    RawBatch &batch = *(check_raw_writebatch(L, 1));
+    raw_batch_del(batch, batch.Key(lua_to_slice(L, 2)));
+    batch.Account();
     return 0;
 }
 
+// rawbatch:deleteMany({key, ...}), returns the key count
+int lvldb_raw_batch_del_many(lua_State *L) {
+    RawBatch &batch = *(check_raw_writebatch(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer n = (lua_Integer)lvldb_rawlen(L, 2);
+    for (lua_Integer i = 1; i <= n; i++) {
+        lua_rawgeti(L, 2, i);
+        raw_batch_del(batch, batch.Key(lua_to_slice(L, -1)));
+        lua_pop(L, 1);
+    }
+    batch.Account();
+    lua_pushinteger(L, n);
+    return 1;
+}
+
 int lvldb_raw_batch_clear(lua_State *L) {
-    WriteBatch &batch = *(check_raw_writebatch(L, 1));
+    RawBatch &batch = *(check_raw_writebatch(L, 1));
     batch.Clear();
     return 0;
 }
 
+int lvldb_raw_batch_set_defer_compress(lua_State *L) {
+    RawBatch &batch = *(check_raw_writebatch(L, 1));
+    luaL_checktype(L, 2, LUA_TBOOLEAN);
+    bool b = lua_toboolean(L, 2);
+    if (!b && !batch.Flush()) {
+        luaL_error(L, "compress failed");
+    }
+    batch.m_defer_compress = b;
+    return 0;
+}
+
 int lvldb_raw_batch_gc(lua_State *L) {
-    WriteBatch *batch = check_raw_writebatch(L, 1);
-    batch->~WriteBatch();
+    RawBatch *batch = check_raw_writebatch(L, 1);
+    batch->~RawBatch();
     return 0;
 }
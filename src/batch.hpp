@@ -3,11 +3,50 @@
 
 #include "lib.hpp"
 #include "utils.hpp"
+#include "memory.hpp"
+#include <atomic>
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+
+class DbState;
 
 #define MAX_PARAM_NUM 32
+// deferred values below this total size are compressed on the calling thread
+#define DEFER_PARALLEL_MIN_BYTES (64 * 1024)
+// over the memory budget, puts into batches holding more than this fail or flush the batch
+#define BUDGET_BATCH_MIN_BYTES (1024 * 1024)
+
+struct PendingOp {
+    string key;
+    string value;
+    bool compress;
+    bool del;
+};
+
+bool compress_pending_ops(vector<PendingOp> &ops);
+void append_pending_ops(vector<PendingOp> &ops, WriteBatch &batch);
+
+class RawBatch : public WriteBatch {
+public:
+    RawBatch() : m_defer_compress(false), m_pending_bytes(0), m_mem_bytes(0) {}
+    ~RawBatch();
+    bool Flush();
+    void Clear();
+    // reports the change of the estimated footprint to the memory accountant
+    void Account();
+    // key with m_prefix prepended, valid until the next call
+    Slice Key(const Slice &key);
+
+    bool m_defer_compress;
+    vector<PendingOp> m_pending;
+    int64_t m_pending_bytes;
+    int64_t m_mem_bytes;
+    // set on batches created by ns:batch()
+    string m_prefix;
+    string m_key;
+};
 
 class MyMutex {
 public:
@@ -32,15 +71,28 @@ public:
     bool m_need_mutex;
 };
 
-class Batch {
+class ShardedDB;
+
+class Batch : public MemoryOwner {
 public:
     Batch(DB *db);
+    Batch(ShardedDB *db);
     ~Batch();
     void Put(lua_State *L, const Slice &key, Slice &val, bool compress);
     void Delete(const Slice &key);
+    Status Incr(const Slice &key, int64_t delta, int64_t *result);
     void Clear();
-    int Get(lua_State *L, const Slice &key, bool uncompress);
-    void Write(lua_State *L, DB *db);
+    // pushes nil, "inflateLimit exceeded" and returns 2 when uncompressing would exceed inflateLimit
+    int Get(lua_State *L, const Slice &key, bool uncompress, size_t inflateLimit = 0);
+    void Write(lua_State *L, DB *db, const WriteOptions &wopt);
+    void Write(lua_State *L, ShardedDB *db, const WriteOptions &wopt);
+    bool Flush();
+    // in coalescing mode, fills m_batch with the final state of each key from the overlay
+    bool Coalesce();
+    void Account();
+    virtual void MemoryUsage(int64_t *bytes);
+    // value the counter would have before this batch's increments
+    Status CounterBase(const string &key, int64_t *value);
     int GetIntParam(lua_State *L, int idx);
     int GetStringParam(lua_State *L, int idx);
     void SetIntParam(lua_State *L, int idx, int64_t value);
@@ -50,25 +102,55 @@ public:
     WriteBatch m_batch;
     unordered_set<string> m_dels;
     unordered_map<string, string> m_upds;
+    unordered_set<string> m_raws;
+    // counter deltas, resolved against the batch's own writes and the db at Write
+    unordered_map<string, int64_t> m_incrs;
+    vector<PendingOp> m_pending;
+    bool m_defer_compress;
+    // puts and deletes only update the overlay, m_batch is built from it at Write
+    bool m_coalesce;
+    bool m_coalesce_ordered;
+    // ops and bytes logged since the last write, and the totals over coalesced writes
+    uint64_t m_ops;
+    uint64_t m_op_bytes;
+    uint64_t m_logged_ops;
+    uint64_t m_logged_bytes;
+    uint64_t m_emitted_ops;
+    uint64_t m_emitted_bytes;
     int64_t m_int_param[MAX_PARAM_NUM];
     string m_str_param[MAX_PARAM_NUM];
     DB *m_db;
+    DbState *m_state;
+    ShardedDB *m_sharded;
+    // estimated footprint of m_batch, the overlay and the pending ops
+    int64_t m_overlay_bytes;
+    int64_t m_pending_bytes;
+    std::atomic<int64_t> m_mem_bytes;
 };
 
 int lvldb_batch_put(lua_State *L);
+int lvldb_batch_put_many(lua_State *L);
 int lvldb_batch_del(lua_State *L);
+int lvldb_batch_del_many(lua_State *L);
+int lvldb_batch_incr(lua_State *L);
 int lvldb_batch_get(lua_State *L);
 int lvldb_batch_clear(lua_State *L);
 int lvldb_batch_close(lua_State *L);
 int lvdb_batch_gc(lua_State *L);
 int lvldb_batch_lock(lua_State *L);
 int lvldb_batch_set_need_lock(lua_State *L);
+int lvldb_batch_set_defer_compress(lua_State *L);
+int lvldb_batch_set_coalesce(lua_State *L);
+int lvldb_batch_coalesce_stats(lua_State *L);
 int lvldb_batch_int_param(lua_State *L);
 int lvldb_batch_str_param(lua_State *L);
 int lvldb_batch_set_int_param(lua_State *L);
 int lvldb_batch_set_str_param(lua_State *L);
 
 int lvldb_raw_batch_put(lua_State *L);
+int lvldb_raw_batch_put_many(lua_State *L);
 int lvldb_raw_batch_del(lua_State *L);
+int lvldb_raw_batch_del_many(lua_State *L);
 int lvldb_raw_batch_clear(lua_State *L);
+int lvldb_raw_batch_set_defer_compress(lua_State *L);
 int lvldb_raw_batch_gc(lua_State *L);
@@ -0,0 +1,323 @@
+﻿#include "counter.hpp"
+#include "db.hpp"
+#include "env.hpp"
+#include "locks.hpp"
+#include "memory.hpp"
+#include "stall.hpp"
+#include "state.hpp"
+#include <chrono>
+
+// clean cached counters are dropped after a flush once the cache holds more than this
+#define COUNTER_CACHE_MAX 65536
+
+void encode_counter(int64_t value, string *dst) {
+    char buf[COUNTER_SIZE];
+    uint64_t v = (uint64_t)value;
+    for (int i = 0; i < COUNTER_SIZE; i++) {
+        buf[i] = char(v >> (i * 8));
+    }
+    dst->assign(buf, sizeof(buf));
+}
+
+bool decode_counter(const Slice &value, int64_t *out) {
+    if (value.size() != COUNTER_SIZE) {
+        return false;
+    }
+    uint64_t v = 0;
+    for (int i = COUNTER_SIZE - 1; i >= 0; i--) {
+        v = (v << 8) | (uint8_t)value[i];
+    }
+    *out = (int64_t)v;
+    return true;
+}
+
+Counters::Counters(DbState *state, DB *db, int flushMillis)
+    : m_state(state), m_db(db), m_flush_millis(flushMillis), m_dirty(0), m_incrs(0), m_flushes(0), m_flushed_keys(0), m_stop(false) {
+    if (m_flush_millis > 0) {
+        m_flush_thread = std::thread(&Counters::FlushLoop, this);
+    }
+}
+
+Counters::~Counters() {
+    Close();
+}
+
+void Counters::Close() {
+    {
+        std::lock_guard<std::mutex> guard(m_flush_wait_mutex);
+        m_stop = true;
+    }
+    m_flush_cond.notify_all();
+    if (m_flush_thread.joinable()) {
+        m_flush_thread.join();
+        size_t flushed;
+        Flush(&flushed);
+    }
+}
+
+bool Counters::Cached(const string &key, int64_t *value) {
+    std::lock_guard<std::mutex> guard(m_cache_mutex);
+    auto it = m_cache.find(key);
+    if (it == m_cache.end()) {
+        return false;
+    }
+    *value = it->second.value;
+    return true;
+}
+
+Status Counters::Load(const Slice &key, int64_t *value) {
+    if (Coalescing() && Cached(key.ToString(), value)) {
+        return Status::OK();
+    }
+    string data;
+    Status s = m_state->Get(m_db, ReadOptions(), key, &data);
+    if (s.IsNotFound()) {
+        *value = 0;
+        return Status::OK();
+    }
+    if (s.ok() && !decode_counter(data, value)) {
+        return Status::InvalidArgument("value is not a counter");
+    }
+    return s;
+}
+
+void Counters::Store(const Slice &key, int64_t value, bool dirty) {
+    if (!Coalescing()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(m_cache_mutex);
+    auto &c = m_cache[key.ToString()];
+    if (dirty && !c.dirty) {
+        m_dirty++;
+    } else if (!dirty && c.dirty) {
+        m_dirty--;
+    }
+    c.value = value;
+    c.dirty = dirty;
+}
+
+void Counters::Erase(const string &key) {
+    auto it = m_cache.find(key);
+    if (it == m_cache.end()) {
+        return;
+    }
+    if (it->second.dirty) {
+        m_dirty--;
+    }
+    m_cache.erase(it);
+}
+
+void Counters::Forget(const Slice &key) {
+    if (!Coalescing()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(m_cache_mutex);
+    Erase(key.ToString());
+}
+
+class BatchKeys : public WriteBatch::Handler {
+public:
+    void Put(const Slice &key, const Slice &value) override { m_keys.push_back(key); }
+    void Delete(const Slice &key) override { m_keys.push_back(key); }
+
+    vector<Slice> m_keys;
+};
+
+void Counters::Forget(WriteBatch *batch) {
+    if (!Coalescing()) {
+        return;
+    }
+    BatchKeys keys;
+    batch->Iterate(&keys);
+    std::lock_guard<std::mutex> guard(m_cache_mutex);
+    for (auto &key : keys.m_keys) {
+        Erase(key.ToString());
+    }
+}
+
+Status Counters::Incr(const WriteOptions &opt, const Slice &key, int64_t delta, int64_t *result) {
+    StripeGuard guard(m_state->m_key_locks, m_state->m_key_locks.Mask(key));
+    int64_t value;
+    Status s = Load(key, &value);
+    if (!s.ok()) {
+        return s;
+    }
+    // wraps around like the integers of Lua 5.3
+    value = (int64_t)((uint64_t)value + (uint64_t)delta);
+    if (Coalescing()) {
+        Store(key, value, true);
+    } else {
+        string data;
+        encode_counter(value, &data);
+        s = m_state->PutLocked(m_db, opt, key, data);
+        if (!s.ok()) {
+            return s;
+        }
+    }
+    m_incrs++;
+    *result = value;
+    return Status::OK();
+}
+
+Status Counters::Read(const Slice &key, int64_t *value) {
+    if (Coalescing() && Cached(key.ToString(), value)) {
+        return Status::OK();
+    }
+    string data;
+    Status s = m_state->Get(m_db, ReadOptions(), key, &data);
+    if (s.ok() && !decode_counter(data, value)) {
+        return Status::InvalidArgument("value is not a counter");
+    }
+    return s;
+}
+
+Status Counters::Flush(size_t *flushed) {
+    *flushed = 0;
+    if (!Coalescing()) {
+        return Status::OK();
+    }
+    uint64_t mask = 0;
+    {
+        std::lock_guard<std::mutex> guard(m_cache_mutex);
+        if (m_dirty == 0) {
+            return Status::OK();
+        }
+        for (auto &it : m_cache) {
+            if (it.second.dirty) {
+                mask |= m_state->m_key_locks.Mask(it.first);
+            }
+        }
+    }
+    // holding the stripes keeps a concurrent batch write from being overwritten by older values
+    StripeGuard stripes(m_state->m_key_locks, mask);
+    WriteBatch batch;
+    vector<std::pair<string, int64_t>> values;
+    {
+        std::lock_guard<std::mutex> guard(m_cache_mutex);
+        string data;
+        for (auto &it : m_cache) {
+            if (it.second.dirty && (mask & m_state->m_key_locks.Mask(it.first))) {
+                encode_counter(it.second.value, &data);
+                batch.Put(it.first, data);
+                values.emplace_back(it.first, it.second.value);
+            }
+        }
+    }
+    if (values.empty()) {
+        return Status::OK();
+    }
+    // the write drops the counters from the cache like any other put, they come back clean
+    Status s = m_state->WriteLocked(m_db, WriteOptions(), &batch);
+    if (!s.ok()) {
+        return s;
+    }
+    for (auto &it : values) {
+        Store(it.first, it.second, false);
+    }
+    std::lock_guard<std::mutex> guard(m_cache_mutex);
+    if (m_cache.size() > COUNTER_CACHE_MAX) {
+        for (auto it = m_cache.begin(); it != m_cache.end();) {
+            it = it->second.dirty ? std::next(it) : m_cache.erase(it);
+        }
+    }
+    m_flushes++;
+    m_flushed_keys += values.size();
+    *flushed = values.size();
+    return s;
+}
+
+void Counters::FlushLoop() {
+    std::unique_lock<std::mutex> lock(m_flush_wait_mutex);
+    while (!m_stop) {
+        m_flush_cond.wait_for(lock, std::chrono::milliseconds(m_flush_millis));
+        if (m_stop) {
+            break;
+        }
+        lock.unlock();
+        size_t flushed;
+        Flush(&flushed);
+        lock.lock();
+    }
+}
+
+size_t Counters::MemoryBytes() {
+    std::lock_guard<std::mutex> guard(m_cache_mutex);
+    size_t bytes = 0;
+    for (auto &it : m_cache) {
+        bytes += it.first.size() + sizeof(CachedCounter) + MEM_ENTRY_OVERHEAD;
+    }
+    return bytes;
+}
+
+void Counters::Push(lua_State *L) {
+    lua_createtable(L, 0, 6);
+    lua_pushboolean(L, Coalescing());
+    lua_setfield(L, -2, "coalescing");
+    lua_pushinteger(L, (lua_Integer)m_incrs.load());
+    lua_setfield(L, -2, "incrs");
+    lua_pushinteger(L, (lua_Integer)m_flushes.load());
+    lua_setfield(L, -2, "flushes");
+    lua_pushinteger(L, (lua_Integer)m_flushed_keys.load());
+    lua_setfield(L, -2, "flushedKeys");
+    std::lock_guard<std::mutex> guard(m_cache_mutex);
+    lua_pushinteger(L, (lua_Integer)m_cache.size());
+    lua_setfield(L, -2, "cached");
+    lua_pushinteger(L, (lua_Integer)m_dirty);
+    lua_setfield(L, -2, "dirty");
+}
+
+// ldb:incr(key, [delta], [writeopts]), returns the new value
+int lvldb_database_incr(lua_State *L) {
+    check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    Slice key = lua_to_slice(L, 2);
+    int64_t delta = (int64_t)luaL_optinteger(L, 3, 1);
+    auto wopt = lvldb_wopt(L, 4);
+    int64_t value = 0;
+    uint64_t start = now_micros();
+    Status s = state->m_counters->Incr(wopt, key, delta, &value);
+    if (!state->m_counters->Coalescing()) {
+        l_record_write(L, 1, now_micros() - start, wopt.sync);
+    }
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_incr: %s", s.ToString().c_str());
+    }
+    lua_pushinteger(L, (lua_Integer)value);
+    return 1;
+}
+
+// ldb:counter(key), nil when the key does not exist
+int lvldb_database_counter(lua_State *L) {
+    check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    Slice key = lua_to_slice(L, 2);
+    int64_t value = 0;
+    Status s = state->m_counters->Read(key, &value);
+    if (s.IsNotFound()) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_counter: %s", s.ToString().c_str());
+    }
+    lua_pushinteger(L, (lua_Integer)value);
+    return 1;
+}
+
+int lvldb_database_flush_counters(lua_State *L) {
+    check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    size_t flushed = 0;
+    Status s = state->m_counters->Flush(&flushed);
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_flush_counters: %s", s.ToString().c_str());
+    }
+    lua_pushinteger(L, (lua_Integer)flushed);
+    return 1;
+}
+
+int lvldb_database_counter_stats(lua_State *L) {
+    check_database(L, 1);
+    check_db_state(L, 1)->m_counters->Push(L);
+    return 1;
+}
@@ -0,0 +1,73 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+class DbState;
+
+// counters are stored as fixed 8 byte little-endian int64 values
+#define COUNTER_SIZE 8
+
+void encode_counter(int64_t value, string *dst);
+// false when the value is not a counter
+bool decode_counter(const Slice &value, int64_t *out);
+
+struct CachedCounter {
+    int64_t value;
+    bool dirty;
+};
+
+// read-modify-write of counter keys, serialized per key by DbState::m_key_locks.
+// With a flush interval the counters are kept in memory and written back in one batch periodically.
+class Counters {
+public:
+    Counters(DbState *state, DB *db, int flushMillis);
+    ~Counters();
+
+    void Close();
+    bool Coalescing() const { return m_flush_millis > 0; }
+
+    Status Incr(const WriteOptions &opt, const Slice &key, int64_t delta, int64_t *result);
+    // current value including unflushed increments, NotFound when the key does not exist
+    Status Read(const Slice &key, int64_t *value);
+    // writes back the dirty counters, returns how many were written
+    Status Flush(size_t *flushed);
+
+    // must hold the key's stripe, used by Batch::Write to resolve its increments
+    Status Load(const Slice &key, int64_t *value);
+    void Store(const Slice &key, int64_t value, bool dirty);
+    // drops the cached counters of keys overwritten by a put or delete, the
+    // stripes of the keys are held by the DbState write path calling these
+    void Forget(const Slice &key);
+    void Forget(WriteBatch *batch);
+
+    size_t MemoryBytes();
+    void Push(lua_State *L);
+
+private:
+    bool Cached(const string &key, int64_t *value);
+    void Erase(const string &key);
+    void FlushLoop();
+
+    DbState *m_state;
+    DB *m_db;
+    int m_flush_millis;
+    std::mutex m_cache_mutex;
+    std::unordered_map<string, CachedCounter> m_cache;
+    size_t m_dirty;
+    std::atomic<uint64_t> m_incrs;
+    std::atomic<uint64_t> m_flushes;
+    std::atomic<uint64_t> m_flushed_keys;
+    bool m_stop;
+    std::mutex m_flush_wait_mutex;
+    std::condition_variable m_flush_cond;
+    std::thread m_flush_thread;
+};
+
+int lvldb_database_incr(lua_State *L);
+int lvldb_database_counter(lua_State *L);
+int lvldb_database_flush_counters(lua_State *L);
+int lvldb_database_counter_stats(lua_State *L);
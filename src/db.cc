@@ -1,5 +1,9 @@
 ﻿#include "db.hpp"
 #include "batch.hpp"
+#include "env.hpp"
+#include "iter.hpp"
+#include "stall.hpp"
+#include "state.hpp"
 
 DB *check_database(lua_State *L, int index) {
     return *(DB **)luaL_checkudata(L, index, LVLDB_MT_DB);
@@ -7,34 +11,78 @@ DB *check_database(lua_State *L, int index) {
 
 int lvldb_database_put(lua_State *L) {
     DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
     Slice key = lua_to_slice(L, 2);
     Slice value = lua_to_slice(L, 3);
     auto wopt = lvldb_wopt(L, 4);
     Status s;
+    uint64_t start = now_micros();
     if (wopt.Compress) {
         size_t outLen = 0;
         void *p = tdefl_compress_mem_to_heap(value.data(), value.size(), &outLen, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
         if (!p) {
             luaL_error(L, "compress failed");
         }
-        s = db->Put(wopt, key, Slice((const char *)p, outLen));
+        s = state->Put(db, wopt, key, Slice((const char *)p, outLen));
         mz_free(p);
     } else {
-        s = db->Put(lvldb_wopt(L, 4), key, value);
+        s = state->Put(db, wopt, key, value);
     }
+    l_record_write(L, 1, now_micros() - start, wopt.sync);
     lua_pushboolean(L, s.ok());
     return 1;
 }
 
+// ldb:putMany({key = value, ...}, [writeopts]), one WriteBatch for the whole table, returns the entry count
+int lvldb_database_put_many(lua_State *L) {
+    DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    auto wopt = lvldb_wopt(L, 3);
+    WriteBatch batch;
+    vector<PendingOp> ops;
+    lua_Integer count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+        Slice key = lua_to_entry_key(L, -2);
+        Slice value = lua_to_slice(L, -1);
+        if (wopt.Compress) {
+            ops.push_back(PendingOp{ key.ToString(), value.ToString(), true, false });
+        } else {
+            batch.Put(key, value);
+        }
+        count++;
+        lua_pop(L, 1);
+    }
+    // compressed on the worker pool when the values are large enough
+    if (!compress_pending_ops(ops)) {
+        return luaL_error(L, "compress failed");
+    }
+    append_pending_ops(ops, batch);
+    uint64_t start = now_micros();
+    Status s = state->Write(db, wopt, &batch);
+    l_record_write(L, 1, now_micros() - start, wopt.sync);
+    if (!s.ok()) {
+        lua_pushnil(L);
+        lua_pushstring(L, s.ToString().c_str());
+        return 2;
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
 int lvldb_database_get(lua_State *L) {
     DB *db = check_database(L, 1);
     Slice key = lua_to_slice(L, 2);
     auto ropt = lvldb_ropt(L, 3);
     string value;
-    Status s = db->Get(ropt, key, &value);
+    Status s = check_db_state(L, 1)->Get(db, ropt, key, &value);
     if (s.ok()) {
         if (ropt.UnCompress) {
-            miniz_uncompress(L, value.c_str(), value.size());
+            if (!miniz_uncompress(L, value.c_str(), value.size(), ropt.InflateLimit)) {
+                lua_pushliteral(L, "inflateLimit exceeded");
+                return 2;
+            }
         } else {
             lua_pushlstring(L, value.c_str(), value.size());
         }
@@ -46,8 +94,17 @@ int lvldb_database_get(lua_State *L) {
 
 int lvldb_database_has(lua_State *L) {
     DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
     Slice key = lua_to_slice(L, 2);
-    Status s = db->Get(lvldb_ropt(L, 3), key, nullptr);
+    auto ropt = lvldb_ropt(L, 3);
+    if (!state->MayExist(ropt, key)) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    Status s = db->Get(ropt, key, nullptr);
+    if (s.IsNotFound()) {
+        state->RecordMiss(ropt);
+    }
     if (s.ok()) {
         lua_pushboolean(L, true);
     } else {
@@ -59,7 +116,10 @@ int lvldb_database_has(lua_State *L) {
 int lvldb_database_del(lua_State *L) {
     DB *db = check_database(L, 1);
     Slice key = lua_to_slice(L, 2);
-    Status s = db->Delete(lvldb_wopt(L, 3), key);
+    auto wopt = lvldb_wopt(L, 3);
+    uint64_t start = now_micros();
+    Status s = check_db_state(L, 1)->Delete(db, wopt, key);
+    l_record_write(L, 1, now_micros() - start, wopt.sync);
     if (s.ok())
         lua_pushboolean(L, true);
     else {
@@ -70,24 +130,28 @@ int lvldb_database_del(lua_State *L) {
 
 int lvldb_database_iterator(lua_State *L) {
     DB *db = check_database(L, 1);
-    Iterator *it = db->NewIterator(lvldb_ropt(L, 2));
-    *(Iterator **)lua_newuserdata(L, sizeof(Iterator **)) = it;
-    luaL_getmetatable(L, LVLDB_MT_ITER);
-    lua_setmetatable(L, -2);
+    auto ropt = lvldb_ropt(L, 2);
+    push_iter(L, check_db_state(L, 1)->NewIterator(db, ropt), ropt);
 
     return 1;
 }
 
 int lvldb_database_write(lua_State *L) {
     DB *db = check_database(L, 1);
+    auto wopt = lvldb_wopt(L, 3);
+    uint64_t start = now_micros();
     auto ppBatch = (Batch **)luaL_testudata(L, 2, LVLDB_MT_BATCH);
     if (ppBatch) {
-        (*ppBatch)->Write(L, db);
+        (*ppBatch)->Write(L, db, wopt);
     } else {
         auto rawbatch = check_raw_writebatch(L, 2);
-        db->Write(lvldb_wopt(L, 3), rawbatch);
+        if (!rawbatch->Flush()) {
+            luaL_error(L, "compress failed");
+        }
+        check_db_state(L, 1)->Write(db, wopt, rawbatch);
         rawbatch->Clear();
     }
+    l_record_write(L, 1, now_micros() - start, wopt.sync);
     return 0;
 }
 
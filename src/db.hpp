@@ -8,6 +8,7 @@
 DB *check_database(lua_State *L, int index);
 
 int lvldb_database_put(lua_State *L);
+int lvldb_database_put_many(lua_State *L);
 int lvldb_database_get(lua_State *L);
 int lvldb_database_has(lua_State *L);
 int lvldb_database_del(lua_State *L);
@@ -0,0 +1,133 @@
+﻿#include "delrange.hpp"
+#include "db.hpp"
+#include "state.hpp"
+
+static void compact_range(DB *db, const string &from, const string &to) {
+    Slice begin(from), end(to);
+    db->CompactRange(from.empty() ? nullptr : &begin, to.empty() ? nullptr : &end);
+}
+
+RangeDeleter::RangeDeleter() : m_state(nullptr), m_db(nullptr), m_stop(false), m_running(false), m_completed(0), m_failed(0), m_deleted(0) {}
+
+RangeDeleter::~RangeDeleter() {
+    Stop();
+}
+
+void RangeDeleter::Start(DbState *state, DB *db, const DeleteRangeJob &job) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_stop) {
+        return;
+    }
+    m_state = state;
+    m_db = db;
+    m_jobs.push_back(job);
+    if (!m_thread.joinable()) {
+        m_thread = std::thread(&RangeDeleter::Run, this);
+    }
+    m_cond.notify_one();
+}
+
+void RangeDeleter::Stop() {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stop = true;
+        m_jobs.clear();
+        m_cond.notify_one();
+    }
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void RangeDeleter::Run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+        if (m_jobs.empty()) {
+            m_cond.wait(lock);
+            continue;
+        }
+        DeleteRangeJob job = m_jobs.front();
+        m_jobs.pop_front();
+        m_running = true;
+        lock.unlock();
+        uint64_t deleted = 0;
+        Status s = m_state->DeleteRange(m_db, WriteOptions(), job.from, job.to, job.batchKeys, &deleted, &m_stop);
+        m_deleted += deleted;
+        if (s.ok() && job.compact && !m_stop) {
+            compact_range(m_db, job.from, job.to);
+        }
+        lock.lock();
+        m_running = false;
+        if (s.ok()) {
+            m_completed++;
+        } else {
+            m_failed++;
+            m_last_error = s.ToString();
+        }
+    }
+}
+
+void RangeDeleter::Push(lua_State *L) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    lua_createtable(L, 0, 6);
+    lua_pushboolean(L, m_running.load());
+    lua_setfield(L, -2, "running");
+    lua_pushinteger(L, (lua_Integer)m_jobs.size());
+    lua_setfield(L, -2, "pending");
+    lua_pushinteger(L, (lua_Integer)m_completed.load());
+    lua_setfield(L, -2, "completed");
+    lua_pushinteger(L, (lua_Integer)m_failed.load());
+    lua_setfield(L, -2, "failed");
+    lua_pushinteger(L, (lua_Integer)m_deleted.load());
+    lua_setfield(L, -2, "deleted");
+    if (!m_last_error.empty()) {
+        lua_pushlstring(L, m_last_error.data(), m_last_error.size());
+        lua_setfield(L, -2, "lastError");
+    }
+}
+
+// ldb:deleteRange(start, [limit], [{compact=, batchSize=, async=}]), deletes [start, limit)
+int lvldb_database_delete_range(lua_State *L) {
+    DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    DeleteRangeJob job;
+    job.from = lua_to_slice(L, 2).ToString();
+    if (!lua_isnoneornil(L, 3)) {
+        job.to = lua_to_slice(L, 3).ToString();
+    }
+    job.batchKeys = DELETE_RANGE_BATCH_KEYS;
+    job.compact = false;
+    bool async = false;
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        lua_Integer batchKeys = opt_int_field(L, 4, "batchSize", DELETE_RANGE_BATCH_KEYS);
+        luaL_argcheck(L, batchKeys > 0, 4, "batchSize must be positive");
+        job.batchKeys = (size_t)batchKeys;
+        job.compact = opt_bool_field(L, 4, "compact", false);
+        async = opt_bool_field(L, 4, "async", false);
+    }
+    if (!job.to.empty() && job.to <= job.from) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+    if (async) {
+        state->m_range_deleter.Start(state, db, job);
+        lua_pushboolean(L, true);
+        return 1;
+    }
+    uint64_t deleted = 0;
+    Status s = state->DeleteRange(db, WriteOptions(), job.from, job.to, job.batchKeys, &deleted);
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_delete_range: %s", s.ToString().c_str());
+    }
+    if (job.compact) {
+        compact_range(db, job.from, job.to);
+    }
+    lua_pushinteger(L, (lua_Integer)deleted);
+    return 1;
+}
+
+int lvldb_database_delete_range_stats(lua_State *L) {
+    check_db_state(L, 1)->m_range_deleter.Push(L);
+    return 1;
+}
@@ -0,0 +1,52 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+class DbState;
+
+// default keys per WriteBatch of a range delete
+#define DELETE_RANGE_BATCH_KEYS 10000
+// caps the batch when keys are large
+#define DELETE_RANGE_BATCH_BYTES (4 * 1024 * 1024)
+
+struct DeleteRangeJob {
+    string from;
+    string to;
+    size_t batchKeys;
+    bool compact;
+};
+
+// runs async range deletes one after another on a single background thread
+class RangeDeleter {
+public:
+    RangeDeleter();
+    ~RangeDeleter();
+
+    void Start(DbState *state, DB *db, const DeleteRangeJob &job);
+    // abandons queued jobs and interrupts the running one between batches
+    void Stop();
+    void Push(lua_State *L);
+
+private:
+    void Run();
+
+    DbState *m_state;
+    DB *m_db;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<DeleteRangeJob> m_jobs;
+    std::thread m_thread;
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_running;
+    std::atomic<uint64_t> m_completed;
+    std::atomic<uint64_t> m_failed;
+    std::atomic<uint64_t> m_deleted;
+    string m_last_error;
+};
+
+int lvldb_database_delete_range(lua_State *L);
+int lvldb_database_delete_range_stats(lua_State *L);
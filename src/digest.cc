@@ -0,0 +1,230 @@
+﻿#include "digest.hpp"
+#include "db.hpp"
+#include "pool.hpp"
+#include "range.hpp"
+#include "state.hpp"
+#include <algorithm>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+
+#define DIGEST_DEFAULT_BUCKETS 16
+#define DIGEST_MAX_BUCKETS 65536
+
+static const uint64_t XXH_PRIME64_1 = 11400714785074694791ull;
+static const uint64_t XXH_PRIME64_2 = 14029467366897019727ull;
+static const uint64_t XXH_PRIME64_3 = 1609587929392839161ull;
+static const uint64_t XXH_PRIME64_4 = 9650029242287828579ull;
+static const uint64_t XXH_PRIME64_5 = 2870177450012600261ull;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t xxhash64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += (uint64_t)len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+struct DigestBucket {
+    DigestBucket() : hash(0), count(0), bytes(0) {}
+
+    uint64_t hash;
+    uint64_t count;
+    uint64_t bytes;
+    Status status;
+};
+
+static void digest_range(DbState *state, DB *db, const ReadOptions &ropt, const string &from, const string &to, DigestBucket &b) {
+    // values are read through the value log, copies may place them differently
+    std::unique_ptr<Iterator> it(state->NewIterator(db, ropt));
+    uint64_t acc = 0;
+    for (it->Seek(from); it->Valid(); it->Next()) {
+        Slice key = it->key();
+        if (!to.empty() && key.compare(to) >= 0) {
+            break;
+        }
+        Slice value = it->value();
+        // the key length seeds the value hash, so the key/value split is part of the digest
+        uint64_t h = xxhash64(key.data(), key.size(), key.size());
+        h = xxhash64(value.data(), value.size(), h);
+        // ordered fold, the same records in another order digest differently
+        acc = rotl64(acc ^ h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        b.count++;
+        b.bytes += key.size() + value.size();
+    }
+    b.status = it->status();
+    b.hash = xxhash64(&acc, sizeof(acc), b.count);
+}
+
+static void push_hex(lua_State *L, uint64_t h) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+    lua_pushlstring(L, buf, 16);
+}
+
+static void push_hashes(lua_State *L, const vector<uint64_t> &hashes) {
+    lua_createtable(L, (int)hashes.size(), 0);
+    for (size_t i = 0; i < hashes.size(); i++) {
+        push_hex(L, hashes[i]);
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+}
+
+// ldb:digest{from=, to=, buckets=N, parallel=N} or ldb:digest{bounds={...}}
+int lvldb_database_digest(lua_State *L) {
+    DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    size_t parallel = (size_t)opt_int_field(L, 2, "parallel", WorkerPool::Instance().Size() + 1);
+    if (parallel == 0) {
+        parallel = 1;
+    }
+
+    vector<string> bounds;
+    lua_getfield(L, 2, "bounds");
+    if (!lua_isnil(L, -1)) {
+        // bounds from another copy's digest, so the buckets line up
+        luaL_argcheck(L, lua_istable(L, -1), 2, "bounds must be a table");
+        int n = (int)lvldb_rawlen(L, -1);
+        for (int i = 1; i <= n; i++) {
+            lua_rawgeti(L, -1, i);
+            bounds.push_back(lua_to_slice(L, -1).ToString());
+            lua_pop(L, 1);
+        }
+        luaL_argcheck(L, bounds.size() >= 2, 2, "bounds needs at least 2 keys");
+    }
+    lua_pop(L, 1);
+    string from = opt_string_field(L, 2, "from");
+    string to = opt_string_field(L, 2, "to");
+    lua_Integer buckets = opt_int_field(L, 2, "buckets", DIGEST_DEFAULT_BUCKETS);
+    luaL_argcheck(L, buckets >= 1 && buckets <= DIGEST_MAX_BUCKETS, 2, "buckets out of range");
+
+    ReadOptions ropt;
+    ropt.fill_cache = false;
+    ropt.snapshot = state->GetSnapshot(db);
+    if (bounds.empty()) {
+        bounds = split_range(db, ropt, from, to, (size_t)buckets);
+    }
+
+    vector<DigestBucket> results(bounds.size() - 1);
+    WorkerPool::Instance().ParallelFor(results.size(), [&](size_t i) {
+        digest_range(state, db, ropt, bounds[i], bounds[i + 1], results[i]);
+    }, parallel);
+    state->ReleaseSnapshot(db, ropt.snapshot);
+
+    vector<vector<uint64_t>> levels(1);
+    uint64_t count = 0, bytes = 0;
+    for (auto &r : results) {
+        if (!r.status.ok()) {
+            return luaL_error(L, "lvldb_digest: %s", r.status.ToString().c_str());
+        }
+        levels[0].push_back(r.hash);
+        count += r.count;
+        bytes += r.bytes;
+    }
+    // binary merkle tree, an odd node is rehashed alone into the next level
+    while (levels.back().size() > 1) {
+        const vector<uint64_t> &below = levels.back();
+        vector<uint64_t> above;
+        for (size_t i = 0; i < below.size(); i += 2) {
+            size_t n = std::min<size_t>(2, below.size() - i);
+            above.push_back(xxhash64(&below[i], n * sizeof(uint64_t), n));
+        }
+        levels.push_back(std::move(above));
+    }
+
+    lua_createtable(L, 0, 8);
+    push_hex(L, levels.back()[0]);
+    lua_setfield(L, -2, "root");
+    lua_createtable(L, (int)bounds.size(), 0);
+    for (size_t i = 0; i < bounds.size(); i++) {
+        lua_pushlstring(L, bounds[i].data(), bounds[i].size());
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    lua_setfield(L, -2, "bounds");
+    push_hashes(L, levels[0]);
+    lua_setfield(L, -2, "hashes");
+    lua_createtable(L, (int)results.size(), 0);
+    for (size_t i = 0; i < results.size(); i++) {
+        lua_pushinteger(L, (lua_Integer)results[i].count);
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    lua_setfield(L, -2, "counts");
+    // tree[1] is the root level, tree[#tree] the bucket hashes
+    lua_createtable(L, (int)levels.size(), 0);
+    for (size_t i = 0; i < levels.size(); i++) {
+        push_hashes(L, levels[levels.size() - 1 - i]);
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    lua_setfield(L, -2, "tree");
+    lua_pushinteger(L, (lua_Integer)count);
+    lua_setfield(L, -2, "keys");
+    lua_pushinteger(L, (lua_Integer)bytes);
+    lua_setfield(L, -2, "bytes");
+    return 1;
+}
@@ -0,0 +1,8 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "utils.hpp"
+
+// xxHash64 of data, little-endian hosts only
+uint64_t xxhash64(const void *data, size_t len, uint64_t seed);
+
+int lvldb_database_digest(lua_State *L);
@@ -0,0 +1,477 @@
+﻿#include "dump.hpp"
+#include "db.hpp"
+#include "pool.hpp"
+#include "range.hpp"
+#include "state.hpp"
+#include <leveldb/env.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// File layout:
+//   header:  "LVLDBDMP" fixed32(version)
+//   chunk:   fixed32(magic) fixed32(flags) fixed32(count) fixed32(rawLen) fixed32(storedLen) fixed32(crc32) payload
+//   payload: { fixed32(klen) fixed32(vlen) key value } * count, deflated when DUMP_FLAG_COMPRESS is set
+// Chunks of different key ranges are interleaved in any order, the last chunk
+// carries DUMP_FLAG_END and the total record count.
+
+#define CHUNK_HEADER_SIZE 24
+
+static void put_fixed32(string &dst, uint32_t v) {
+    char buf[4] = { char(v), char(v >> 8), char(v >> 16), char(v >> 24) };
+    dst.append(buf, 4);
+}
+
+static uint32_t get_fixed32(const char *p) {
+    const uint8_t *u = (const uint8_t *)p;
+    return uint32_t(u[0]) | uint32_t(u[1]) << 8 | uint32_t(u[2]) << 16 | uint32_t(u[3]) << 24;
+}
+
+static void push_stats(lua_State *L, uint64_t keys, uint64_t bytes, uint64_t fileBytes, uint64_t chunks, std::chrono::steady_clock::time_point start) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    lua_newtable(L);
+    lua_pushinteger(L, keys);
+    lua_setfield(L, -2, "keys");
+    lua_pushinteger(L, bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, fileBytes);
+    lua_setfield(L, -2, "fileBytes");
+    lua_pushinteger(L, chunks);
+    lua_setfield(L, -2, "chunks");
+    lua_pushinteger(L, ms);
+    lua_setfield(L, -2, "elapsed");
+    lua_pushnumber(L, ms > 0 ? bytes / 1048576.0 / (ms / 1000.0) : 0);
+    lua_setfield(L, -2, "mbps");
+}
+
+class DumpWriter {
+public:
+    DumpWriter(FILE *fp, bool compress) : m_fp(fp), m_compress(compress), m_keys(0), m_bytes(0), m_file_bytes(0), m_chunks(0) {}
+
+    bool Emit(string &payload, uint32_t count, uint32_t flags = 0) {
+        string header;
+        const char *data = payload.data();
+        size_t len = payload.size();
+        if (len > UINT32_MAX) {
+            SetError("record too large for a chunk");
+            return false;
+        }
+        void *p = nullptr;
+        if (m_compress && len > 0) {
+            p = tdefl_compress_mem_to_heap(data, len, &len, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+            if (!p) {
+                SetError("compress failed");
+                return false;
+            }
+            data = (const char *)p;
+            flags |= DUMP_FLAG_COMPRESS;
+            if (len > UINT32_MAX) {
+                mz_free(p);
+                SetError("record too large for a chunk");
+                return false;
+            }
+        }
+        put_fixed32(header, DUMP_CHUNK_MAGIC);
+        put_fixed32(header, flags);
+        put_fixed32(header, count);
+        put_fixed32(header, (uint32_t)payload.size());
+        put_fixed32(header, (uint32_t)len);
+        put_fixed32(header, (uint32_t)mz_crc32(MZ_CRC32_INIT, (const unsigned char *)data, len));
+
+        bool ok;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            ok = fwrite(header.data(), 1, header.size(), m_fp) == header.size() && fwrite(data, 1, len, m_fp) == len;
+            if (ok && !(flags & DUMP_FLAG_END)) {
+                m_keys += count;
+                m_bytes += payload.size();
+                m_chunks++;
+            }
+            m_file_bytes += header.size() + len;
+        }
+        if (p) {
+            mz_free(p);
+        }
+        if (!ok) {
+            SetError("write failed");
+        }
+        payload.clear();
+        return ok;
+    }
+
+    void SetError(const string &err) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_error.empty()) {
+            m_error = err;
+        }
+    }
+
+    FILE *m_fp;
+    bool m_compress;
+    std::mutex m_mutex;
+    string m_error;
+    uint64_t m_keys;
+    uint64_t m_bytes;
+    uint64_t m_file_bytes;
+    uint64_t m_chunks;
+};
+
+static void export_range(DB *db, DbState *state, const ReadOptions &ropt, const string &from, const string &to, size_t chunkSize, DumpWriter &writer) {
+    std::unique_ptr<Iterator> it(state->NewIterator(db, ropt));
+    string payload;
+    uint32_t count = 0;
+    for (it->Seek(from); it->Valid(); it->Next()) {
+        Slice key = it->key();
+        if (!to.empty() && key.compare(to) >= 0) {
+            break;
+        }
+        Slice val = it->value();
+        put_fixed32(payload, (uint32_t)key.size());
+        put_fixed32(payload, (uint32_t)val.size());
+        payload.append(key.data(), key.size());
+        payload.append(val.data(), val.size());
+        ++count;
+        if (payload.size() >= chunkSize) {
+            if (!writer.Emit(payload, count)) {
+                return;
+            }
+            count = 0;
+        }
+    }
+    if (!it->status().ok()) {
+        writer.SetError(it->status().ToString());
+        return;
+    }
+    if (count > 0) {
+        writer.Emit(payload, count);
+    }
+}
+
+// ldb:export(file, {snapshot=true, compress=false, ranges={{from=, to=}, ...}, parallel=N, chunkSize=N})
+int lvldb_database_export(lua_State *L) {
+    DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    const char *filename = luaL_checkstring(L, 2);
+    bool snapshot = true, compress = false;
+    size_t parallel = WorkerPool::Instance().Size() + 1;
+    size_t chunkSize = DUMP_CHUNK_SIZE;
+    vector<std::pair<string, string>> ranges;
+    if (lua_gettop(L) >= 3 && !lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        snapshot = opt_bool_field(L, 3, "snapshot", true);
+        compress = opt_bool_field(L, 3, "compress", false);
+        parallel = (size_t)opt_int_field(L, 3, "parallel", parallel);
+        lua_Integer size = opt_int_field(L, 3, "chunkSize", chunkSize);
+        luaL_argcheck(L, size > 0 && size <= DUMP_MAX_CHUNK_SIZE, 3, "chunkSize out of range");
+        chunkSize = (size_t)size;
+        lua_getfield(L, 3, "ranges");
+        if (!lua_isnil(L, -1)) {
+            luaL_checktype(L, -1, LUA_TTABLE);
+            int top = lua_gettop(L);
+            for (lua_Integer i = 1;; i++) {
+                lua_rawgeti(L, top, i);
+                if (lua_isnil(L, -1)) {
+                    break;
+                }
+                luaL_checktype(L, -1, LUA_TTABLE);
+                ranges.push_back(std::make_pair(opt_string_field(L, top + 1, "from"), opt_string_field(L, top + 1, "to")));
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    if (ranges.empty()) {
+        ranges.push_back(std::make_pair(string(), string()));
+    }
+    if (parallel == 0) {
+        parallel = 1;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        return luaL_error(L, "lvldb_export: cannot open %s", filename);
+    }
+    auto start = std::chrono::steady_clock::now();
+    ReadOptions ropt;
+    ropt.fill_cache = false;
+    if (snapshot) {
+        ropt.snapshot = state->GetSnapshot(db);
+    }
+
+    vector<std::pair<string, string>> parts;
+    for (auto &r : ranges) {
+        auto bounds = split_range(db, ropt, r.first, r.second, parallel);
+        for (size_t i = 0; i + 1 < bounds.size(); i++) {
+            parts.push_back(std::make_pair(bounds[i], bounds[i + 1]));
+        }
+    }
+
+    DumpWriter writer(fp, compress);
+    string header(DUMP_MAGIC);
+    put_fixed32(header, DUMP_VERSION);
+    if (fwrite(header.data(), 1, header.size(), fp) != header.size()) {
+        writer.SetError("write failed");
+    } else {
+        writer.m_file_bytes += header.size();
+        WorkerPool::Instance().ParallelFor(parts.size(), [&](size_t i) {
+            export_range(db, state, ropt, parts[i].first, parts[i].second, chunkSize, writer);
+        }, parallel);
+    }
+    if (ropt.snapshot) {
+        state->ReleaseSnapshot(db, ropt.snapshot);
+    }
+    if (writer.m_error.empty()) {
+        string empty;
+        writer.m_compress = false;
+        writer.Emit(empty, (uint32_t)writer.m_keys, DUMP_FLAG_END);
+    }
+    if (fclose(fp) != 0) {
+        writer.SetError("write failed");
+    }
+    if (!writer.m_error.empty()) {
+        return luaL_error(L, "lvldb_export: %s", writer.m_error.c_str());
+    }
+    push_stats(L, writer.m_keys, writer.m_bytes, writer.m_file_bytes, writer.m_chunks, start);
+    return 1;
+}
+
+struct DumpChunk {
+    uint32_t flags;
+    uint32_t count;
+    uint32_t rawLen;
+    uint32_t crc;
+    string data;
+};
+
+static bool apply_chunk(DB *db, DbState *state, DumpChunk &chunk, string &err) {
+    if (mz_crc32(MZ_CRC32_INIT, (const unsigned char *)chunk.data.data(), chunk.data.size()) != chunk.crc) {
+        err = "checksum mismatch";
+        return false;
+    }
+    if (chunk.flags & DUMP_FLAG_COMPRESS) {
+        // bounded by rawLen, a stream inflating to more fails instead of growing the buffer
+        string raw(chunk.rawLen, '\0');
+        size_t outLen = tinfl_decompress_mem_to_mem(raw.empty() ? nullptr : &raw[0], raw.size(), chunk.data.data(), chunk.data.size(), TINFL_FLAG_PARSE_ZLIB_HEADER);
+        if (outLen == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED || outLen != chunk.rawLen) {
+            err = "decompress failed";
+            return false;
+        }
+        chunk.data.swap(raw);
+    }
+    WriteBatch batch;
+    const char *p = chunk.data.data();
+    const char *end = p + chunk.data.size();
+    for (uint32_t i = 0; i < chunk.count; i++) {
+        if (end - p < 8) {
+            err = "corrupted chunk";
+            return false;
+        }
+        uint32_t klen = get_fixed32(p);
+        uint32_t vlen = get_fixed32(p + 4);
+        p += 8;
+        if ((uint64_t)(end - p) < (uint64_t)klen + vlen) {
+            err = "corrupted chunk";
+            return false;
+        }
+        batch.Put(Slice(p, klen), Slice(p + klen, vlen));
+        p += klen + vlen;
+    }
+    // synced, the watermark written after the group must not get ahead of what is durable
+    WriteOptions wopt;
+    wopt.sync = true;
+    Status s = state->Write(db, wopt, &batch);
+    if (!s.ok()) {
+        err = s.ToString();
+        return false;
+    }
+    return true;
+}
+
+// fseek takes a long, which is 32 bits on Windows
+static bool seek_file(FILE *fp, uint64_t offset) {
+#if defined(_MSC_VER)
+    return _fseeki64(fp, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(fp, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static uint64_t file_size(FILE *fp) {
+#if defined(_MSC_VER)
+    __int64 pos = _ftelli64(fp);
+    __int64 size = _fseeki64(fp, 0, SEEK_END) == 0 ? _ftelli64(fp) : -1;
+    _fseeki64(fp, pos, SEEK_SET);
+#else
+    off_t pos = ftello(fp);
+    off_t size = fseeko(fp, 0, SEEK_END) == 0 ? ftello(fp) : -1;
+    fseeko(fp, pos, SEEK_SET);
+#endif
+    return size < 0 ? 0 : (uint64_t)size;
+}
+
+static bool read_progress(const string &progress, const string &file, uint64_t &offset, uint64_t &keys) {
+    string content;
+    if (!ReadFileToString(Env::Default(), progress, &content).ok()) {
+        return false;
+    }
+    size_t nl = content.find('\n');
+    unsigned long long off = 0, n = 0;
+    if (nl == string::npos || content.compare(0, nl, file) != 0 || sscanf(content.c_str() + nl + 1, "%llu %llu", &off, &n) != 2) {
+        return false;
+    }
+    offset = off;
+    keys = n;
+    return true;
+}
+
+// written to a temporary file and renamed, a crash leaves the old watermark or the new one
+static void write_progress(const string &progress, const string &file, uint64_t offset, uint64_t keys) {
+    Env *env = Env::Default();
+    char line[64];
+    snprintf(line, sizeof(line), "\n%llu %llu\n", (unsigned long long)offset, (unsigned long long)keys);
+    string tmp = progress + ".tmp";
+    WritableFile *raw = nullptr;
+    Status s = env->NewWritableFile(tmp, &raw);
+    if (!s.ok()) {
+        return;
+    }
+    std::unique_ptr<WritableFile> fp(raw);
+    s = fp->Append(file + line);
+    if (s.ok()) {
+        s = fp->Sync();
+    }
+    if (s.ok()) {
+        s = fp->Close();
+    }
+    fp.reset();
+    if (s.ok()) {
+        s = env->RenameFile(tmp, progress);
+    }
+    if (!s.ok()) {
+        env->DeleteFile(tmp);
+    }
+}
+
+// lualeveldb.import(file, path [, options])
+int lvldb_import(lua_State *L) {
+    const char *filename = luaL_checkstring(L, 1);
+    string path = luaL_checkstring(L, 2);
+    MyOptions opt = MyOptions();
+    if (lua_gettop(L) >= 3) {
+        opt = *check_options(L, 3);
+    } else {
+        opt.create_if_missing = true;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return luaL_error(L, "lvldb_import: cannot open %s", filename);
+    }
+    char header[12];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, DUMP_MAGIC, 8) != 0 || get_fixed32(header + 8) != DUMP_VERSION) {
+        fclose(fp);
+        return luaL_error(L, "lvldb_import: %s is not an export file", filename);
+    }
+    uint64_t fileSize = file_size(fp);
+
+    DB *db;
+    DbState *state;
+    Status s = l_open_db(opt, path, &db, &state);
+    if (!s.ok()) {
+        fclose(fp);
+        return luaL_error(L, "lvldb_import: Error opening creating database: %s", s.ToString().c_str());
+    }
+
+    // chunks are re-applied idempotently, so the watermark only has to cover fully written groups
+    string progress = path + "/IMPORT-PROGRESS";
+    uint64_t offset = sizeof(header);
+    uint64_t keys = 0;
+    if (read_progress(progress, filename, offset, keys) && !seek_file(fp, offset)) {
+        offset = sizeof(header);
+        keys = 0;
+        seek_file(fp, offset);
+    }
+    uint64_t resumed = offset > sizeof(header) ? offset : 0;
+
+    auto start = std::chrono::steady_clock::now();
+    size_t group = WorkerPool::Instance().Size() + 1;
+    uint64_t bytes = 0, fileBytes = 0, chunks = 0;
+    string err;
+    bool finished = false;
+    while (err.empty() && !finished) {
+        vector<DumpChunk> pending;
+        while (pending.size() < group) {
+            char h[CHUNK_HEADER_SIZE];
+            size_t n = fread(h, 1, sizeof(h), fp);
+            if (n == 0 && feof(fp)) {
+                err = "incomplete export file";
+                break;
+            }
+            if (n != sizeof(h) || get_fixed32(h) != DUMP_CHUNK_MAGIC) {
+                err = "corrupted chunk header";
+                break;
+            }
+            DumpChunk chunk;
+            chunk.flags = get_fixed32(h + 4);
+            chunk.count = get_fixed32(h + 8);
+            chunk.rawLen = get_fixed32(h + 12);
+            chunk.crc = get_fixed32(h + 20);
+            if (chunk.flags & DUMP_FLAG_END) {
+                finished = true;
+                break;
+            }
+            // lengths come from the file, checked before anything is allocated for them
+            uint32_t storedLen = get_fixed32(h + 16);
+            bool compressed = (chunk.flags & DUMP_FLAG_COMPRESS) != 0;
+            if (storedLen > fileSize - std::min(fileSize, offset + (uint64_t)sizeof(h)) || storedLen > DUMP_MAX_CHUNK_BYTES ||
+                chunk.rawLen > DUMP_MAX_CHUNK_BYTES || (!compressed && storedLen != chunk.rawLen)) {
+                err = "corrupted chunk length";
+                break;
+            }
+            chunk.data.resize(storedLen);
+            if (!chunk.data.empty() && fread(&chunk.data[0], 1, chunk.data.size(), fp) != chunk.data.size()) {
+                err = "truncated chunk";
+                break;
+            }
+            fileBytes += sizeof(h) + chunk.data.size();
+            offset += sizeof(h) + chunk.data.size();
+            pending.push_back(std::move(chunk));
+        }
+
+        std::mutex mutex;
+        WorkerPool::Instance().ParallelFor(pending.size(), [&](size_t i) {
+            string e;
+            if (!apply_chunk(db, state, pending[i], e)) {
+                std::lock_guard<std::mutex> guard(mutex);
+                err = e;
+            }
+        });
+        if (!pending.empty() && err.empty()) {
+            for (auto &c : pending) {
+                keys += c.count;
+                bytes += c.rawLen;
+            }
+            chunks += pending.size();
+            write_progress(progress, filename, offset, keys);
+        }
+    }
+    fclose(fp);
+    if (finished) {
+        remove(progress.c_str());
+    }
+    l_unregister_db(db, [](void *db) {
+        delete (DB *)db;
+    });
+    if (!err.empty()) {
+        return luaL_error(L, "lvldb_import: %s", err.c_str());
+    }
+    push_stats(L, keys, bytes, fileBytes, chunks, start);
+    lua_pushinteger(L, (lua_Integer)resumed);
+    lua_setfield(L, -2, "resumed");
+    return 1;
+}
@@ -0,0 +1,19 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "utils.hpp"
+
+#define DUMP_MAGIC "LVLDBDMP"
+#define DUMP_VERSION 1
+#define DUMP_CHUNK_MAGIC 0x4b4e4843 // "CHNK"
+#define DUMP_CHUNK_SIZE (4 * 1024 * 1024)
+// chunk lengths are fixed32, a chunk ends after the record that reaches chunkSize
+#define DUMP_MAX_CHUNK_SIZE (1024 * 1024 * 1024)
+// import rejects chunks claiming more, the largest chunkSize plus the record that crossed it
+#define DUMP_MAX_CHUNK_BYTES (2ULL * DUMP_MAX_CHUNK_SIZE)
+
+// chunk flags
+#define DUMP_FLAG_COMPRESS 1
+#define DUMP_FLAG_END 2
+
+int lvldb_database_export(lua_State *L);
+int lvldb_import(lua_State *L);
@@ -0,0 +1,381 @@
+﻿#include "env.hpp"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <thread>
+
+static const char *const file_type_names[IO_FILE_TYPES] = { "wal", "sst", "manifest", "other" };
+static const char *const op_type_names[IO_OP_TYPES] = { "read", "write", "sync", "open" };
+
+uint64_t now_micros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool ends_with(const string &s, const char *suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+IoFileType io_file_type(const string &fname) {
+    auto pos = fname.find_last_of("/\\");
+    string base = pos == string::npos ? fname : fname.substr(pos + 1);
+    if (ends_with(base, ".log")) {
+        return IO_WAL;
+    }
+    if (ends_with(base, ".ldb") || ends_with(base, ".sst")) {
+        return IO_SST;
+    }
+    if (base.compare(0, 9, "MANIFEST-") == 0) {
+        return IO_MANIFEST;
+    }
+    return IO_OTHER;
+}
+
+class IoSequentialFile : public SequentialFile {
+public:
+    IoSequentialFile(IoStatsEnv *env, IoFileType type, SequentialFile *file) : m_env(env), m_type(type), m_file(file) {}
+    ~IoSequentialFile() { delete m_file; }
+
+    Status Read(size_t n, Slice *result, char *scratch) override {
+        uint64_t start = now_micros();
+        Status s = m_file->Read(n, result, scratch);
+        m_env->Record(m_type, IO_READ, result->size(), now_micros() - start);
+        return s;
+    }
+
+    Status Skip(uint64_t n) override { return m_file->Skip(n); }
+
+private:
+    IoStatsEnv *m_env;
+    IoFileType m_type;
+    SequentialFile *m_file;
+};
+
+class IoRandomAccessFile : public RandomAccessFile {
+public:
+    IoRandomAccessFile(IoStatsEnv *env, IoFileType type, RandomAccessFile *file) : m_env(env), m_type(type), m_file(file) {}
+    ~IoRandomAccessFile() { delete m_file; }
+
+    Status Read(uint64_t offset, size_t n, Slice *result, char *scratch) const override {
+        uint64_t start = now_micros();
+        Status s = m_file->Read(offset, n, result, scratch);
+        m_env->Record(m_type, IO_READ, result->size(), now_micros() - start);
+        return s;
+    }
+
+private:
+    IoStatsEnv *m_env;
+    IoFileType m_type;
+    RandomAccessFile *m_file;
+};
+
+// flushes are counted as write ops without bytes, that's where buffered appends hit the disk
+class IoWritableFile : public WritableFile {
+public:
+    IoWritableFile(IoStatsEnv *env, IoFileType type, WritableFile *file) : m_env(env), m_type(type), m_file(file) {}
+    ~IoWritableFile() { delete m_file; }
+
+    Status Append(const Slice &data) override {
+        uint64_t start = now_micros();
+        Status s = m_file->Append(data);
+        m_env->Record(m_type, IO_WRITE, data.size(), now_micros() - start);
+        return s;
+    }
+
+    Status Close() override { return m_file->Close(); }
+
+    Status Flush() override {
+        uint64_t start = now_micros();
+        Status s = m_file->Flush();
+        m_env->Record(m_type, IO_WRITE, 0, now_micros() - start);
+        return s;
+    }
+
+    Status Sync() override {
+        uint64_t start = now_micros();
+        Status s = m_file->Sync();
+        m_env->Record(m_type, IO_SYNC, 0, now_micros() - start);
+        return s;
+    }
+
+private:
+    IoStatsEnv *m_env;
+    IoFileType m_type;
+    WritableFile *m_file;
+};
+
+IoStatsEnv::IoStatsEnv(Env *target) : EnvWrapper(target) {
+    Reset();
+}
+
+Status IoStatsEnv::NewSequentialFile(const std::string &f, SequentialFile **r) {
+    IoFileType type = io_file_type(f);
+    uint64_t start = now_micros();
+    Status s = target()->NewSequentialFile(f, r);
+    Record(type, IO_OPEN, 0, now_micros() - start);
+    if (s.ok()) {
+        *r = new IoSequentialFile(this, type, *r);
+    }
+    return s;
+}
+
+Status IoStatsEnv::NewRandomAccessFile(const std::string &f, RandomAccessFile **r) {
+    IoFileType type = io_file_type(f);
+    uint64_t start = now_micros();
+    Status s = target()->NewRandomAccessFile(f, r);
+    Record(type, IO_OPEN, 0, now_micros() - start);
+    if (s.ok()) {
+        *r = new IoRandomAccessFile(this, type, *r);
+    }
+    return s;
+}
+
+Status IoStatsEnv::NewWritableFile(const std::string &f, WritableFile **r) {
+    IoFileType type = io_file_type(f);
+    uint64_t start = now_micros();
+    Status s = target()->NewWritableFile(f, r);
+    Record(type, IO_OPEN, 0, now_micros() - start);
+    if (s.ok()) {
+        *r = new IoWritableFile(this, type, *r);
+    }
+    return s;
+}
+
+Status IoStatsEnv::NewAppendableFile(const std::string &f, WritableFile **r) {
+    IoFileType type = io_file_type(f);
+    uint64_t start = now_micros();
+    Status s = target()->NewAppendableFile(f, r);
+    Record(type, IO_OPEN, 0, now_micros() - start);
+    if (s.ok()) {
+        *r = new IoWritableFile(this, type, *r);
+    }
+    return s;
+}
+
+void IoStatsEnv::Record(IoFileType type, IoOpType op, uint64_t bytes, uint64_t micros) {
+    IoCounter &c = m_counters[type][op];
+    c.bytes += bytes;
+    c.ops++;
+    c.micros += micros;
+    int bucket = 0;
+    while (micros > 0 && bucket < IO_HIST_BUCKETS - 1) {
+        micros >>= 1;
+        bucket++;
+    }
+    c.hist[bucket]++;
+}
+
+void IoStatsEnv::Reset() {
+    for (int t = 0; t < IO_FILE_TYPES; t++) {
+        for (int o = 0; o < IO_OP_TYPES; o++) {
+            IoCounter &c = m_counters[t][o];
+            c.bytes = 0;
+            c.ops = 0;
+            c.micros = 0;
+            for (int i = 0; i < IO_HIST_BUCKETS; i++) {
+                c.hist[i] = 0;
+            }
+        }
+    }
+}
+
+// {wal = {read = {bytes=, ops=, micros=, hist={...}}, write=, sync=, open=}, sst=, manifest=, other=}
+void IoStatsEnv::Push(lua_State *L) {
+    lua_newtable(L);
+    for (int t = 0; t < IO_FILE_TYPES; t++) {
+        lua_newtable(L);
+        for (int o = 0; o < IO_OP_TYPES; o++) {
+            IoCounter &c = m_counters[t][o];
+            lua_newtable(L);
+            lua_pushinteger(L, c.bytes);
+            lua_setfield(L, -2, "bytes");
+            lua_pushinteger(L, c.ops);
+            lua_setfield(L, -2, "ops");
+            lua_pushinteger(L, c.micros);
+            lua_setfield(L, -2, "micros");
+            lua_newtable(L);
+            for (int i = 0; i < IO_HIST_BUCKETS; i++) {
+                lua_pushinteger(L, c.hist[i]);
+                lua_rawseti(L, -2, i + 1);
+            }
+            lua_setfield(L, -2, "hist");
+            lua_setfield(L, -2, op_type_names[o]);
+        }
+        lua_setfield(L, -2, file_type_names[t]);
+    }
+}
+
+#define RATE_TUNE_WINDOW 100000 // micros
+#define RATE_DEFAULT_TARGET_LATENCY 2000 // micros
+
+static thread_local bool t_background = false;
+
+bool in_background_thread() {
+    return t_background;
+}
+
+RateLimiter::RateLimiter(int64_t rate, bool autoTune, int64_t targetLatency)
+    : m_max_rate(rate), m_rate(rate), m_auto(autoTune), m_target_latency(targetLatency > 0 ? targetLatency : RATE_DEFAULT_TARGET_LATENCY),
+      m_throttled_micros(0), m_throttled_bytes(0), m_throttled_ops(0), m_tokens(0), m_last(now_micros()),
+      m_read_micros(0), m_read_ops(0), m_window_start(now_micros()), m_last_latency(0) {}
+
+void RateLimiter::Request(size_t bytes) {
+    uint64_t wait = 0;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        uint64_t now = now_micros();
+        if (m_auto) {
+            Tune(now);
+        }
+        int64_t rate = m_rate;
+        if (rate <= 0) {
+            m_last = now;
+            return;
+        }
+        // allow bursts of 100ms worth of writes
+        double burst = rate / 10.0;
+        m_tokens += (now - m_last) * (rate / 1000000.0);
+        if (m_tokens > burst) {
+            m_tokens = burst;
+        }
+        m_last = now;
+        m_tokens -= bytes;
+        if (m_tokens < 0) {
+            wait = (uint64_t)(-m_tokens * 1000000.0 / rate);
+        }
+    }
+    if (wait > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(wait));
+        m_throttled_micros += wait;
+        m_throttled_bytes += bytes;
+        m_throttled_ops++;
+    }
+}
+
+void RateLimiter::ReportRead(uint64_t micros) {
+    m_read_micros += micros;
+    m_read_ops++;
+}
+
+void RateLimiter::Tune(uint64_t now) {
+    if (now - m_window_start < RATE_TUNE_WINDOW) {
+        return;
+    }
+    uint64_t ops = m_read_ops.exchange(0);
+    uint64_t micros = m_read_micros.exchange(0);
+    m_window_start = now;
+    int64_t max = m_max_rate;
+    int64_t rate = m_rate;
+    if (max <= 0) {
+        return;
+    }
+    if (ops > 0) {
+        m_last_latency = micros / ops;
+    }
+    if (ops > 0 && (int64_t)m_last_latency > m_target_latency) {
+        rate = std::max(max / 16, rate * 7 / 10);
+    } else {
+        rate = std::min(max, rate + rate / 10 + 1);
+    }
+    m_rate = rate;
+}
+
+void RateLimiter::SetRate(int64_t rate, bool autoTune) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_max_rate = rate;
+    m_rate = rate;
+    m_auto = autoTune;
+}
+
+void RateLimiter::Push(lua_State *L) {
+    lua_newtable(L);
+    lua_pushinteger(L, m_rate);
+    lua_setfield(L, -2, "rate");
+    lua_pushinteger(L, m_max_rate);
+    lua_setfield(L, -2, "maxRate");
+    lua_pushboolean(L, m_auto);
+    lua_setfield(L, -2, "auto");
+    lua_pushinteger(L, m_throttled_micros);
+    lua_setfield(L, -2, "throttledMicros");
+    lua_pushinteger(L, m_throttled_bytes);
+    lua_setfield(L, -2, "throttledBytes");
+    lua_pushinteger(L, m_throttled_ops);
+    lua_setfield(L, -2, "throttledOps");
+    std::lock_guard<std::mutex> guard(m_mutex);
+    lua_pushinteger(L, m_last_latency);
+    lua_setfield(L, -2, "readLatency");
+}
+
+class ThrottledWritableFile : public WritableFile {
+public:
+    ThrottledWritableFile(RateLimiter *limiter, WritableFile *file) : m_limiter(limiter), m_file(file) {}
+    ~ThrottledWritableFile() { delete m_file; }
+
+    Status Append(const Slice &data) override {
+        if (t_background) {
+            m_limiter->Request(data.size());
+        }
+        return m_file->Append(data);
+    }
+
+    Status Close() override { return m_file->Close(); }
+    Status Flush() override { return m_file->Flush(); }
+    Status Sync() override { return m_file->Sync(); }
+
+private:
+    RateLimiter *m_limiter;
+    WritableFile *m_file;
+};
+
+class LatencyRandomAccessFile : public RandomAccessFile {
+public:
+    LatencyRandomAccessFile(RateLimiter *limiter, RandomAccessFile *file) : m_limiter(limiter), m_file(file) {}
+    ~LatencyRandomAccessFile() { delete m_file; }
+
+    Status Read(uint64_t offset, size_t n, Slice *result, char *scratch) const override {
+        if (t_background || !m_limiter->m_auto) {
+            return m_file->Read(offset, n, result, scratch);
+        }
+        uint64_t start = now_micros();
+        Status s = m_file->Read(offset, n, result, scratch);
+        m_limiter->ReportRead(now_micros() - start);
+        return s;
+    }
+
+private:
+    RateLimiter *m_limiter;
+    RandomAccessFile *m_file;
+};
+
+Status RateLimitEnv::NewWritableFile(const std::string &f, WritableFile **r) {
+    Status s = target()->NewWritableFile(f, r);
+    if (s.ok() && io_file_type(f) == IO_SST) {
+        *r = new ThrottledWritableFile(m_limiter, *r);
+    }
+    return s;
+}
+
+Status RateLimitEnv::NewRandomAccessFile(const std::string &f, RandomAccessFile **r) {
+    Status s = target()->NewRandomAccessFile(f, r);
+    if (s.ok()) {
+        *r = new LatencyRandomAccessFile(m_limiter, *r);
+    }
+    return s;
+}
+
+struct BackgroundCall {
+    void (*function)(void *arg);
+    void *arg;
+};
+
+static void run_in_background(void *arg) {
+    BackgroundCall *call = (BackgroundCall *)arg;
+    t_background = true;
+    call->function(call->arg);
+    t_background = false;
+    delete call;
+}
+
+void RateLimitEnv::Schedule(void (*function)(void *arg), void *arg) {
+    target()->Schedule(run_in_background, new BackgroundCall{ function, arg });
+}
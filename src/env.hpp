@@ -0,0 +1,85 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <leveldb/env.h>
+#include <atomic>
+#include <mutex>
+
+enum IoFileType { IO_WAL, IO_SST, IO_MANIFEST, IO_OTHER, IO_FILE_TYPES };
+enum IoOpType { IO_READ, IO_WRITE, IO_SYNC, IO_OPEN, IO_OP_TYPES };
+
+// bucket i counts operations that took [2^(i-1), 2^i) microseconds
+#define IO_HIST_BUCKETS 24
+
+struct IoCounter {
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> ops;
+    std::atomic<uint64_t> micros;
+    std::atomic<uint64_t> hist[IO_HIST_BUCKETS];
+};
+
+IoFileType io_file_type(const string &fname);
+
+// Env wrapper that counts bytes, ops and latency of every file operation
+class IoStatsEnv : public EnvWrapper {
+public:
+    IoStatsEnv(Env *target);
+
+    Status NewSequentialFile(const std::string &f, SequentialFile **r) override;
+    Status NewRandomAccessFile(const std::string &f, RandomAccessFile **r) override;
+    Status NewWritableFile(const std::string &f, WritableFile **r) override;
+    Status NewAppendableFile(const std::string &f, WritableFile **r) override;
+
+    void Record(IoFileType type, IoOpType op, uint64_t bytes, uint64_t micros);
+    void Reset();
+    void Push(lua_State *L);
+
+    IoCounter m_counters[IO_FILE_TYPES][IO_OP_TYPES];
+};
+
+// token bucket for background writes, the rate may go negative in debt and the caller sleeps it off
+class RateLimiter {
+public:
+    RateLimiter(int64_t rate, bool autoTune, int64_t targetLatency);
+
+    void Request(size_t bytes);
+    void ReportRead(uint64_t micros);
+    void SetRate(int64_t rate, bool autoTune);
+    void Push(lua_State *L);
+
+    std::atomic<int64_t> m_max_rate;
+    std::atomic<int64_t> m_rate;
+    std::atomic<bool> m_auto;
+    int64_t m_target_latency;
+
+    std::atomic<uint64_t> m_throttled_micros;
+    std::atomic<uint64_t> m_throttled_bytes;
+    std::atomic<uint64_t> m_throttled_ops;
+
+private:
+    void Tune(uint64_t now);
+
+    std::mutex m_mutex;
+    double m_tokens;
+    uint64_t m_last;
+    // foreground read latency of the current tuning window
+    std::atomic<uint64_t> m_read_micros;
+    std::atomic<uint64_t> m_read_ops;
+    uint64_t m_window_start;
+    uint64_t m_last_latency;
+};
+
+// Env wrapper that throttles table file writes issued from leveldb's background
+// thread (compactions and memtable flushes), foreground writes are never delayed
+class RateLimitEnv : public EnvWrapper {
+public:
+    RateLimitEnv(Env *target, RateLimiter *limiter) : EnvWrapper(target), m_limiter(limiter) {}
+
+    Status NewWritableFile(const std::string &f, WritableFile **r) override;
+    Status NewRandomAccessFile(const std::string &f, RandomAccessFile **r) override;
+    void Schedule(void (*function)(void *arg), void *arg) override;
+
+    RateLimiter *m_limiter;
+};
+
+bool in_background_thread();
+uint64_t now_micros();
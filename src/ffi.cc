@@ -0,0 +1,121 @@
+﻿#include "ffi.hpp"
+#include "env.hpp"
+#include "state.hpp"
+#include <string.h>
+
+struct FfiIter {
+    Iterator *it;
+    // the current entry has not been returned yet
+    bool primed;
+};
+
+static DbState *ffi_state(void *handle, DB **db) {
+    LuaDB *ud = (LuaDB *)handle;
+    *db = ud ? ud->db : nullptr;
+    return *db ? ud->state : nullptr;
+}
+
+int lvldb_ffi_get(void *handle, const char *key, size_t klen, char *buf, size_t cap, size_t *vlen, int fillCache) {
+    DB *db;
+    DbState *state = ffi_state(handle, &db);
+    if (!state) {
+        return LVLDB_FFI_CLOSED;
+    }
+    // reused across calls so steady-state gets don't allocate
+    static thread_local string value;
+    ReadOptions ropt;
+    ropt.fill_cache = fillCache != 0;
+    Status s = state->Get(db, ropt, Slice(key, klen), &value);
+    if (s.IsNotFound()) {
+        return LVLDB_FFI_NOT_FOUND;
+    }
+    if (!s.ok()) {
+        return LVLDB_FFI_ERROR;
+    }
+    *vlen = value.size();
+    if (value.size() > cap) {
+        return LVLDB_FFI_TRUNCATED;
+    }
+    memcpy(buf, value.data(), value.size());
+    return LVLDB_FFI_OK;
+}
+
+int lvldb_ffi_put(void *handle, const char *key, size_t klen, const char *val, size_t vlen, int sync) {
+    DB *db;
+    DbState *state = ffi_state(handle, &db);
+    if (!state) {
+        return LVLDB_FFI_CLOSED;
+    }
+    WriteOptions wopt;
+    wopt.sync = sync != 0;
+    uint64_t start = now_micros();
+    Status s = state->Put(db, wopt, Slice(key, klen), Slice(val, vlen));
+    // no VM to run the slow write callback in, the write is still counted
+    state->m_write_stats.Record(now_micros() - start);
+    return s.ok() ? LVLDB_FFI_OK : LVLDB_FFI_ERROR;
+}
+
+int lvldb_ffi_delete(void *handle, const char *key, size_t klen, int sync) {
+    DB *db;
+    DbState *state = ffi_state(handle, &db);
+    if (!state) {
+        return LVLDB_FFI_CLOSED;
+    }
+    WriteOptions wopt;
+    wopt.sync = sync != 0;
+    uint64_t start = now_micros();
+    Status s = state->Delete(db, wopt, Slice(key, klen));
+    state->m_write_stats.Record(now_micros() - start);
+    return s.ok() ? LVLDB_FFI_OK : LVLDB_FFI_ERROR;
+}
+
+void *lvldb_ffi_iter_new(void *handle, int fillCache) {
+    DB *db;
+    DbState *state = ffi_state(handle, &db);
+    if (!state) {
+        return nullptr;
+    }
+    ReadOptions ropt;
+    ropt.fill_cache = fillCache != 0;
+    FfiIter *iter = new FfiIter;
+    iter->it = state->NewIterator(db, ropt);
+    iter->it->SeekToFirst();
+    iter->primed = true;
+    return iter;
+}
+
+void lvldb_ffi_iter_seek(void *iter, const char *key, size_t klen) {
+    FfiIter *fi = (FfiIter *)iter;
+    if (klen == 0) {
+        fi->it->SeekToFirst();
+    } else {
+        fi->it->Seek(Slice(key, klen));
+    }
+    fi->primed = true;
+}
+
+int lvldb_ffi_iter_step(void *iter, const char **key, size_t *klen, const char **val, size_t *vlen) {
+    FfiIter *fi = (FfiIter *)iter;
+    if (!fi->primed && fi->it->Valid()) {
+        fi->it->Next();
+    }
+    fi->primed = false;
+    if (!fi->it->Valid()) {
+        return 0;
+    }
+    Slice k = fi->it->key();
+    Slice v = fi->it->value();
+    *key = k.data();
+    *klen = k.size();
+    *val = v.data();
+    *vlen = v.size();
+    return 1;
+}
+
+void lvldb_ffi_iter_free(void *iter) {
+    FfiIter *fi = (FfiIter *)iter;
+    if (fi) {
+        delete fi->it;
+        delete fi;
+    }
+}
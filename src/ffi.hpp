@@ -0,0 +1,24 @@
+﻿#pragma once
+#include "lib.hpp"
+
+// Plain C entry points for LuaJIT's FFI, see lua/lualeveldb_ffi.lua.
+// `handle` is the payload of a leveldb.db userdata, what ffi.cast("void *", db) yields.
+#define LVLDB_FFI_OK 0
+#define LVLDB_FFI_NOT_FOUND 1
+// the value did not fit, *vlen holds the size needed
+#define LVLDB_FFI_TRUNCATED 2
+#define LVLDB_FFI_CLOSED -1
+#define LVLDB_FFI_ERROR -2
+
+extern "C" {
+LUALIB_API int lvldb_ffi_get(void *handle, const char *key, size_t klen, char *buf, size_t cap, size_t *vlen, int fillCache);
+LUALIB_API int lvldb_ffi_put(void *handle, const char *key, size_t klen, const char *val, size_t vlen, int sync);
+LUALIB_API int lvldb_ffi_delete(void *handle, const char *key, size_t klen, int sync);
+
+LUALIB_API void *lvldb_ffi_iter_new(void *handle, int fillCache);
+// positions at the first key >= key, or the first key when klen is 0
+LUALIB_API void lvldb_ffi_iter_seek(void *iter, const char *key, size_t klen);
+// returns 1 and the next entry, pointers stay valid until the following call, 0 at the end
+LUALIB_API int lvldb_ffi_iter_step(void *iter, const char **key, size_t *klen, const char **val, size_t *vlen);
+LUALIB_API void lvldb_ffi_iter_free(void *iter);
+}
@@ -1,5 +1,13 @@
 ﻿#include "iter.hpp"
 
+void push_iter(lua_State *L, Iterator *it, const MyReadOptions &ropt) {
+    LuaIter *ud = (LuaIter *)lua_newuserdata(L, sizeof(LuaIter));
+    ud->it = it;
+    ud->inflateLimit = ropt.InflateLimit;
+    luaL_getmetatable(L, LVLDB_MT_ITER);
+    lua_setmetatable(L, -2);
+}
+
 Iterator *check_iter(lua_State *L) {
     auto ud = (Iterator **)luaL_checkudata(L, 1, LVLDB_MT_ITER);
     return *ud;
@@ -61,6 +69,7 @@ int lvldb_iterator_key(lua_State *L) {
 
 int lvldb_iterator_val(lua_State *L) {
     Iterator *iter = check_iter(L);
+    size_t limit = ((LuaIter *)lua_touserdata(L, 1))->inflateLimit;
     Slice val = iter->value();
     bool uncompress = false;
     if (lua_gettop(L) >= 2 && !lua_isnil(L, 2)) {
@@ -68,7 +77,10 @@ int lvldb_iterator_val(lua_State *L) {
         uncompress = lua_toboolean(L, 2);
     }
     if (uncompress) {
-        miniz_uncompress(L, val.data(), val.size());
+        if (!miniz_uncompress(L, val.data(), val.size(), limit)) {
+            lua_pushliteral(L, "inflateLimit exceeded");
+            return 2;
+        }
     } else {
         lua_pushlstring(L, val.data(), val.size());
     }
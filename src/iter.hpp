@@ -2,6 +2,15 @@
 #include "lib.hpp"
 #include "utils.hpp"
 
+// layout of the leveldb.iter userdata, it must stay the first member
+struct LuaIter {
+    Iterator *it;
+    // inflateLimit of the read options the iterator was created with, used by value(true)
+    size_t inflateLimit;
+};
+
+// pushes a leveldb.iter userdata that takes ownership of it
+void push_iter(lua_State *L, Iterator *it, const MyReadOptions &ropt);
 Iterator *check_iter(lua_State *L);
 
 int lvldb_iterator_delete(lua_State *L);
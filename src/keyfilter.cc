@@ -0,0 +1,448 @@
+﻿#include "keyfilter.hpp"
+#include "db.hpp"
+#include "env.hpp"
+#include "locks.hpp"
+#include "state.hpp"
+#include <miniz.h>
+#include <algorithm>
+#include <string.h>
+
+// file: magic fixed32(bitsPerKey) fixed64(fingerprint) fixed64(capacity) fixed64(blocks) fixed64(inserted) fixed64(keys)
+//       words as fixed64, fixed32(crc32 of the words)
+#define KEY_FILTER_MAGIC "LKF1"
+#define KEY_FILTER_HEADER_SIZE 48
+#define KEY_FILTER_IO_CHUNK (1024 * 1024)
+// at most 7 probes, each takes 9 bits of one 64 bit hash
+#define KEY_FILTER_MAX_PROBES 7
+
+static void put_fixed32(char *dst, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        dst[i] = char(v >> (i * 8));
+    }
+}
+
+static void put_fixed64(char *dst, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        dst[i] = char(v >> (i * 8));
+    }
+}
+
+static uint32_t get_fixed32(const char *p) {
+    const uint8_t *u = (const uint8_t *)p;
+    return uint32_t(u[0]) | uint32_t(u[1]) << 8 | uint32_t(u[2]) << 16 | uint32_t(u[3]) << 24;
+}
+
+static uint64_t get_fixed64(const char *p) {
+    return uint64_t(get_fixed32(p)) | uint64_t(get_fixed32(p + 4)) << 32;
+}
+
+// splitmix64 finalizer, decorrelates the probe bits from the block index
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+static int popcount64(uint64_t v) {
+    v = v - ((v >> 1) & 0x5555555555555555ull);
+    v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return int((v * 0x0101010101010101ull) >> 56);
+}
+
+static bool is_db_file(const string &name) {
+    auto ends_with = [&](const char *suffix) {
+        size_t n = strlen(suffix);
+        return name.size() >= n && name.compare(name.size() - n, n, suffix) == 0;
+    };
+    return name == "CURRENT" || name.compare(0, 9, "MANIFEST-") == 0 || ends_with(".log") || ends_with(".ldb") || ends_with(".sst");
+}
+
+// names and sizes of the files holding the db's data, any write in between changes it
+static uint64_t db_fingerprint(Env *env, const string &dbpath) {
+    vector<string> children;
+    if (!env->GetChildren(dbpath, &children).ok()) {
+        return 0;
+    }
+    std::sort(children.begin(), children.end());
+    string desc;
+    for (auto &name : children) {
+        uint64_t size = 0;
+        if (is_db_file(name) && env->GetFileSize(dbpath + "/" + name, &size).ok()) {
+            char buf[8];
+            put_fixed64(buf, size);
+            desc.append(name).append(1, '\0').append(buf, sizeof(buf));
+        }
+    }
+    return desc.empty() ? 0 : key_hash(desc);
+}
+
+BloomBlocks::BloomBlocks(size_t capacity, int bitsPerKey) : m_capacity(capacity), m_bits_per_key(bitsPerKey), m_inserted(0) {
+    m_probes = std::max(1, std::min(KEY_FILTER_MAX_PROBES, int(bitsPerKey * 0.69)));
+    m_blocks = std::max<size_t>(1, (std::max<size_t>(capacity, 1) * bitsPerKey + 511) / 512);
+    m_words.reset(new std::atomic<uint64_t>[m_blocks * 8]);
+    for (size_t i = 0; i < m_blocks * 8; i++) {
+        m_words[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void BloomBlocks::Add(uint64_t hash) {
+    std::atomic<uint64_t> *block = &m_words[(hash % m_blocks) * 8];
+    uint64_t h = mix64(hash);
+    for (int i = 0; i < m_probes; i++) {
+        uint32_t bit = uint32_t(h >> (i * 9)) & 511;
+        block[bit >> 6].fetch_or(uint64_t(1) << (bit & 63), std::memory_order_relaxed);
+    }
+    m_inserted.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool BloomBlocks::MayContain(uint64_t hash) const {
+    const std::atomic<uint64_t> *block = &m_words[(hash % m_blocks) * 8];
+    uint64_t h = mix64(hash);
+    for (int i = 0; i < m_probes; i++) {
+        uint32_t bit = uint32_t(h >> (i * 9)) & 511;
+        if (!(block[bit >> 6].load(std::memory_order_relaxed) & (uint64_t(1) << (bit & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+double BloomBlocks::EstimatedFpRate() const {
+    uint64_t set = 0;
+    for (size_t i = 0; i < m_blocks * 8; i++) {
+        set += popcount64(m_words[i].load(std::memory_order_relaxed));
+    }
+    double fill = double(set) / (m_blocks * 512);
+    double rate = 1;
+    for (int i = 0; i < m_probes; i++) {
+        rate *= fill;
+    }
+    return rate;
+}
+
+KeyFilter::KeyFilter(Env *env, const string &file, int bitsPerKey)
+    : m_env(env), m_file(file), m_bits_per_key(bitsPerKey), m_state(nullptr), m_db(nullptr), m_current(nullptr), m_building(nullptr), m_epoch(0),
+      m_stop(false), m_running(false), m_loaded(false), m_keys(0), m_builds(0), m_build_micros(0), m_lookups(0), m_negatives(0), m_false_positives(0) {
+    m_active[0] = 0;
+    m_active[1] = 0;
+}
+
+KeyFilter::~KeyFilter() {
+    Close();
+    delete m_current.load();
+}
+
+void KeyFilter::Load(const string &dbpath) {
+    if (m_file.empty() || !m_env->FileExists(m_file)) {
+        return;
+    }
+    SequentialFile *raw = nullptr;
+    if (!m_env->NewSequentialFile(m_file, &raw).ok()) {
+        return;
+    }
+    std::unique_ptr<SequentialFile> file(raw);
+    std::unique_ptr<char[]> scratch(new char[KEY_FILTER_IO_CHUNK]);
+    Slice data;
+    Status s = file->Read(KEY_FILTER_HEADER_SIZE, &data, scratch.get());
+    if (s.ok() && data.size() == KEY_FILTER_HEADER_SIZE && memcmp(data.data(), KEY_FILTER_MAGIC, 4) == 0 && (int)get_fixed32(data.data() + 4) == m_bits_per_key &&
+        get_fixed64(data.data() + 8) == db_fingerprint(m_env, dbpath)) {
+        uint64_t capacity = get_fixed64(data.data() + 16);
+        uint64_t blocks = get_fixed64(data.data() + 24);
+        uint64_t inserted = get_fixed64(data.data() + 32);
+        uint64_t keys = get_fixed64(data.data() + 40);
+        std::unique_ptr<BloomBlocks> filter(new BloomBlocks(capacity, m_bits_per_key));
+        if (filter->m_blocks == blocks) {
+            size_t words = blocks * 8, done = 0;
+            mz_ulong crc = MZ_CRC32_INIT;
+            while (s.ok() && done < words) {
+                size_t n = std::min(words - done, size_t(KEY_FILTER_IO_CHUNK / 8));
+                s = file->Read(n * 8, &data, scratch.get());
+                if (s.ok() && data.size() != n * 8) {
+                    s = Status::Corruption("truncated key filter");
+                }
+                if (s.ok()) {
+                    crc = mz_crc32(crc, (const unsigned char *)data.data(), data.size());
+                    for (size_t i = 0; i < n; i++) {
+                        filter->m_words[done + i].store(get_fixed64(data.data() + i * 8), std::memory_order_relaxed);
+                    }
+                    done += n;
+                }
+            }
+            if (s.ok()) {
+                s = file->Read(4, &data, scratch.get());
+            }
+            if (s.ok() && data.size() == 4 && get_fixed32(data.data()) == (uint32_t)crc) {
+                filter->m_inserted = inserted;
+                m_keys = keys;
+                m_current = filter.release();
+                m_loaded = true;
+            }
+        }
+    }
+    file.reset();
+    // a filter that outlives a crash would miss the keys written after it was saved
+    m_env->DeleteFile(m_file);
+}
+
+void KeyFilter::Save(const string &dbpath) {
+    BloomBlocks *filter = m_current.load();
+    if (m_file.empty() || !filter) {
+        return;
+    }
+    string tmp = m_file + ".tmp";
+    WritableFile *raw = nullptr;
+    Status s = m_env->NewWritableFile(tmp, &raw);
+    if (!s.ok()) {
+        return;
+    }
+    std::unique_ptr<WritableFile> file(raw);
+    char header[KEY_FILTER_HEADER_SIZE];
+    memcpy(header, KEY_FILTER_MAGIC, 4);
+    put_fixed32(header + 4, (uint32_t)m_bits_per_key);
+    put_fixed64(header + 8, db_fingerprint(m_env, dbpath));
+    put_fixed64(header + 16, filter->m_capacity);
+    put_fixed64(header + 24, filter->m_blocks);
+    put_fixed64(header + 32, filter->m_inserted);
+    put_fixed64(header + 40, m_keys);
+    s = file->Append(Slice(header, sizeof(header)));
+    string chunk;
+    mz_ulong crc = MZ_CRC32_INIT;
+    size_t words = filter->m_blocks * 8;
+    for (size_t i = 0; s.ok() && i < words;) {
+        size_t n = std::min(words - i, size_t(KEY_FILTER_IO_CHUNK / 8));
+        chunk.resize(n * 8);
+        for (size_t j = 0; j < n; j++) {
+            put_fixed64(&chunk[j * 8], filter->m_words[i + j].load(std::memory_order_relaxed));
+        }
+        crc = mz_crc32(crc, (const unsigned char *)chunk.data(), chunk.size());
+        s = file->Append(chunk);
+        i += n;
+    }
+    if (s.ok()) {
+        put_fixed32(header, (uint32_t)crc);
+        s = file->Append(Slice(header, 4));
+    }
+    if (s.ok()) {
+        s = file->Sync();
+    }
+    if (s.ok()) {
+        s = file->Close();
+    }
+    file.reset();
+    if (s.ok()) {
+        s = m_env->RenameFile(tmp, m_file);
+    }
+    if (!s.ok()) {
+        m_env->DeleteFile(tmp);
+    }
+}
+
+void KeyFilter::Start(DbState *state, DB *db) {
+    m_state = state;
+    m_db = db;
+    if (!Ready()) {
+        Rebuild();
+    }
+}
+
+void KeyFilter::Close() {
+    m_stop = true;
+    std::lock_guard<std::mutex> guard(m_build_mutex);
+    if (m_build_thread.joinable()) {
+        m_build_thread.join();
+    }
+}
+
+void KeyFilter::Add(uint64_t hash) {
+    uint32_t slot = Enter();
+    BloomBlocks *current = m_current.load();
+    BloomBlocks *building = m_building.load();
+    bool full = false;
+    if (current) {
+        current->Add(hash);
+        full = current->m_inserted.load(std::memory_order_relaxed) > current->m_capacity * 2;
+    }
+    if (building && building != current) {
+        building->Add(hash);
+    }
+    Leave(slot);
+    if (full && !m_running) {
+        Rebuild();
+    }
+}
+
+bool KeyFilter::MayContain(uint64_t hash) {
+    uint32_t slot = Enter();
+    BloomBlocks *current = m_current.load();
+    bool maybe = !current || current->MayContain(hash);
+    Leave(slot);
+    if (current) {
+        m_lookups++;
+        if (!maybe) {
+            m_negatives++;
+        }
+    }
+    return maybe;
+}
+
+size_t KeyFilter::Bytes() {
+    uint32_t slot = Enter();
+    BloomBlocks *current = m_current.load();
+    BloomBlocks *building = m_building.load();
+    size_t bytes = (current ? current->Bytes() : 0) + (building && building != current ? building->Bytes() : 0);
+    Leave(slot);
+    return bytes;
+}
+
+bool KeyFilter::Rebuild() {
+    std::lock_guard<std::mutex> guard(m_build_mutex);
+    if (m_running || m_stop || !m_db) {
+        return false;
+    }
+    if (m_build_thread.joinable()) {
+        m_build_thread.join();
+    }
+    m_running = true;
+    m_build_thread = std::thread(&KeyFilter::Build, this);
+    return true;
+}
+
+uint32_t KeyFilter::Enter() {
+    // counted in a slot only once the epoch is still the same afterwards, otherwise a
+    // Retire that already found the slot empty could free the filter this reader loads
+    for (;;) {
+        uint32_t epoch = m_epoch.load();
+        m_active[epoch & 1]++;
+        if (m_epoch.load() == epoch) {
+            return epoch & 1;
+        }
+        m_active[epoch & 1]--;
+    }
+}
+
+void KeyFilter::Retire(BloomBlocks *filter) {
+    uint32_t epoch = m_epoch.fetch_add(1);
+    while (m_active[epoch & 1].load() != 0) {
+        std::this_thread::yield();
+    }
+    delete filter;
+}
+
+void KeyFilter::Build() {
+    uint64_t start = now_micros();
+    ReadOptions ropt;
+    ropt.fill_cache = false;
+    // only keys are read, so the raw iterator is enough even with the value log
+    size_t count = 0;
+    {
+        std::unique_ptr<Iterator> it(m_db->NewIterator(ropt));
+        for (it->SeekToFirst(); it->Valid() && !m_stop; it->Next()) {
+            count++;
+        }
+    }
+    BloomBlocks *filter = m_stop ? nullptr : new BloomBlocks(count + count / 4 + 1024, m_bits_per_key);
+    std::unique_ptr<Iterator> it;
+    if (filter) {
+        // with every stripe held no write is in flight: a write either lands before the
+        // iterator is created or adds its key to the new filter itself
+        StripeGuard all(m_state->m_key_locks, ~uint64_t(0));
+        m_building = filter;
+        it.reset(m_db->NewIterator(ropt));
+    }
+    uint64_t keys = 0;
+    if (it) {
+        for (it->SeekToFirst(); it->Valid() && !m_stop; it->Next()) {
+            filter->Add(key_hash(it->key()));
+            keys++;
+        }
+        it.reset();
+    }
+    if (filter && !m_stop) {
+        BloomBlocks *old = m_current.exchange(filter);
+        m_building = nullptr;
+        m_keys = keys;
+        m_builds++;
+        m_build_micros = now_micros() - start;
+        if (old) {
+            Retire(old);
+        }
+    } else if (filter) {
+        m_building = nullptr;
+        Retire(filter);
+    }
+    m_running = false;
+}
+
+void KeyFilter::Push(lua_State *L) {
+    uint64_t lookups = m_lookups, negatives = m_negatives, fp = m_false_positives;
+    lua_createtable(L, 0, 16);
+    lua_pushboolean(L, Ready());
+    lua_setfield(L, -2, "ready");
+    lua_pushboolean(L, m_running.load());
+    lua_setfield(L, -2, "building");
+    lua_pushboolean(L, m_loaded.load());
+    lua_setfield(L, -2, "loaded");
+    lua_pushinteger(L, m_bits_per_key);
+    lua_setfield(L, -2, "bitsPerKey");
+    lua_pushinteger(L, (lua_Integer)m_keys.load());
+    lua_setfield(L, -2, "keys");
+    lua_pushinteger(L, (lua_Integer)m_builds.load());
+    lua_setfield(L, -2, "builds");
+    lua_pushinteger(L, (lua_Integer)m_build_micros.load());
+    lua_setfield(L, -2, "buildMicros");
+    lua_pushinteger(L, (lua_Integer)lookups);
+    lua_setfield(L, -2, "lookups");
+    lua_pushinteger(L, (lua_Integer)negatives);
+    lua_setfield(L, -2, "negatives");
+    lua_pushinteger(L, (lua_Integer)fp);
+    lua_setfield(L, -2, "falsePositives");
+    // observed: share of lookups for absent keys that still went to leveldb
+    lua_pushnumber(L, negatives + fp > 0 ? (lua_Number)fp / (negatives + fp) : 0);
+    lua_setfield(L, -2, "fpRate");
+    // copied out first, a Lua error must not leave the epoch slot taken
+    bool ready = false;
+    uint64_t capacity = 0, inserted = 0, bytes = 0;
+    double estimated = 0;
+    uint32_t slot = Enter();
+    BloomBlocks *current = m_current.load();
+    if (current) {
+        ready = true;
+        capacity = current->m_capacity;
+        inserted = current->m_inserted.load();
+        bytes = current->Bytes();
+        estimated = current->EstimatedFpRate();
+    }
+    Leave(slot);
+    if (ready) {
+        lua_pushinteger(L, (lua_Integer)capacity);
+        lua_setfield(L, -2, "capacity");
+        lua_pushinteger(L, (lua_Integer)inserted);
+        lua_setfield(L, -2, "inserted");
+        lua_pushinteger(L, (lua_Integer)bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushnumber(L, estimated);
+        lua_setfield(L, -2, "estimatedFpRate");
+    }
+}
+
+int lvldb_database_key_filter_stats(lua_State *L) {
+    check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    if (!state->m_key_filter) {
+        lua_pushnil(L);
+        return 1;
+    }
+    state->m_key_filter->Push(L);
+    return 1;
+}
+
+// ldb:rebuildKeyFilter(), false when disabled or a build is already running
+int lvldb_database_rebuild_key_filter(lua_State *L) {
+    check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    lua_pushboolean(L, state->m_key_filter && state->m_key_filter->Rebuild());
+    return 1;
+}
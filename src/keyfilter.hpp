@@ -0,0 +1,90 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <leveldb/env.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class DbState;
+
+// blocked bloom filter, the bits of a key all fall into one 64 byte block
+class BloomBlocks {
+public:
+    BloomBlocks(size_t capacity, int bitsPerKey);
+
+    void Add(uint64_t hash);
+    bool MayContain(uint64_t hash) const;
+    size_t Bytes() const { return m_blocks * 64; }
+    double EstimatedFpRate() const;
+
+    size_t m_capacity;
+    int m_bits_per_key;
+    int m_probes;
+    size_t m_blocks;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_words;
+    std::atomic<uint64_t> m_inserted;
+};
+
+// in-memory filter over every key of the db, lets has/get skip leveldb for absent keys.
+// Deletes leave their bits set, the filter is rebuilt by a key-only scan when it fills up.
+class KeyFilter {
+public:
+    KeyFilter(Env *env, const string &file, int bitsPerKey);
+    ~KeyFilter();
+
+    // runs before the db is opened, adopts the saved filter when the db files match it
+    void Load(const string &dbpath);
+    // starts the background scan unless a saved filter was loaded
+    void Start(DbState *state, DB *db);
+    void Close();
+    // runs after the db is deleted so the fingerprint matches the next open
+    void Save(const string &dbpath);
+
+    bool Ready() const { return m_current.load() != nullptr; }
+    // callers hold the key's stripe
+    void Add(uint64_t hash);
+    // false when the key is certainly absent
+    bool MayContain(uint64_t hash);
+    void RecordFalsePositive() { m_false_positives++; }
+    // current filter plus the one being built
+    size_t Bytes();
+    // scans the db again into a filter sized for its current key count
+    bool Rebuild();
+
+    void Push(lua_State *L);
+
+private:
+    void Build();
+    // announces a reader of m_current/m_building, returns the slot to pass to Leave
+    uint32_t Enter();
+    void Leave(uint32_t slot) { m_active[slot]--; }
+    void Retire(BloomBlocks *filter);
+
+    Env *m_env;
+    string m_file;
+    int m_bits_per_key;
+    DbState *m_state;
+    DB *m_db;
+    std::atomic<BloomBlocks *> m_current;
+    std::atomic<BloomBlocks *> m_building;
+    // readers announce themselves in the slot of the current epoch, a retired filter
+    // is freed once the slot of the epoch it was replaced in drains; a reader whose
+    // epoch moved on before it was counted retries, see Enter
+    std::atomic<uint32_t> m_epoch;
+    std::atomic<uint32_t> m_active[2];
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_loaded;
+    std::atomic<uint64_t> m_keys;
+    std::atomic<uint64_t> m_builds;
+    std::atomic<uint64_t> m_build_micros;
+    std::atomic<uint64_t> m_lookups;
+    std::atomic<uint64_t> m_negatives;
+    std::atomic<uint64_t> m_false_positives;
+    std::mutex m_build_mutex;
+    std::thread m_build_thread;
+};
+
+int lvldb_database_key_filter_stats(lua_State *L);
+int lvldb_database_rebuild_key_filter(lua_State *L);
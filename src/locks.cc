@@ -0,0 +1,26 @@
+﻿#include "locks.hpp"
+
+uint64_t key_hash(const Slice &key) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < key.size(); i++) {
+        h = (h ^ (uint8_t)key[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+void StripedLocks::Lock(uint64_t mask) {
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        if (mask & (uint64_t(1) << i)) {
+            m_stripes[i].lock();
+        }
+    }
+}
+
+void StripedLocks::Unlock(uint64_t mask) {
+    for (int i = LOCK_STRIPES - 1; i >= 0; i--) {
+        if (mask & (uint64_t(1) << i)) {
+            m_stripes[i].unlock();
+        }
+    }
+}
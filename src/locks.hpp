@@ -0,0 +1,30 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <mutex>
+
+#define LOCK_STRIPES 64
+
+uint64_t key_hash(const Slice &key);
+
+// fixed set of mutexes keys hash onto, a set of keys is locked as a bitmask of stripes
+class StripedLocks {
+public:
+    uint64_t Mask(const Slice &key) const { return MaskOf(key_hash(key)); }
+    uint64_t MaskOf(uint64_t hash) const { return uint64_t(1) << (hash % LOCK_STRIPES); }
+    // always in ascending order, so two lockers can not deadlock
+    void Lock(uint64_t mask);
+    void Unlock(uint64_t mask);
+
+private:
+    std::mutex m_stripes[LOCK_STRIPES];
+};
+
+class StripeGuard {
+public:
+    StripeGuard(StripedLocks &locks, uint64_t mask) : m_locks(locks), m_mask(mask) { m_locks.Lock(m_mask); }
+    ~StripeGuard() { m_locks.Unlock(m_mask); }
+
+private:
+    StripedLocks &m_locks;
+    uint64_t m_mask;
+};
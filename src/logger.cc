@@ -0,0 +1,128 @@
+﻿#include "logger.hpp"
+#include "env.hpp"
+#include "state.hpp"
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+#define EVENT_MESSAGE_SIZE 512
+
+static const char *const event_type_names[] = { "", "flush", "compaction", "move", "error" };
+
+EventLogger::EventLogger(size_t capacity) : m_slots(capacity), m_next_seq(1), m_flush_start(0), m_compaction_start(0) {
+    for (auto &slot : m_slots) {
+        slot.seq = 0;
+    }
+}
+
+void EventLogger::Logv(const char *format, va_list ap) {
+    char msg[EVENT_MESSAGE_SIZE];
+    vsnprintf(msg, sizeof(msg), format, ap);
+
+    int64_t f[EVENT_FIELDS] = { 0 };
+    unsigned long long number = 0;
+    long long bytes = 0;
+    int n0 = 0, l0 = 0, n1 = 0, l1 = 0;
+    uint64_t now = now_micros();
+    if (sscanf(msg, "Level-0 table #%llu: %lld bytes", &number, &bytes) == 2) {
+        f[EVENT_TYPE] = EVENT_FLUSH;
+        f[EVENT_BYTES] = bytes;
+        f[EVENT_MICROS] = m_flush_start ? now - m_flush_start : 0;
+    } else if (sscanf(msg, "Level-0 table #%llu: started", &number) == 1) {
+        m_flush_start = now;
+        return;
+    } else if (sscanf(msg, "Compacted %d@%d + %d@%d files => %lld bytes", &n0, &l0, &n1, &l1, &bytes) == 5) {
+        f[EVENT_TYPE] = EVENT_COMPACTION;
+        f[EVENT_LEVEL] = l0;
+        f[EVENT_BYTES] = bytes;
+        f[EVENT_INPUTS] = n0;
+        f[EVENT_INPUTS_NEXT] = n1;
+        f[EVENT_MICROS] = m_compaction_start ? now - m_compaction_start : 0;
+    } else if (sscanf(msg, "Compacting %d@%d + %d@%d files", &n0, &l0, &n1, &l1) == 4) {
+        m_compaction_start = now;
+        return;
+    } else if (sscanf(msg, "Moved #%llu to level-%d %lld bytes", &number, &l0, &bytes) == 3) {
+        f[EVENT_TYPE] = EVENT_MOVE;
+        f[EVENT_LEVEL] = l0;
+        f[EVENT_BYTES] = bytes;
+    } else if (strncmp(msg, "Compaction error", 16) == 0) {
+        f[EVENT_TYPE] = EVENT_ERROR;
+    } else {
+        return;
+    }
+    f[EVENT_TIME] = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    Append(f);
+}
+
+void EventLogger::Append(const int64_t *fields) {
+    uint64_t seq = m_next_seq++;
+    DbEventSlot &slot = m_slots[seq % m_slots.size()];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < EVENT_FIELDS; i++) {
+        slot.fields[i].store(fields[i], std::memory_order_relaxed);
+    }
+    slot.seq.store(seq, std::memory_order_release);
+}
+
+int EventLogger::Push(lua_State *L, uint64_t sinceSeq) {
+    uint64_t last = m_next_seq - 1;
+    uint64_t first = sinceSeq + 1;
+    uint64_t dropped = 0;
+    if (last >= m_slots.size() && first <= last - m_slots.size()) {
+        dropped = last - m_slots.size() + 1 - first;
+        first = last - m_slots.size() + 1;
+    }
+    lua_newtable(L);
+    int n = 0;
+    for (uint64_t seq = first; seq <= last; seq++) {
+        DbEventSlot &slot = m_slots[seq % m_slots.size()];
+        int64_t f[EVENT_FIELDS];
+        if (slot.seq.load(std::memory_order_acquire) != seq) {
+            dropped++;
+            continue;
+        }
+        for (int i = 0; i < EVENT_FIELDS; i++) {
+            f[i] = slot.fields[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq) {
+            dropped++;
+            continue;
+        }
+        lua_newtable(L);
+        lua_pushinteger(L, seq);
+        lua_setfield(L, -2, "seq");
+        lua_pushstring(L, event_type_names[f[EVENT_TYPE]]);
+        lua_setfield(L, -2, "type");
+        lua_pushinteger(L, f[EVENT_LEVEL]);
+        lua_setfield(L, -2, "level");
+        lua_pushinteger(L, f[EVENT_BYTES]);
+        lua_setfield(L, -2, "bytes");
+        lua_pushinteger(L, f[EVENT_MICROS]);
+        lua_setfield(L, -2, "micros");
+        if (f[EVENT_TYPE] == EVENT_COMPACTION) {
+            lua_pushinteger(L, f[EVENT_INPUTS]);
+            lua_setfield(L, -2, "inputs");
+            lua_pushinteger(L, f[EVENT_INPUTS_NEXT]);
+            lua_setfield(L, -2, "inputsNext");
+        }
+        lua_pushinteger(L, f[EVENT_TIME]);
+        lua_setfield(L, -2, "time");
+        lua_rawseti(L, -2, ++n);
+    }
+    lua_pushinteger(L, last);
+    lua_pushinteger(L, dropped);
+    return 3;
+}
+
+// ldb:events([sinceSeq]), returns events, lastSeq, dropped
+int lvldb_database_events(lua_State *L) {
+    DbState *state = check_db_state(L, 1);
+    lua_Integer since = luaL_optinteger(L, 2, 0);
+    if (!state->m_event_log) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return state->m_event_log->Push(L, since > 0 ? (uint64_t)since : 0);
+}
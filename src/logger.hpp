@@ -0,0 +1,46 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <leveldb/env.h>
+#include <atomic>
+#include <vector>
+
+enum DbEventType { EVENT_FLUSH = 1, EVENT_COMPACTION, EVENT_MOVE, EVENT_ERROR };
+
+enum DbEventField {
+    EVENT_TYPE,
+    EVENT_LEVEL,
+    EVENT_BYTES,
+    EVENT_MICROS,
+    EVENT_INPUTS,
+    EVENT_INPUTS_NEXT,
+    EVENT_TIME,
+    EVENT_FIELDS
+};
+
+// one ring slot, guarded by its own sequence number (seqlock) so readers never block the logger
+struct DbEventSlot {
+    std::atomic<uint64_t> seq;
+    std::atomic<int64_t> fields[EVENT_FIELDS];
+};
+
+// leveldb info logger that keeps flush and compaction events in a bounded ring buffer
+// instead of writing the LOG file
+class EventLogger : public Logger {
+public:
+    EventLogger(size_t capacity);
+
+    void Logv(const char *format, va_list ap) override;
+    // pushes the events after sinceSeq, returns the number of results
+    int Push(lua_State *L, uint64_t sinceSeq);
+
+private:
+    void Append(const int64_t *fields);
+
+    vector<DbEventSlot> m_slots;
+    std::atomic<uint64_t> m_next_seq;
+    // leveldb logs start and end of a job from its single background thread
+    std::atomic<uint64_t> m_flush_start;
+    std::atomic<uint64_t> m_compaction_start;
+};
+
+int lvldb_database_events(lua_State *L);
@@ -17,6 +17,7 @@ struct DbRef {
 };
 
 map<string, DbRef> g_register_dbs;
+map<void *, DbState *> g_db_states;
 mutex g_mutex;
 void *l_get_db(const string &db_path) {
     std::lock_guard<std::mutex> guard(g_mutex);
@@ -37,6 +38,27 @@ void l_ref_db(void *db) {
     }
 }
 
+void *l_acquire_db(const string &db_path) {
+    std::lock_guard<std::mutex> guard(g_mutex);
+    auto it = g_register_dbs.find(db_path);
+    if (it == g_register_dbs.end()) {
+        return nullptr;
+    }
+    it->second.refCount++;
+    return it->second.db;
+}
+
+void *l_publish_db(const string &db_path, void *db) {
+    std::lock_guard<std::mutex> guard(g_mutex);
+    auto it = g_register_dbs.find(db_path);
+    if (it != g_register_dbs.end()) {
+        it->second.refCount++;
+        return it->second.db;
+    }
+    g_register_dbs.insert(std::make_pair(db_path, DbRef{ db, 1 }));
+    return db;
+}
+
 void l_register_db(const string &db_path, void *db) {
     std::lock_guard<std::mutex> guard(g_mutex);
     auto it = g_register_dbs.find(db_path);
@@ -47,7 +69,8 @@ void l_register_db(const string &db_path, void *db) {
     }
 }
 
-void l_unregister_db(void *db, const std::function<void(void *)> &delete_cb) {
+bool l_unregister_db(void *db, const std::function<void(void *)> &delete_cb) {
+    DbState *state = nullptr;
     {
         std::lock_guard<std::mutex> guard(g_mutex);
         for (auto it = g_register_dbs.begin(); it != g_register_dbs.end(); ++it) {
@@ -56,49 +79,111 @@ void l_unregister_db(void *db, const std::function<void(void *)> &delete_cb) {
                     g_register_dbs.erase(it);
                     break;
                 }
-                return;
+                return false;
             }
         }
+        auto it = g_db_states.find(db);
+        if (it != g_db_states.end()) {
+            state = it->second;
+            g_db_states.erase(it);
+        }
+    }
+    if (state) {
+        state->Close();
     }
     delete_cb(db);
+    // the env wrappers must outlive the DB
+    delete state;
+    return true;
+}
+
+DbState *l_get_db_state(void *db) {
+    std::lock_guard<std::mutex> guard(g_mutex);
+    auto it = g_db_states.find(db);
+    return it == g_db_states.end() ? nullptr : it->second;
+}
+
+// publishes a new db and its state together, so no opener finds the db without its state;
+// returns the db registered first when another thread opened the same path meanwhile
+static DB *register_opened_db(const string &path, DB *db, DbState *state) {
+    std::lock_guard<std::mutex> guard(g_mutex);
+    auto it = g_register_dbs.find(path);
+    if (it != g_register_dbs.end()) {
+        it->second.refCount++;
+        return (DB *)it->second.db;
+    }
+    g_register_dbs.insert(std::make_pair(path, DbRef{ db, 1 }));
+    g_db_states[db] = state;
+    return db;
+}
+
+Status l_open_db(const MyOptions &opt, const string &path, DB **db, DbState **state) {
+    *db = (DB *)l_acquire_db(path);
+    if (!*db) {
+        DbState *st = new DbState();
+        Status s = DB::Open(st->Setup(opt, path), path, db);
+        if (s.ok()) {
+            s = st->Open(opt, path, *db);
+            if (!s.ok()) {
+                st->Close();
+                delete *db;
+            }
+        }
+        if (!s.ok()) {
+            delete st;
+            return s;
+        }
+        DB *registered = register_opened_db(path, *db, st);
+        if (registered != *db) {
+            st->Close();
+            delete *db;
+            delete st;
+            *db = registered;
+        }
+    }
+    if (state) {
+        *state = l_get_db_state(*db);
+    }
+    return Status::OK();
 }
 
 int lvldb_open(lua_State *L) {
     DB *db;
-    Options *opt = check_options(L, 1);
+    DbState *state;
+    MyOptions *opt = check_options(L, 1);
     const char *filename = luaL_checkstring(L, 2);
 
-    Status s;
-    db = (DB *)l_get_db(filename);
-    if (!db) {
-        s = DB::Open(*(opt), filename, &db);
-    }
-
+    Status s = l_open_db(*opt, filename, &db, &state);
     if (!s.ok())
         luaL_error(L, "lvldb_open: Error opening creating database: %s", s.ToString().c_str());
     else {
-        *(DB**)lua_newuserdata(L, sizeof(DB**)) = db;
+        LuaDB *ud = (LuaDB *)lua_newuserdata(L, sizeof(LuaDB));
+        ud->db = db;
+        ud->state = state;
         luaL_getmetatable(L, LVLDB_MT_DB);
         lua_setmetatable(L, -2);
-        l_register_db(filename, db);
     }
     return 1;
 }
 
 int lvldb_close(lua_State *L) {
-    DB **db = (DB **)luaL_checkudata(L, 1, LVLDB_MT_DB);
-    if (*db) {
-        l_unregister_db(*db, [](void *db) {
+    LuaDB *ud = (LuaDB *)luaL_checkudata(L, 1, LVLDB_MT_DB);
+    if (ud->db) {
+        uint64_t id = ud->state ? ud->state->m_id : 0;
+        bool closed = l_unregister_db(ud->db, [](void *db) {
             delete (DB *)db;
         });
-        *db = nullptr;
+        ud->db = nullptr;
+        if (closed && id) {
+            l_forget_slow_write(L, id);
+        }
     }
     return 0;
 }
 
 int lvldb_options(lua_State *L) {
-    Options *optp = (Options *)lua_newuserdata(L, sizeof(Options));
-    new (optp) Options();
+    MyOptions *optp = (MyOptions *)lua_newuserdata(L, sizeof(MyOptions));
+    new (optp) MyOptions();
     luaL_getmetatable(L, LVLDB_MT_OPT);
     lua_setmetatable(L, -2);
     return 1;
@@ -122,13 +207,18 @@ int lvldb_batch(lua_State *L) {
     lua_setmetatable(L, -2);
     if (!name.empty()) {
         l_register_db(name, batchp);
+        MemoryAccountant::Instance().Register(batchp, "batch:" + name, false);
     }
     return 1;
 }
 
 int lvldb_raw_batch(lua_State *L) {
-    WriteBatch *batchp = (WriteBatch *)lua_newuserdata(L, sizeof(WriteBatch));
-    new (batchp) WriteBatch;
+    RawBatch *batchp = (RawBatch *)lua_newuserdata(L, sizeof(RawBatch));
+    new (batchp) RawBatch;
+    if (lua_gettop(L) >= 1 && !lua_isnil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+        batchp->m_defer_compress = lua_toboolean(L, 1);
+    }
     luaL_getmetatable(L, LVLDB_MT_RAW_BATCH);
     lua_setmetatable(L, -2);
     return 1;
@@ -191,139 +281,19 @@ int lvldb_miniz_decompress(lua_State *L) {
     return 1;
 }
 
-// base64
-#define SMALL_CHUNK 256
-static int
-lb64encode(lua_State *L) {
-	static const char* encoding = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-	size_t sz = 0;
-	const uint8_t * text = (const uint8_t *)luaL_checklstring(L, 1, &sz);
-	int encode_sz = int((sz + 2)/3*4);
-	char tmp[SMALL_CHUNK];
-	char *buffer = tmp;
-	if (encode_sz > SMALL_CHUNK) {
-		buffer = (char*)lua_newuserdata(L, encode_sz);
-	}
-	int i,j;
-	j=0;
-	for (i=0;i<(int)sz-2;i+=3) {
-		uint32_t v = text[i] << 16 | text[i+1] << 8 | text[i+2];
-		buffer[j] = encoding[v >> 18];
-		buffer[j+1] = encoding[(v >> 12) & 0x3f];
-		buffer[j+2] = encoding[(v >> 6) & 0x3f];
-		buffer[j+3] = encoding[(v) & 0x3f];
-		j+=4;
-	}
-	int padding = int(sz-i);
-	uint32_t v;
-	switch(padding) {
-	case 1 :
-		v = text[i];
-		buffer[j] = encoding[v >> 2];
-		buffer[j+1] = encoding[(v & 3) << 4];
-		buffer[j+2] = '=';
-		buffer[j+3] = '=';
-		break;
-	case 2 :
-		v = text[i] << 8 | text[i+1];
-		buffer[j] = encoding[v >> 10];
-		buffer[j+1] = encoding[(v >> 4) & 0x3f];
-		buffer[j+2] = encoding[(v & 0xf) << 2];
-		buffer[j+3] = '=';
-		break;
-	}
-	lua_pushlstring(L, buffer, encode_sz);
-	return 1;
-}
-
-static inline int
-b64index(uint8_t c) {
-	static const int decoding[] = {62,-1,-1,-1,63,52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-2,-1,-1,-1,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,-1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51};
-	int decoding_size = sizeof(decoding)/sizeof(decoding[0]);
-	if (c<43) {
-		return -1;
-	}
-	c -= 43;
-	if (c>=decoding_size)
-		return -1;
-	return decoding[c];
-}
-
-static int
-lb64decode(lua_State *L) {
-	size_t sz = 0;
-	const uint8_t * text = (const uint8_t *)luaL_checklstring(L, 1, &sz);
-	int decode_sz = int((sz+3)/4*3);
-	char tmp[SMALL_CHUNK];
-	char *buffer = tmp;
-	if (decode_sz > SMALL_CHUNK) {
-		buffer = (char*)lua_newuserdata(L, decode_sz);
-	}
-	int i,j;
-	int output = 0;
-	for (i=0;i<sz;) {
-		int padding = 0;
-		int c[4];
-		for (j=0;j<4;) {
-			if (i>=sz) {
-				return luaL_error(L, "Invalid base64 text");
-			}
-			c[j] = b64index(text[i]);
-			if (c[j] == -1) {
-				++i;
-				continue;
-			}
-			if (c[j] == -2) {
-				++padding;
-			}
-			++i;
-			++j;
-		}
-		uint32_t v;
-		switch (padding) {
-		case 0:
-			v = (unsigned)c[0] << 18 | c[1] << 12 | c[2] << 6 | c[3];
-			buffer[output] = v >> 16;
-			buffer[output+1] = (v >> 8) & 0xff;
-			buffer[output+2] = v & 0xff;
-			output += 3;
-			break;
-		case 1:
-			if (c[3] != -2 || (c[2] & 3)!=0) {
-				return luaL_error(L, "Invalid base64 text");
-			}
-			v = (unsigned)c[0] << 10 | c[1] << 4 | c[2] >> 2 ;
-			buffer[output] = v >> 8;
-			buffer[output+1] = v & 0xff;
-			output += 2;
-			break;
-		case 2:
-			if (c[3] != -2 || c[2] != -2 || (c[1] & 0xf) !=0)  {
-				return luaL_error(L, "Invalid base64 text");
-			}
-			v = (unsigned)c[0] << 2 | c[1] >> 4;
-			buffer[output] = v;
-			++ output;
-			break;
-		default:
-			return luaL_error(L, "Invalid base64 text");
-		}
-	}
-	lua_pushlstring(L, buffer, output);
-	return 1;
-}
-
 // empty
 static const struct luaL_Reg E[] = { {NULL, NULL} };
 
 // main methods
 static const luaL_Reg lvldb_leveldb_m[] = {
     {"open", lvldb_open},
+    {"openSharded", lvldb_open_sharded},
     {"close", lvldb_close},
     {"options", lvldb_options},
     {"readOptions", lvldb_read_options},
     {"writeOptions", lvldb_write_options},
     {"repair", lvldb_repair},
+    {"import", lvldb_import},
     {"rawbatch", lvldb_raw_batch},
     {"check", lvldb_check},
     {"now", lvldb_now},
@@ -331,8 +301,13 @@ static const luaL_Reg lvldb_leveldb_m[] = {
     {"tick", lvldb_tick},
     {"mz_compress", lvldb_miniz_compress},
     {"mz_decompress", lvldb_miniz_decompress},
-	{"base64encode", lb64encode},
-	{"base64decode", lb64decode},
+    {"base64encode", lvldb_base64_encode},
+    {"base64decode", lvldb_base64_decode},
+    {"base64encoder", lvldb_base64_encoder},
+    {"deflater", lvldb_deflater},
+    {"inflater", lvldb_inflater},
+    {"memory", lvldb_memory},
+    {"setMemoryBudget", lvldb_set_memory_budget},
     {NULL, NULL} };
 
 // options methods
@@ -354,6 +329,17 @@ static const Xet_reg_pre options_getsets[] = {
     {"blockSize", get_size, set_size, offsetof(Options, block_size)},
     {"blockRestartInterval", get_int, set_int, offsetof(Options, block_restart_interval)},
     {"maxFileSize", get_int, set_int, offsetof(Options, max_file_size)},
+    {"ioStats", FIELD_XET(MyOptions, bool, IoStats, get_bool, set_bool)},
+    {"rateLimit", FIELD_XET(MyOptions, lua_Integer, RateLimit, get_size, set_size)},
+    {"rateLimitAuto", FIELD_XET(MyOptions, bool, RateLimitAuto, get_bool, set_bool)},
+    {"rateLimitLatency", FIELD_XET(MyOptions, int, RateLimitLatency, get_int, set_int)},
+    {"inMemory", FIELD_XET(MyOptions, bool, InMemory, get_bool, set_bool)},
+    {"eventLog", FIELD_XET(MyOptions, int, EventLog, get_int, set_int)},
+    {"valueLog", FIELD_XET(MyOptions, size_t, ValueLog, get_size, set_size)},
+    {"valueLogFileSize", FIELD_XET(MyOptions, size_t, ValueLogFileSize, get_size, set_size)},
+    {"counterFlush", FIELD_XET(MyOptions, int, CounterFlush, get_int, set_int)},
+    {"keyFilter", FIELD_XET(MyOptions, int, KeyFilter, get_int, set_int)},
+    {"hotRanges", FIELD_XET(MyOptions, int, HotRanges, get_int, set_int)},
     {NULL, NULL} };
 
 // read options methods
@@ -363,9 +349,10 @@ static const luaL_Reg lvldb_read_options_m[] = {
 
 // read options getters
 static const Xet_reg_pre read_options_getsets[] = {
-    {"verifyChecksum", get_bool, set_bool, offsetof(MyReadOptions, verify_checksums)},
-    {"fillCache", get_bool, set_bool, offsetof(MyReadOptions, fill_cache)},
-    {"decompress", get_bool, set_bool, offsetof(MyReadOptions, UnCompress)},
+    {"verifyChecksum", get_bool, set_bool, offsetof(ReadOptions, verify_checksums)},
+    {"fillCache", get_bool, set_bool, offsetof(ReadOptions, fill_cache)},
+    {"decompress", FIELD_XET(MyReadOptions, bool, UnCompress, get_bool, set_bool)},
+    {"inflateLimit", FIELD_XET(MyReadOptions, size_t, InflateLimit, get_size, set_size)},
     {NULL, NULL} };
 
 // write options methods
@@ -375,13 +362,14 @@ static const luaL_Reg lvldb_write_options_m[] = {
 
 // write options getters
 static const Xet_reg_pre write_options_getsets[] = {
-    {"sync", get_bool, set_bool, offsetof(MyWriteOptions, sync)},
-    {"compress", get_bool, set_bool, offsetof(MyWriteOptions, Compress)},
+    {"sync", get_bool, set_bool, offsetof(WriteOptions, sync)},
+    {"compress", FIELD_XET(MyWriteOptions, bool, Compress, get_bool, set_bool)},
     {NULL, NULL} };
 
 // database methods
 static const luaL_Reg lvldb_database_m[] = {
     {"put", lvldb_database_put},
+    {"putMany", lvldb_database_put_many},
     {"get", lvldb_database_get},
     {"batch", lvldb_batch},
     {"close", lvldb_close},
@@ -390,9 +378,52 @@ static const luaL_Reg lvldb_database_m[] = {
     {"iterator", lvldb_database_iterator},
     {"write", lvldb_database_write},
     {"snapshot", lvldb_database_snapshot},
+    {"export", lvldb_database_export},
+    {"aggregate", lvldb_database_aggregate},
+    {"digest", lvldb_database_digest},
+    {"ioStats", lvldb_database_io_stats},
+    {"resetIoStats", lvldb_database_reset_io_stats},
+    {"setRateLimit", lvldb_database_set_rate_limit},
+    {"rateLimitStats", lvldb_database_rate_limit_stats},
+    {"persistTo", lvldb_database_persist_to},
+    {"tryPut", lvldb_database_try_put},
+    {"tryWrite", lvldb_database_try_write},
+    {"writeStats", lvldb_database_write_stats},
+    {"onSlowWrite", lvldb_database_on_slow_write},
+    {"events", lvldb_database_events},
+    {"valueLogStats", lvldb_database_value_log_stats},
+    {"valueLogGc", lvldb_database_value_log_gc},
+    {"incr", lvldb_database_incr},
+    {"counter", lvldb_database_counter},
+    {"flushCounters", lvldb_database_flush_counters},
+    {"counterStats", lvldb_database_counter_stats},
+    {"transaction", lvldb_database_transaction},
+    {"transactionStats", lvldb_database_transaction_stats},
+    {"keyFilterStats", lvldb_database_key_filter_stats},
+    {"rebuildKeyFilter", lvldb_database_rebuild_key_filter},
+    {"watch", lvldb_database_watch},
+    {"warmup", lvldb_database_warmup},
+    {"warmupProgress", lvldb_database_warmup_progress},
+    {"namespace", lvldb_database_namespace},
+    {"deleteRange", lvldb_database_delete_range},
+    {"deleteRangeStats", lvldb_database_delete_range_stats},
+    {"scan", lvldb_database_scan},
     {"__gc", lvldb_close},
     {NULL, NULL} };
 
+// sharded database methods
+static const luaL_Reg lvldb_sharded_m[] = {
+    {"put", lvldb_sharded_put},
+    {"get", lvldb_sharded_get},
+    {"batch", lvldb_sharded_batch},
+    {"close", lvldb_sharded_close},
+    {"has", lvldb_sharded_has},
+    {"delete", lvldb_sharded_del},
+    {"iterator", lvldb_sharded_iterator},
+    {"write", lvldb_sharded_write},
+    {"__gc", lvldb_sharded_close},
+    {NULL, NULL} };
+
 // iterator methods
 static const struct luaL_Reg lvldb_iterator_m[] = {
     {"del", lvldb_iterator_delete},
@@ -410,6 +441,7 @@ static const struct luaL_Reg lvldb_iterator_m[] = {
 // batch methods
 static const luaL_Reg lvldb_batch_m[] = {
     {"put", lvldb_batch_put},
+    {"putMany", lvldb_batch_put_many},
     {"get", lvldb_batch_get},
     {"lock", lvldb_batch_lock},
     {"close", lvldb_batch_close},
@@ -418,19 +450,77 @@ static const luaL_Reg lvldb_batch_m[] = {
     {"set_int_param", lvldb_batch_set_int_param},
     {"set_str_param", lvldb_batch_set_str_param},
     {"set_need_lock", lvldb_batch_set_need_lock},
+    {"set_defer_compress", lvldb_batch_set_defer_compress},
+    {"set_coalesce", lvldb_batch_set_coalesce},
+    {"coalesce_stats", lvldb_batch_coalesce_stats},
     {"delete", lvldb_batch_del},
+    {"deleteMany", lvldb_batch_del_many},
+    {"incr", lvldb_batch_incr},
     {"clear", lvldb_batch_clear},
     {"__gc", lvdb_batch_gc},
     {NULL, NULL} };
 
+// transaction methods
+static const luaL_Reg lvldb_txn_m[] = {
+    {"get", lvldb_txn_get},
+    {"put", lvldb_txn_put},
+    {"delete", lvldb_txn_del},
+    {"commit", lvldb_txn_commit},
+    {"rollback", lvldb_txn_rollback},
+    {"__gc", lvldb_txn_gc},
+    {NULL, NULL} };
+
+// namespace methods
+static const luaL_Reg lvldb_ns_m[] = {
+    {"put", lvldb_ns_put},
+    {"get", lvldb_ns_get},
+    {"has", lvldb_ns_has},
+    {"delete", lvldb_ns_del},
+    {"iterator", lvldb_ns_iterator},
+    {"batch", lvldb_ns_batch},
+    {"write", lvldb_ns_write},
+    {"stats", lvldb_ns_stats},
+    {"drop", lvldb_ns_drop},
+    {"__gc", lvldb_ns_gc},
+    {NULL, NULL} };
+
+// change feed subscription methods
+static const luaL_Reg lvldb_watch_m[] = {
+    {"poll", lvldb_watch_poll},
+    {"stats", lvldb_watch_stats},
+    {"close", lvldb_watch_close},
+    {"__gc", lvldb_watch_close},
+    {NULL, NULL} };
+
 // batch methods
 static const luaL_Reg lvldb_raw_batch_m[] = {
     {"put", lvldb_raw_batch_put},
+    {"putMany", lvldb_raw_batch_put_many},
     {"delete", lvldb_raw_batch_del},
+    {"deleteMany", lvldb_raw_batch_del_many},
     {"clear", lvldb_raw_batch_clear},
+    {"set_defer_compress", lvldb_raw_batch_set_defer_compress},
     {"__gc", lvldb_raw_batch_gc},
     {NULL, NULL} };
 
+// base64 stream encoder methods
+static const luaL_Reg lvldb_base64_encoder_m[] = {
+    {"update", lvldb_base64_encoder_update},
+    {"finish", lvldb_base64_encoder_finish},
+    {NULL, NULL} };
+// streaming compressor methods
+static const luaL_Reg lvldb_deflater_m[] = {
+    {"update", lvldb_deflater_update},
+    {"finish", lvldb_deflater_finish},
+    {"__gc", lvldb_deflater_gc},
+    {NULL, NULL} };
+
+// streaming decompressor methods
+static const luaL_Reg lvldb_inflater_m[] = {
+    {"update", lvldb_inflater_update},
+    {"finish", lvldb_inflater_finish},
+    {"__gc", lvldb_inflater_gc},
+    {NULL, NULL} };
 
 extern "C"
 {
@@ -452,12 +542,19 @@ extern "C"
 
         // initialize meta-tables methods
         init_metatable(L, LVLDB_MT_DB, lvldb_database_m);
+        init_metatable(L, LVLDB_MT_SHARDED, lvldb_sharded_m);
         init_metatable(L, LVLDB_MT_OPT, lvldb_options_m, options_getsets);
         init_metatable(L, LVLDB_MT_ROPT, lvldb_read_options_m, read_options_getsets);
         init_metatable(L, LVLDB_MT_WOPT, lvldb_write_options_m, write_options_getsets);
         init_metatable(L, LVLDB_MT_ITER, lvldb_iterator_m);
         init_metatable(L, LVLDB_MT_BATCH, lvldb_batch_m);
         init_metatable(L, LVLDB_MT_RAW_BATCH, lvldb_raw_batch_m);
+        init_metatable(L, LVLDB_MT_TXN, lvldb_txn_m);
+        init_metatable(L, LVLDB_MT_WATCH, lvldb_watch_m);
+        init_metatable(L, LVLDB_MT_NS, lvldb_ns_m);
+        init_metatable(L, LVLDB_MT_B64_ENC, lvldb_base64_encoder_m);
+        init_metatable(L, LVLDB_MT_DEFLATER, lvldb_deflater_m);
+        init_metatable(L, LVLDB_MT_INFLATER, lvldb_inflater_m);
 
         return 1;
     }
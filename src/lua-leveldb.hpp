@@ -5,7 +5,27 @@
 #include "meta.hpp"
 #include "lib.hpp"
 
+#include "aggregate.hpp"
+#include "base64.hpp"
 #include "batch.hpp"
+#include "counter.hpp"
 #include "db.hpp"
+#include "delrange.hpp"
+#include "digest.hpp"
+#include "dump.hpp"
+#include "ffi.hpp"
 #include "iter.hpp"
+#include "keyfilter.hpp"
+#include "logger.hpp"
+#include "memory.hpp"
+#include "namespace.hpp"
 #include "opt.hpp"
+#include "scan.hpp"
+#include "sharded.hpp"
+#include "stall.hpp"
+#include "state.hpp"
+#include "txn.hpp"
+#include "vlog.hpp"
+#include "warmup.hpp"
+#include "watch.hpp"
+#include "zstream.hpp"
@@ -0,0 +1,156 @@
+﻿#include "memory.hpp"
+#include "env.hpp"
+#include <string.h>
+
+// the polled part of the budget check is refreshed at most this often
+#define MEMORY_POLL_MICROS 100000
+
+static const char *const mem_category_names[MEM_CATEGORIES] = { "memtable", "blockCache", "batch", "compression", "keyFilter", "counters" };
+
+MemoryAccountant &MemoryAccountant::Instance() {
+    static MemoryAccountant instance;
+    return instance;
+}
+
+MemoryAccountant::MemoryAccountant() : m_polled(0), m_polled_at(0), m_budget(0), m_flush(false), m_rejects(0), m_flushes(0) {
+    for (int i = 0; i < MEM_CATEGORIES; i++) {
+        m_tracked[i] = 0;
+    }
+}
+
+void MemoryAccountant::Register(MemoryOwner *owner, const string &name, bool polled) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    Entry &entry = m_owners[owner];
+    entry.name = name;
+    entry.polled = polled;
+}
+
+void MemoryAccountant::Unregister(MemoryOwner *owner) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_owners.erase(owner);
+}
+
+void MemoryAccountant::SetBudget(int64_t bytes, bool flush) {
+    m_budget = bytes;
+    m_flush = flush;
+}
+
+// caller holds m_mutex
+int64_t MemoryAccountant::PollOwners() {
+    int64_t total = 0;
+    for (auto &it : m_owners) {
+        if (it.second.polled) {
+            int64_t bytes[MEM_CATEGORIES] = { 0 };
+            it.first->MemoryUsage(bytes);
+            for (int i = 0; i < MEM_CATEGORIES; i++) {
+                total += bytes[i];
+            }
+        }
+    }
+    m_polled = total;
+    m_polled_at = now_micros();
+    return total;
+}
+
+bool MemoryAccountant::OverBudget() {
+    int64_t budget = m_budget;
+    if (budget <= 0) {
+        return false;
+    }
+    int64_t total = 0;
+    for (int i = 0; i < MEM_CATEGORIES; i++) {
+        total += m_tracked[i];
+    }
+    if (now_micros() - m_polled_at > MEMORY_POLL_MICROS) {
+        std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            PollOwners();
+        }
+    }
+    return total + m_polled > budget;
+}
+
+void MemoryAccountant::Push(lua_State *L) {
+    int64_t categories[MEM_CATEGORIES];
+    for (int i = 0; i < MEM_CATEGORIES; i++) {
+        categories[i] = m_tracked[i];
+    }
+    // collected first, raising a Lua error must not leave the mutex locked
+    struct Usage {
+        string name;
+        int64_t bytes[MEM_CATEGORIES];
+    };
+    vector<Usage> usages;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        usages.resize(m_owners.size());
+        int64_t polled = 0;
+        size_t n = 0;
+        for (auto &it : m_owners) {
+            Usage &u = usages[n++];
+            u.name = it.second.name;
+            memset(u.bytes, 0, sizeof(u.bytes));
+            it.first->MemoryUsage(u.bytes);
+            for (int i = 0; i < MEM_CATEGORIES && it.second.polled; i++) {
+                categories[i] += u.bytes[i];
+                polled += u.bytes[i];
+            }
+        }
+        m_polled = polled;
+        m_polled_at = now_micros();
+    }
+    lua_createtable(L, 0, 8);
+    lua_createtable(L, 0, (int)usages.size());
+    for (auto &u : usages) {
+        int64_t sum = 0;
+        lua_createtable(L, 0, MEM_CATEGORIES + 1);
+        for (int i = 0; i < MEM_CATEGORIES; i++) {
+            if (u.bytes[i] != 0) {
+                lua_pushinteger(L, (lua_Integer)u.bytes[i]);
+                lua_setfield(L, -2, mem_category_names[i]);
+            }
+            sum += u.bytes[i];
+        }
+        lua_pushinteger(L, (lua_Integer)sum);
+        lua_setfield(L, -2, "total");
+        lua_setfield(L, -2, u.name.c_str());
+    }
+    lua_setfield(L, -2, "objects");
+    int64_t total = 0;
+    lua_createtable(L, 0, MEM_CATEGORIES);
+    for (int i = 0; i < MEM_CATEGORIES; i++) {
+        lua_pushinteger(L, (lua_Integer)categories[i]);
+        lua_setfield(L, -2, mem_category_names[i]);
+        total += categories[i];
+    }
+    lua_setfield(L, -2, "categories");
+    lua_pushinteger(L, (lua_Integer)total);
+    lua_setfield(L, -2, "total");
+    int64_t budget = m_budget;
+    lua_pushinteger(L, (lua_Integer)budget);
+    lua_setfield(L, -2, "budget");
+    lua_pushboolean(L, budget > 0 && total > budget);
+    lua_setfield(L, -2, "overBudget");
+    lua_pushstring(L, m_flush ? "flush" : "fail");
+    lua_setfield(L, -2, "mode");
+    lua_pushinteger(L, (lua_Integer)m_rejects.load());
+    lua_setfield(L, -2, "rejects");
+    lua_pushinteger(L, (lua_Integer)m_flushes.load());
+    lua_setfield(L, -2, "flushes");
+}
+
+// lualeveldb.memory()
+int lvldb_memory(lua_State *L) {
+    MemoryAccountant::Instance().Push(L);
+    return 1;
+}
+
+// lualeveldb.setMemoryBudget(bytes, [mode]), mode is "fail" (default) or "flush"
+int lvldb_set_memory_budget(lua_State *L) {
+    lua_Integer bytes = luaL_checkinteger(L, 1);
+    const char *mode = luaL_optstring(L, 2, "fail");
+    luaL_argcheck(L, bytes >= 0, 1, "budget must not be negative");
+    luaL_argcheck(L, strcmp(mode, "fail") == 0 || strcmp(mode, "flush") == 0, 2, "mode must be \"fail\" or \"flush\"");
+    MemoryAccountant::Instance().SetBudget(bytes, strcmp(mode, "flush") == 0);
+    return 0;
+}
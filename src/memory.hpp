@@ -0,0 +1,68 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <atomic>
+#include <map>
+#include <mutex>
+
+enum MemCategory {
+    MEM_MEMTABLE,
+    MEM_BLOCK_CACHE,
+    MEM_BATCH,
+    MEM_COMPRESSION,
+    MEM_KEY_FILTER,
+    MEM_COUNTERS,
+    MEM_CATEGORIES
+};
+
+// rough per entry cost of the hash containers behind batch overlays and counter caches
+#define MEM_ENTRY_OVERHEAD 48
+
+class MemoryOwner {
+public:
+    virtual ~MemoryOwner() {}
+    // adds the bytes held right now to bytes[MEM_CATEGORIES]
+    virtual void MemoryUsage(int64_t *bytes) = 0;
+};
+
+// process wide view of the memory held by the binding. Databases are polled, batches and
+// compression state report their changes as they happen so the budget check stays cheap.
+class MemoryAccountant {
+public:
+    static MemoryAccountant &Instance();
+
+    // polled owners are asked for their usage, the others only name bytes already passed to Account
+    void Register(MemoryOwner *owner, const string &name, bool polled);
+    void Unregister(MemoryOwner *owner);
+    void Account(MemCategory cat, int64_t delta) { m_tracked[cat] += delta; }
+
+    // 0 disables the budget, flush makes oversized batches write themselves instead of failing
+    void SetBudget(int64_t bytes, bool flush);
+    bool OverBudget();
+    bool FlushOnBudget() const { return m_flush; }
+    void RecordReject() { m_rejects++; }
+    void RecordFlush() { m_flushes++; }
+
+    void Push(lua_State *L);
+
+private:
+    MemoryAccountant();
+    int64_t PollOwners();
+
+    struct Entry {
+        string name;
+        bool polled;
+    };
+
+    std::mutex m_mutex;
+    std::map<MemoryOwner *, Entry> m_owners;
+    std::atomic<int64_t> m_tracked[MEM_CATEGORIES];
+    std::atomic<int64_t> m_polled;
+    std::atomic<uint64_t> m_polled_at;
+    std::atomic<int64_t> m_budget;
+    std::atomic<bool> m_flush;
+    std::atomic<uint64_t> m_rejects;
+    std::atomic<uint64_t> m_flushes;
+};
+
+int lvldb_memory(lua_State *L);
+int lvldb_set_memory_budget(lua_State *L);
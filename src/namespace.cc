@@ -0,0 +1,232 @@
+﻿#include "namespace.hpp"
+#include "batch.hpp"
+#include "db.hpp"
+#include "env.hpp"
+#include "iter.hpp"
+#include "range.hpp"
+#include "stall.hpp"
+#include "state.hpp"
+#include <memory>
+
+// keeps an iterator inside the namespace and hides the prefix from its keys
+class PrefixIterator : public Iterator {
+public:
+    PrefixIterator(Iterator *it, const string &prefix, const string &limit) : m_it(it), m_prefix(prefix), m_limit(limit) {}
+
+    virtual bool Valid() const { return m_it->Valid() && m_it->key().starts_with(m_prefix); }
+    virtual void SeekToFirst() { m_it->Seek(m_prefix); }
+    virtual void SeekToLast() {
+        if (m_limit.empty()) {
+            m_it->SeekToLast();
+            return;
+        }
+        m_it->Seek(m_limit);
+        if (m_it->Valid()) {
+            m_it->Prev();
+        } else {
+            m_it->SeekToLast();
+        }
+    }
+    virtual void Seek(const Slice &target) {
+        m_key.assign(m_prefix);
+        m_key.append(target.data(), target.size());
+        m_it->Seek(m_key);
+    }
+    virtual void Next() { m_it->Next(); }
+    virtual void Prev() { m_it->Prev(); }
+    virtual Slice key() const {
+        Slice key = m_it->key();
+        key.remove_prefix(m_prefix.size());
+        return key;
+    }
+    virtual Slice value() const { return m_it->value(); }
+    virtual Status status() const { return m_it->status(); }
+
+private:
+    std::unique_ptr<Iterator> m_it;
+    string m_prefix;
+    string m_limit;
+    string m_key;
+};
+
+Namespace::Namespace(DB *db, const Slice &prefix) : m_db(db), m_prefix(prefix.ToString()) {
+    m_state = l_get_db_state(db);
+    m_limit = prefix_successor(m_prefix);
+    l_ref_db(db);
+}
+
+Namespace::~Namespace() {
+    l_unregister_db(m_db, [](void *db) {
+        delete (DB *)db;
+    });
+}
+
+Slice Namespace::Key(lua_State *L, int idx) {
+    size_t len = 0;
+    const char *data = luaL_checklstring(L, idx, &len);
+    m_key.assign(m_prefix);
+    m_key.append(data, len);
+    return m_key;
+}
+
+static Namespace *check_ns(lua_State *L, int index) {
+    Namespace *ns = *(Namespace **)luaL_checkudata(L, index, LVLDB_MT_NS);
+    luaL_argcheck(L, ns != nullptr, index, "namespace is closed");
+    return ns;
+}
+
+// ldb:namespace(name), name is used as the raw key prefix
+int lvldb_database_namespace(lua_State *L) {
+    DB *db = check_database(L, 1);
+    Slice prefix = lua_to_slice(L, 2);
+    luaL_argcheck(L, !prefix.empty(), 2, "namespace name must not be empty");
+    Namespace **ns = (Namespace **)lua_newuserdata(L, sizeof(Namespace *));
+    *ns = nullptr;
+    luaL_getmetatable(L, LVLDB_MT_NS);
+    lua_setmetatable(L, -2);
+    *ns = new Namespace(db, prefix);
+    return 1;
+}
+
+int lvldb_ns_put(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    Slice key = ns->Key(L, 2);
+    Slice value = lua_to_slice(L, 3);
+    auto wopt = lvldb_wopt(L, 4);
+    Status s;
+    uint64_t start = now_micros();
+    if (wopt.Compress) {
+        size_t outLen = 0;
+        void *p = tdefl_compress_mem_to_heap(value.data(), value.size(), &outLen, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+        if (!p) {
+            luaL_error(L, "compress failed");
+        }
+        s = ns->m_state->Put(ns->m_db, wopt, key, Slice((const char *)p, outLen));
+        mz_free(p);
+    } else {
+        s = ns->m_state->Put(ns->m_db, wopt, key, value);
+    }
+    l_record_write(L, ns->m_db, ns->m_state, now_micros() - start, wopt.sync);
+    lua_pushboolean(L, s.ok());
+    return 1;
+}
+
+int lvldb_ns_get(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    Slice key = ns->Key(L, 2);
+    auto ropt = lvldb_ropt(L, 3);
+    string value;
+    Status s = ns->m_state->Get(ns->m_db, ropt, key, &value);
+    if (!s.ok()) {
+        lua_pushnil(L);
+    } else if (!ropt.UnCompress) {
+        lua_pushlstring(L, value.c_str(), value.size());
+    } else if (!miniz_uncompress(L, value.c_str(), value.size(), ropt.InflateLimit)) {
+        lua_pushliteral(L, "inflateLimit exceeded");
+        return 2;
+    }
+    return 1;
+}
+
+int lvldb_ns_has(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    Slice key = ns->Key(L, 2);
+    auto ropt = lvldb_ropt(L, 3);
+    if (!ns->m_state->MayExist(ropt, key)) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    Status s = ns->m_db->Get(ropt, key, nullptr);
+    if (s.IsNotFound()) {
+        ns->m_state->RecordMiss(ropt);
+    }
+    lua_pushboolean(L, s.ok());
+    return 1;
+}
+
+int lvldb_ns_del(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    Slice key = ns->Key(L, 2);
+    auto wopt = lvldb_wopt(L, 3);
+    uint64_t start = now_micros();
+    Status s = ns->m_state->Delete(ns->m_db, wopt, key);
+    l_record_write(L, ns->m_db, ns->m_state, now_micros() - start, wopt.sync);
+    lua_pushboolean(L, s.ok());
+    return 1;
+}
+
+// the iterator is a plain leveldb.iter, bounded to the namespace and positioned with bare keys
+int lvldb_ns_iterator(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    auto ropt = lvldb_ropt(L, 2);
+    push_iter(L, new PrefixIterator(ns->m_state->NewIterator(ns->m_db, ropt), ns->m_prefix, ns->m_limit), ropt);
+    return 1;
+}
+
+// ns:batch([deferCompress]), a rawbatch whose put/delete keys get the namespace prefix
+int lvldb_ns_batch(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    RawBatch *batchp = (RawBatch *)lua_newuserdata(L, sizeof(RawBatch));
+    new (batchp) RawBatch;
+    batchp->m_prefix = ns->m_prefix;
+    if (lua_gettop(L) >= 2 && !lua_isnil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TBOOLEAN);
+        batchp->m_defer_compress = lua_toboolean(L, 2);
+    }
+    luaL_getmetatable(L, LVLDB_MT_RAW_BATCH);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int lvldb_ns_write(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    RawBatch *rawbatch = check_raw_writebatch(L, 2);
+    auto wopt = lvldb_wopt(L, 3);
+    uint64_t start = now_micros();
+    if (!rawbatch->Flush()) {
+        luaL_error(L, "compress failed");
+    }
+    ns->m_state->Write(ns->m_db, wopt, rawbatch);
+    rawbatch->Clear();
+    l_record_write(L, ns->m_db, ns->m_state, now_micros() - start, wopt.sync);
+    return 0;
+}
+
+// ns:stats(), on-disk size of the namespace from GetApproximateSizes, unflushed writes are not counted
+int lvldb_ns_stats(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    string limit = ns->m_limit.empty() ? ns->m_prefix + string(8, '\xff') : ns->m_limit;
+    Range range(ns->m_prefix, limit);
+    uint64_t size = 0;
+    ns->m_db->GetApproximateSizes(&range, 1, &size);
+    lua_createtable(L, 0, 2);
+    lua_pushlstring(L, ns->m_prefix.data(), ns->m_prefix.size());
+    lua_setfield(L, -2, "prefix");
+    lua_pushinteger(L, (lua_Integer)size);
+    lua_setfield(L, -2, "approximateBytes");
+    return 1;
+}
+
+// ns:drop([compact]), deletes every key of the namespace and by default compacts the range away
+int lvldb_ns_drop(lua_State *L) {
+    Namespace *ns = check_ns(L, 1);
+    bool compact = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+    uint64_t deleted = 0;
+    Status s = ns->m_state->DeleteRange(ns->m_db, WriteOptions(), ns->m_prefix, ns->m_limit, DELETE_RANGE_BATCH_KEYS, &deleted);
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_ns_drop: %s", s.ToString().c_str());
+    }
+    if (compact) {
+        Slice begin(ns->m_prefix), end(ns->m_limit);
+        ns->m_db->CompactRange(&begin, ns->m_limit.empty() ? nullptr : &end);
+    }
+    lua_pushinteger(L, (lua_Integer)deleted);
+    return 1;
+}
+
+int lvldb_ns_gc(lua_State *L) {
+    Namespace **ns = (Namespace **)luaL_checkudata(L, 1, LVLDB_MT_NS);
+    delete *ns;
+    *ns = nullptr;
+    return 0;
+}
@@ -0,0 +1,34 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "utils.hpp"
+
+class DbState;
+
+// leveldb.ns userdata: a key prefix on one db, prepended in C++ so Lua passes the bare keys
+class Namespace {
+public:
+    Namespace(DB *db, const Slice &prefix);
+    ~Namespace();
+
+    // prefix + the string at idx, valid until the next call
+    Slice Key(lua_State *L, int idx);
+
+    DB *m_db;
+    DbState *m_state;
+    string m_prefix;
+    // first key past the namespace, empty when the prefix is all 0xff
+    string m_limit;
+    string m_key;
+};
+
+int lvldb_database_namespace(lua_State *L);
+int lvldb_ns_put(lua_State *L);
+int lvldb_ns_get(lua_State *L);
+int lvldb_ns_has(lua_State *L);
+int lvldb_ns_del(lua_State *L);
+int lvldb_ns_iterator(lua_State *L);
+int lvldb_ns_batch(lua_State *L);
+int lvldb_ns_write(lua_State *L);
+int lvldb_ns_stats(lua_State *L);
+int lvldb_ns_drop(lua_State *L);
+int lvldb_ns_gc(lua_State *L);
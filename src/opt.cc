@@ -46,7 +46,7 @@ int set_bool(lua_State *L, void *v) {
 }
 
 int lvldb_options_tostring(lua_State *L) {
-    Options *opt = check_options(L, 1);
+    MyOptions *opt = check_options(L, 1);
 
     ostringstream oss(ostringstream::out);
     oss << "Comparator: " << opt->comparator->Name()
@@ -54,7 +54,12 @@ int lvldb_options_tostring(lua_State *L) {
         << "\nError if exists: " << bool_tostring(opt->error_if_exists)
         << "\nParanoid checks: " << bool_tostring(opt->paranoid_checks)
         << "\nEnvironment: " << pointer_tostring(opt->env)
+        << "\nIn memory: " << bool_tostring(opt->InMemory)
+        << "\nIO stats: " << bool_tostring(opt->IoStats)
+        << "\nRate limit: " << opt->RateLimit << (opt->RateLimitAuto ? " (auto)" : "")
         << "\nInfo log: " << pointer_tostring(opt->info_log)
+        << "\nEvent log: " << opt->EventLog
+        << "\nValue log: " << opt->ValueLog << " (file size " << opt->ValueLogFileSize << ")"
         << "\nWrite buffer size: " << opt->write_buffer_size
         << "\nMax open files: " << opt->max_open_files
         << "\nBlock cache: " << pointer_tostring(opt->block_cache)
@@ -85,6 +90,7 @@ int lvldb_read_options_tostring(lua_State *L) {
     oss << "Verify checksum: " << bool_tostring(ropt->verify_checksums)
         << "\nFill cache: " << bool_tostring(ropt->fill_cache)
         << "\nDeCompress: " << bool_tostring(ropt->UnCompress)
+        << "\nInflate limit: " << ropt->InflateLimit
         << "\nSnapshot: " << ropt->snapshot << endl;
     lua_pushstring(L, oss.str().c_str());
     return 1;
@@ -13,6 +13,14 @@ int set_size(lua_State *L, void *v);
 int get_bool(lua_State *L, void *v);
 int set_bool(lua_State *L, void *v);
 
+// get/set of a field of MyOptions & co, which are not standard-layout and so rule out
+// offsetof: registered with offset 0, the field is reached through a member pointer
+template <typename S, typename T, T S::*Field, int (*Func)(lua_State *, void *)>
+int field_xet(lua_State *L, void *v) {
+    return Func(L, &(((S *)v)->*Field));
+}
+#define FIELD_XET(S, T, field, get, set) field_xet<S, T, &S::field, get>, field_xet<S, T, &S::field, set>, 0
+
 int lvldb_options_tostring(lua_State *L);
 int lvldb_read_options(lua_State *L);
 int lvldb_read_options_tostring(lua_State *L);
@@ -0,0 +1,91 @@
+﻿#include "pool.hpp"
+#include <algorithm>
+#include <memory>
+
+WorkerPool &WorkerPool::Instance() {
+    static WorkerPool pool(std::max(2u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+WorkerPool::WorkerPool(size_t threads) : m_stop(false) {
+    for (size_t i = 0; i < threads; i++) {
+        m_threads.emplace_back([this]() { Run(); });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    for (auto &t : m_threads) {
+        t.join();
+    }
+}
+
+void WorkerPool::Post(std::function<void()> &&task) {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_tasks.emplace_back(std::move(task));
+    }
+    m_cond.notify_one();
+}
+
+void WorkerPool::Run() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+            if (m_stop && m_tasks.empty()) {
+                return;
+            }
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void WorkerPool::ParallelFor(size_t n, const std::function<void(size_t)> &fn, size_t parallel) {
+    if (n == 0) {
+        return;
+    }
+    if (parallel == 0 || parallel > Size() + 1) {
+        parallel = Size() + 1;
+    }
+    if (parallel > n) {
+        parallel = n;
+    }
+
+    struct Shared {
+        std::atomic<size_t> next;
+        std::atomic<size_t> finished;
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+    auto shared = std::make_shared<Shared>();
+    shared->next = 0;
+    shared->finished = 0;
+
+    // a late worker finds no index left and never touches fn after we return
+    const std::function<void(size_t)> *pfn = &fn;
+    std::function<void()> worker = [shared, n, pfn]() {
+        size_t i;
+        while ((i = shared->next++) < n) {
+            (*pfn)(i);
+            if (++shared->finished == n) {
+                std::lock_guard<std::mutex> guard(shared->mutex);
+                shared->cond.notify_all();
+            }
+        }
+    };
+    for (size_t i = 1; i < parallel; i++) {
+        Post(std::function<void()>(worker));
+    }
+    worker();
+
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->cond.wait(lock, [&]() { return shared->finished == n; });
+}
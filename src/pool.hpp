@@ -0,0 +1,30 @@
+﻿#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+    static WorkerPool &Instance();
+
+    WorkerPool(size_t threads);
+    ~WorkerPool();
+
+    // runs fn(0..n-1) on the pool, the calling thread helps and returns when all are done
+    void ParallelFor(size_t n, const std::function<void(size_t)> &fn, size_t parallel = 0);
+    size_t Size() const { return m_threads.size(); }
+
+private:
+    void Post(std::function<void()> &&task);
+    void Run();
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<std::function<void()>> m_tasks;
+    std::vector<std::thread> m_threads;
+    bool m_stop;
+};
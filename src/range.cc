@@ -0,0 +1,122 @@
+﻿#include "range.hpp"
+#include <memory>
+
+static size_t common_prefix_len(const string &a, const string &b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+static void bucket_sizes(DB *db, const vector<string> &keys, vector<uint64_t> &sizes) {
+    vector<Range> ranges;
+    for (size_t i = 0; i + 1 < keys.size(); i++) {
+        ranges.push_back(Range(keys[i], keys[i + 1]));
+    }
+    sizes.assign(ranges.size(), 0);
+    if (!ranges.empty()) {
+        db->GetApproximateSizes(ranges.data(), (int)ranges.size(), sizes.data());
+    }
+}
+
+vector<string> split_range(DB *db, const ReadOptions &ropt, const string &from, const string &to, size_t parts) {
+    vector<string> bounds;
+    bounds.push_back(from);
+    string first, last;
+    if (parts > 1) {
+        std::unique_ptr<Iterator> it(db->NewIterator(ropt));
+        it->Seek(from);
+        if (it->Valid() && (to.empty() || it->key().compare(to) < 0)) {
+            first = it->key().ToString();
+            if (to.empty()) {
+                it->SeekToLast();
+            } else {
+                it->Seek(to);
+                if (it->Valid()) {
+                    it->Prev();
+                } else {
+                    it->SeekToLast();
+                }
+            }
+            if (it->Valid()) {
+                last = it->key().ToString();
+            }
+        }
+    }
+    if (first >= last) {
+        bounds.push_back(to);
+        return bounds;
+    }
+
+    // bucket keys on the first byte after the common prefix of the real first/last keys
+    size_t p = common_prefix_len(first, last);
+    string prefix = first.substr(0, p);
+    int lo = first.size() > p ? (uint8_t)first[p] : -1;
+    int hi = (uint8_t)last[p];
+    vector<string> keys;
+    keys.push_back(first);
+    for (int b = lo + 1; b <= hi; b++) {
+        keys.push_back(prefix + char(b));
+    }
+    keys.push_back(last + '\0');
+
+    vector<uint64_t> sizes;
+    bucket_sizes(db, keys, sizes);
+    uint64_t total = 0;
+    for (auto s : sizes) {
+        total += s;
+    }
+    if (total == 0) {
+        bounds.push_back(to);
+        return bounds;
+    }
+
+    // heavy buckets get one more byte of resolution
+    vector<string> refined;
+    for (size_t i = 0; i + 1 < keys.size(); i++) {
+        refined.push_back(keys[i]);
+        if (sizes[i] * parts <= total) {
+            continue;
+        }
+        string base = i == 0 ? (lo >= 0 ? prefix + char(lo) : prefix) : keys[i];
+        for (int b = 16; b < 256; b += 16) {
+            string k = base + char(b);
+            if (k > keys[i] && k < keys[i + 1]) {
+                refined.push_back(k);
+            }
+        }
+    }
+    refined.push_back(keys.back());
+    bucket_sizes(db, refined, sizes);
+
+    uint64_t acc = 0;
+    size_t k = 1;
+    for (size_t i = 0; i + 2 < refined.size() && k < parts; i++) {
+        acc += sizes[i];
+        if (acc * parts >= total * k) {
+            const string &cut = refined[i + 1];
+            if (cut > bounds.back() && (to.empty() || cut < to)) {
+                bounds.push_back(cut);
+            }
+            while (k < parts && acc * parts >= total * k) {
+                k++;
+            }
+        }
+    }
+    bounds.push_back(to);
+    return bounds;
+}
+
+string prefix_successor(const string &prefix) {
+    string limit = prefix;
+    while (!limit.empty()) {
+        uint8_t c = (uint8_t)limit.back();
+        if (c != 0xff) {
+            limit.back() = char(c + 1);
+            return limit;
+        }
+        limit.pop_back();
+    }
+    return limit;
+}
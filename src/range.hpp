@@ -0,0 +1,11 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <vector>
+
+// Splits [from, to) into at most `parts` sub-ranges of similar on-disk size
+// using GetApproximateSizes. An empty `to` means the end of the database.
+// The result holds the boundaries: front() == from, back() == to.
+vector<string> split_range(DB *db, const ReadOptions &ropt, const string &from, const string &to, size_t parts);
+
+// smallest key greater than every key starting with prefix, empty when there is none
+string prefix_successor(const string &prefix);
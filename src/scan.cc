@@ -0,0 +1,225 @@
+﻿#include "scan.hpp"
+#include "db.hpp"
+#include "range.hpp"
+#include "state.hpp"
+#include <algorithm>
+#include <memory>
+
+// supports '*' and '?', matched against raw key bytes
+bool glob_match(const char *pat, const char *pend, const char *str, const char *send) {
+    const char *star = nullptr, *retry = nullptr;
+    while (str < send) {
+        if (pat < pend && (*pat == '?' || *pat == *str)) {
+            pat++;
+            str++;
+        } else if (pat < pend && *pat == '*') {
+            star = pat++;
+            retry = str;
+        } else if (star) {
+            pat = star + 1;
+            str = ++retry;
+        } else {
+            return false;
+        }
+    }
+    while (pat < pend && *pat == '*') {
+        pat++;
+    }
+    return pat == pend;
+}
+
+ScanFilter::ScanFilter()
+    : m_has_regex(false), m_min_value_len(-1), m_max_value_len(-1), m_has_value_match(false), m_value_offset(0),
+      m_keys_only(false), m_count_only(false), m_limit(-1) {}
+
+void ScanFilter::Parse(lua_State *L, int idx) {
+    m_from = opt_string_field(L, idx, "from");
+    m_to = opt_string_field(L, idx, "to");
+    m_glob = opt_string_field(L, idx, "glob");
+    string regex = opt_string_field(L, idx, "regex");
+    if (!regex.empty()) {
+        string err;
+        try {
+            m_regex.assign(regex, std::regex::ECMAScript | std::regex::optimize);
+        } catch (const std::regex_error &e) {
+            err = e.what();
+        }
+        if (!err.empty()) {
+            luaL_error(L, "invalid regex: %s", err.c_str());
+        }
+        m_has_regex = true;
+    }
+    m_min_value_len = opt_int_field(L, idx, "minValueLen", -1);
+    m_max_value_len = opt_int_field(L, idx, "maxValueLen", -1);
+    m_keys_only = opt_bool_field(L, idx, "keysOnly", false);
+    m_count_only = opt_bool_field(L, idx, "countOnly", false);
+    m_limit = opt_int_field(L, idx, "limit", -1);
+
+    lua_getfield(L, idx, "prefixes");
+    if (!lua_isnil(L, -1)) {
+        luaL_checktype(L, -1, LUA_TTABLE);
+        for (lua_Integer i = 1;; i++) {
+            lua_rawgeti(L, -1, i);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                break;
+            }
+            size_t len = 0;
+            const char *p = luaL_checklstring(L, -1, &len);
+            m_prefixes.push_back(string(p, len));
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    // valueMatch = {offset=N, bytes="..."}
+    lua_getfield(L, idx, "valueMatch");
+    if (!lua_isnil(L, -1)) {
+        luaL_checktype(L, -1, LUA_TTABLE);
+        int top = lua_gettop(L);
+        lua_Integer offset = opt_int_field(L, top, "offset", 0);
+        luaL_argcheck(L, offset >= 0, idx, "valueMatch.offset must not be negative");
+        m_value_offset = (size_t)offset;
+        m_value_bytes = opt_string_field(L, top, "bytes");
+        m_has_value_match = true;
+    }
+    lua_pop(L, 1);
+}
+
+bool ScanFilter::MatchKey(const Slice &key) const {
+    if (!m_glob.empty() && !glob_match(m_glob.data(), m_glob.data() + m_glob.size(), key.data(), key.data() + key.size())) {
+        return false;
+    }
+    if (m_has_regex && !std::regex_search(key.data(), key.data() + key.size(), m_regex)) {
+        return false;
+    }
+    return true;
+}
+
+bool ScanFilter::MatchValue(const Slice &val) const {
+    if (m_min_value_len >= 0 && val.size() < (uint64_t)m_min_value_len) {
+        return false;
+    }
+    if (m_max_value_len >= 0 && val.size() > (uint64_t)m_max_value_len) {
+        return false;
+    }
+    if (m_has_value_match) {
+        if (val.size() < m_value_offset || val.size() - m_value_offset < m_value_bytes.size()) {
+            return false;
+        }
+        if (memcmp(val.data() + m_value_offset, m_value_bytes.data(), m_value_bytes.size()) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+vector<std::pair<string, string>> ScanFilter::Ranges() const {
+    vector<std::pair<string, string>> ranges;
+    if (m_prefixes.empty()) {
+        ranges.push_back(std::make_pair(m_from, m_to));
+        return ranges;
+    }
+    auto prefixes = m_prefixes;
+    std::sort(prefixes.begin(), prefixes.end());
+    string covering;
+    bool has_covering = false;
+    for (auto &p : prefixes) {
+        // "ab" is already visited through "a"
+        if (has_covering && Slice(p).starts_with(covering)) {
+            continue;
+        }
+        covering = p;
+        has_covering = true;
+        string lo = std::max(p, m_from);
+        string hi = prefix_successor(p);
+        if (!m_to.empty() && (hi.empty() || m_to < hi)) {
+            hi = m_to;
+        }
+        if (!hi.empty() && lo >= hi) {
+            continue;
+        }
+        ranges.push_back(std::make_pair(lo, hi));
+    }
+    return ranges;
+}
+
+// ldb:scan(filter, [readopts])
+//   countOnly: returns count, nextKey
+//   otherwise: returns keys, values (nil with keysOnly), nextKey
+//   nil, "inflateLimit exceeded" when a decompressed value goes over readopts.inflateLimit
+int lvldb_database_scan(lua_State *L) {
+    DB *db = check_database(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    ScanFilter filter;
+    filter.Parse(L, 2);
+    auto ropt = lvldb_ropt(L, 3);
+
+    int keys_idx = 0, vals_idx = 0;
+    if (!filter.m_count_only) {
+        lua_newtable(L);
+        keys_idx = lua_gettop(L);
+        if (!filter.m_keys_only) {
+            lua_newtable(L);
+            vals_idx = lua_gettop(L);
+        }
+    }
+
+    std::unique_ptr<Iterator> it(check_db_state(L, 1)->NewIterator(db, ropt));
+    lua_Integer count = 0;
+    bool more = false;
+    auto ranges = filter.Ranges();
+    for (size_t r = 0; r < ranges.size() && !more; r++) {
+        const string &to = ranges[r].second;
+        for (it->Seek(ranges[r].first); it->Valid(); it->Next()) {
+            Slice key = it->key();
+            if (!to.empty() && key.compare(to) >= 0) {
+                break;
+            }
+            if (filter.m_limit >= 0 && count >= filter.m_limit) {
+                more = true;
+                break;
+            }
+            if (!filter.MatchKey(key)) {
+                continue;
+            }
+            Slice val;
+            if (filter.NeedValue()) {
+                val = it->value();
+                if (!filter.MatchValue(val)) {
+                    continue;
+                }
+            }
+            count++;
+            if (keys_idx) {
+                lua_pushlstring(L, key.data(), key.size());
+                lua_rawseti(L, keys_idx, count);
+            }
+            if (vals_idx) {
+                if (ropt.UnCompress) {
+                    // a nil hole would shift values against keys, the whole scan fails instead
+                    if (!miniz_uncompress(L, val.data(), val.size(), ropt.InflateLimit)) {
+                        lua_pushliteral(L, "inflateLimit exceeded");
+                        return 2;
+                    }
+                } else {
+                    lua_pushlstring(L, val.data(), val.size());
+                }
+                lua_rawseti(L, vals_idx, count);
+            }
+        }
+    }
+
+    if (filter.m_count_only) {
+        lua_pushinteger(L, count);
+    } else if (!vals_idx) {
+        lua_pushnil(L);
+    }
+    if (more) {
+        Slice key = it->key();
+        lua_pushlstring(L, key.data(), key.size());
+    } else {
+        lua_pushnil(L);
+    }
+    return filter.m_count_only ? 2 : 3;
+}
@@ -0,0 +1,37 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "utils.hpp"
+#include <regex>
+#include <vector>
+
+class ScanFilter {
+public:
+    ScanFilter();
+
+    void Parse(lua_State *L, int idx);
+    bool MatchKey(const Slice &key) const;
+    bool MatchValue(const Slice &val) const;
+    bool NeedValue() const { return !m_keys_only || HasValueFilter(); }
+    bool HasValueFilter() const { return m_min_value_len >= 0 || m_max_value_len >= 0 || m_has_value_match; }
+    // [from, to) ranges to visit, one per prefix when prefixes are given
+    vector<std::pair<string, string>> Ranges() const;
+
+    string m_from;
+    string m_to;
+    vector<string> m_prefixes;
+    string m_glob;
+    bool m_has_regex;
+    std::regex m_regex;
+    int64_t m_min_value_len;
+    int64_t m_max_value_len;
+    bool m_has_value_match;
+    size_t m_value_offset;
+    string m_value_bytes;
+    bool m_keys_only;
+    bool m_count_only;
+    int64_t m_limit;
+};
+
+bool glob_match(const char *pat, const char *pend, const char *str, const char *send);
+
+int lvldb_database_scan(lua_State *L);
@@ -0,0 +1,429 @@
+﻿#include "sharded.hpp"
+#include "batch.hpp"
+#include "iter.hpp"
+#include "pool.hpp"
+#include "state.hpp"
+#include <leveldb/env.h>
+#include <stdio.h>
+
+class MergedIterator : public Iterator {
+public:
+    MergedIterator(const vector<Iterator *> &children) : m_children(children), m_current(nullptr), m_forward(true) {}
+
+    ~MergedIterator() {
+        for (auto child : m_children) {
+            delete child;
+        }
+    }
+
+    bool Valid() const override { return m_current != nullptr; }
+
+    void SeekToFirst() override {
+        for (auto child : m_children) {
+            child->SeekToFirst();
+        }
+        FindSmallest();
+        m_forward = true;
+    }
+
+    void SeekToLast() override {
+        for (auto child : m_children) {
+            child->SeekToLast();
+        }
+        FindLargest();
+        m_forward = false;
+    }
+
+    void Seek(const Slice &target) override {
+        for (auto child : m_children) {
+            child->Seek(target);
+        }
+        FindSmallest();
+        m_forward = true;
+    }
+
+    void Next() override {
+        // every child except the current one has to be moved past key()
+        if (!m_forward) {
+            string k = key().ToString();
+            for (auto child : m_children) {
+                if (child != m_current) {
+                    child->Seek(k);
+                    if (child->Valid() && child->key() == Slice(k)) {
+                        child->Next();
+                    }
+                }
+            }
+            m_forward = true;
+        }
+        m_current->Next();
+        FindSmallest();
+    }
+
+    void Prev() override {
+        if (m_forward) {
+            string k = key().ToString();
+            for (auto child : m_children) {
+                if (child != m_current) {
+                    child->Seek(k);
+                    if (child->Valid()) {
+                        child->Prev();
+                    } else {
+                        child->SeekToLast();
+                    }
+                }
+            }
+            m_forward = false;
+        }
+        m_current->Prev();
+        FindLargest();
+    }
+
+    Slice key() const override { return m_current->key(); }
+    Slice value() const override { return m_current->value(); }
+
+    Status status() const override {
+        for (auto child : m_children) {
+            Status s = child->status();
+            if (!s.ok()) {
+                return s;
+            }
+        }
+        return Status::OK();
+    }
+
+private:
+    void FindSmallest() {
+        m_current = nullptr;
+        for (auto child : m_children) {
+            if (child->Valid() && (!m_current || child->key().compare(m_current->key()) < 0)) {
+                m_current = child;
+            }
+        }
+    }
+
+    void FindLargest() {
+        m_current = nullptr;
+        for (auto child : m_children) {
+            if (child->Valid() && (!m_current || child->key().compare(m_current->key()) > 0)) {
+                m_current = child;
+            }
+        }
+    }
+
+    vector<Iterator *> m_children;
+    Iterator *m_current;
+    bool m_forward;
+};
+
+Iterator *new_merged_iterator(const vector<Iterator *> &children) {
+    return new MergedIterator(children);
+}
+
+class ShardSplitter : public WriteBatch::Handler {
+public:
+    ShardSplitter(ShardedDB *db) : m_db(db), m_batches(db->m_shards.size()) {}
+    void Put(const Slice &key, const Slice &value) override { m_batches[m_db->Route(key)].Put(key, value); }
+    void Delete(const Slice &key) override { m_batches[m_db->Route(key)].Delete(key); }
+
+    ShardedDB *m_db;
+    vector<WriteBatch> m_batches;
+};
+
+ShardedDB::ShardedDB() : m_prefix_len(0) {}
+
+ShardedDB::~ShardedDB() {
+    for (auto db : m_shards) {
+        l_unregister_db(db, [](void *db) {
+            delete (DB *)db;
+        });
+    }
+}
+
+Status ShardedDB::Open(const MyOptions &opt, const string &path, size_t n) {
+    Env *env = opt.env ? opt.env : Env::Default();
+    env->CreateDir(path);
+
+    // the shard count and the route decide where a key lives, refuse to reopen
+    // with others; the file holds the count, a newline and RouteSpec()
+    string meta = path + "/SHARDS", content;
+    string spec = std::to_string(n) + "\n" + RouteSpec();
+    if (env->FileExists(meta)) {
+        Status s = ReadFileToString(env, meta, &content);
+        if (!s.ok()) {
+            return s;
+        }
+        size_t nl = content.find('\n');
+        string count = content.substr(0, nl);
+        string route = nl == string::npos ? string() : content.substr(nl + 1);
+        if ((size_t)atoll(count.c_str()) != n) {
+            return Status::InvalidArgument("shard count mismatch, db was created with", count);
+        }
+        if (route != RouteSpec()) {
+            return Status::InvalidArgument("shard route mismatch, db was created with", route.empty() ? "no route" : route);
+        }
+    } else if (opt.create_if_missing) {
+        Status s = WriteStringToFile(env, spec, meta);
+        if (!s.ok()) {
+            return s;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/shard-%03d", (int)i);
+        DB *db;
+        Status s = l_open_db(opt, path + name, &db);
+        if (!s.ok()) {
+            return s;
+        }
+        m_shards.push_back(db);
+    }
+    return Status::OK();
+}
+
+string ShardedDB::RouteSpec() const {
+    if (m_prefix_len > 0) {
+        return "prefix:" + std::to_string(m_prefix_len);
+    }
+    if (!m_separator.empty()) {
+        return "separator:" + m_separator;
+    }
+    return string();
+}
+
+size_t ShardedDB::Route(const Slice &key) const {
+    size_t len = key.size();
+    if (m_prefix_len > 0 && m_prefix_len < len) {
+        len = m_prefix_len;
+    } else if (!m_separator.empty()) {
+        auto pos = string(key.data(), key.size()).find(m_separator);
+        if (pos != string::npos) {
+            len = pos;
+        }
+    }
+    // FNV-1a, stable across builds since the routing is persisted on disk
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)key[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)(h % m_shards.size());
+}
+
+Status ShardedDB::Write(const WriteOptions &opt, WriteBatch *batch) {
+    ShardSplitter splitter(this);
+    Status s = batch->Iterate(&splitter);
+    if (!s.ok()) {
+        return s;
+    }
+    vector<size_t> targets;
+    size_t empty = WriteBatch().ApproximateSize();
+    for (size_t i = 0; i < splitter.m_batches.size(); i++) {
+        if (splitter.m_batches[i].ApproximateSize() > empty) {
+            targets.push_back(i);
+        }
+    }
+    vector<Status> results(targets.size());
+    WorkerPool::Instance().ParallelFor(targets.size(), [&](size_t i) {
+        results[i] = m_shards[targets[i]]->Write(opt, &splitter.m_batches[targets[i]]);
+    });
+    for (auto &r : results) {
+        if (!r.ok()) {
+            return r;
+        }
+    }
+    return Status::OK();
+}
+
+Iterator *ShardedDB::NewIterator(const ReadOptions &opt) {
+    vector<Iterator *> children;
+    for (auto db : m_shards) {
+        children.push_back(db->NewIterator(opt));
+    }
+    return new_merged_iterator(children);
+}
+
+ShardedDB *check_sharded(lua_State *L, int index) {
+    return *(ShardedDB **)luaL_checkudata(L, index, LVLDB_MT_SHARDED);
+}
+
+// lualeveldb.openSharded(path, nShards, [options], [route])
+int lvldb_open_sharded(lua_State *L) {
+    string path = luaL_checkstring(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n > 0, 2, "shard count must be positive");
+    MyOptions opt = lvldb_opt(L, 3);
+    luaL_argcheck(L, opt.ValueLog == 0, 3, "valueLog is not supported by sharded databases");
+    luaL_argcheck(L, opt.KeyFilter == 0, 3, "keyFilter is not supported by sharded databases");
+    luaL_argcheck(L, opt.HotRanges == 0, 3, "hotRanges is not supported by sharded databases");
+
+    ShardedDB route;
+    if (lua_gettop(L) >= 4 && !lua_isnil(L, 4)) {
+        if (lua_type(L, 4) == LUA_TNUMBER) {
+            lua_Integer len = luaL_checkinteger(L, 4);
+            luaL_argcheck(L, len >= 0, 4, "route prefix length must not be negative");
+            route.m_prefix_len = (size_t)len;
+        } else {
+            route.m_separator = luaL_checkstring(L, 4);
+        }
+    }
+
+    string name = SHARDED_REGISTER_PREFIX + path;
+    string err;
+    ShardedDB *db = (ShardedDB *)l_acquire_db(name);
+    if (!db) {
+        // first opens are serialized, a second opener shares the instance instead of failing on the shards' LOCK files
+        static std::mutex open_mutex;
+        std::lock_guard<std::mutex> guard(open_mutex);
+        db = (ShardedDB *)l_acquire_db(name);
+        if (!db) {
+            ShardedDB *opened = new ShardedDB();
+            opened->m_prefix_len = route.m_prefix_len;
+            opened->m_separator = route.m_separator;
+            Status s = opened->Open(opt, path, (size_t)n);
+            if (s.ok()) {
+                db = (ShardedDB *)l_publish_db(name, opened);
+            } else {
+                err = "Error opening creating database: " + s.ToString();
+            }
+            if (db != opened) {
+                delete opened;
+            }
+        }
+    } else if (db->m_shards.size() != (size_t)n) {
+        err = path + " is open with " + std::to_string(db->m_shards.size()) + " shards";
+    } else if (db->RouteSpec() != route.RouteSpec()) {
+        err = path + " is open with route '" + db->RouteSpec() + "'";
+    }
+    if (!err.empty()) {
+        if (db) {
+            l_unregister_db(db, [](void *db) {
+                delete (ShardedDB *)db;
+            });
+        }
+        return luaL_error(L, "lvldb_open_sharded: %s", err.c_str());
+    }
+
+    *(ShardedDB **)lua_newuserdata(L, sizeof(ShardedDB *)) = db;
+    luaL_getmetatable(L, LVLDB_MT_SHARDED);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int lvldb_sharded_close(lua_State *L) {
+    ShardedDB **db = (ShardedDB **)luaL_checkudata(L, 1, LVLDB_MT_SHARDED);
+    if (*db) {
+        l_unregister_db(*db, [](void *db) {
+            delete (ShardedDB *)db;
+        });
+        *db = nullptr;
+    }
+    return 0;
+}
+
+int lvldb_sharded_put(lua_State *L) {
+    ShardedDB *sdb = check_sharded(L, 1);
+    Slice key = lua_to_slice(L, 2);
+    Slice value = lua_to_slice(L, 3);
+    auto wopt = lvldb_wopt(L, 4);
+    DB *db = sdb->Shard(key);
+    Status s;
+    if (wopt.Compress) {
+        size_t outLen = 0;
+        void *p = tdefl_compress_mem_to_heap(value.data(), value.size(), &outLen, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+        if (!p) {
+            luaL_error(L, "compress failed");
+        }
+        s = db->Put(wopt, key, Slice((const char *)p, outLen));
+        mz_free(p);
+    } else {
+        s = db->Put(wopt, key, value);
+    }
+    lua_pushboolean(L, s.ok());
+    return 1;
+}
+
+int lvldb_sharded_get(lua_State *L) {
+    ShardedDB *sdb = check_sharded(L, 1);
+    Slice key = lua_to_slice(L, 2);
+    auto ropt = lvldb_ropt(L, 3);
+    string value;
+    Status s = sdb->Shard(key)->Get(ropt, key, &value);
+    if (s.ok()) {
+        if (ropt.UnCompress) {
+            if (!miniz_uncompress(L, value.c_str(), value.size(), ropt.InflateLimit)) {
+                lua_pushliteral(L, "inflateLimit exceeded");
+                return 2;
+            }
+        } else {
+            lua_pushlstring(L, value.c_str(), value.size());
+        }
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+int lvldb_sharded_has(lua_State *L) {
+    ShardedDB *sdb = check_sharded(L, 1);
+    Slice key = lua_to_slice(L, 2);
+    string value;
+    Status s = sdb->Shard(key)->Get(lvldb_ropt(L, 3), key, &value);
+    lua_pushboolean(L, s.ok());
+    return 1;
+}
+
+int lvldb_sharded_del(lua_State *L) {
+    ShardedDB *sdb = check_sharded(L, 1);
+    Slice key = lua_to_slice(L, 2);
+    Status s = sdb->Shard(key)->Delete(lvldb_wopt(L, 3), key);
+    lua_pushboolean(L, s.ok());
+    return 1;
+}
+
+int lvldb_sharded_write(lua_State *L) {
+    ShardedDB *sdb = check_sharded(L, 1);
+    auto ppBatch = (Batch **)luaL_testudata(L, 2, LVLDB_MT_BATCH);
+    if (ppBatch) {
+        (*ppBatch)->Write(L, sdb, lvldb_wopt(L, 3));
+    } else {
+        auto rawbatch = check_raw_writebatch(L, 2);
+        if (!rawbatch->Flush()) {
+            luaL_error(L, "compress failed");
+        }
+        sdb->Write(lvldb_wopt(L, 3), rawbatch);
+        rawbatch->Clear();
+    }
+    return 0;
+}
+
+int lvldb_sharded_batch(lua_State *L) {
+    string name;
+    Batch *batchp = nullptr;
+    ShardedDB *db = check_sharded(L, 1);
+    if (lua_gettop(L) >= 2) {
+        name = luaL_checkstring(L, 2);
+        batchp = (Batch *)l_get_db(name);
+    }
+
+    if (!batchp) {
+        batchp = new Batch(db);
+    }
+
+    *(Batch **)lua_newuserdata(L, sizeof(Batch *)) = batchp;
+    luaL_getmetatable(L, LVLDB_MT_BATCH);
+    lua_setmetatable(L, -2);
+    if (!name.empty()) {
+        l_register_db(name, batchp);
+        MemoryAccountant::Instance().Register(batchp, "batch:" + name, false);
+    }
+    return 1;
+}
+
+int lvldb_sharded_iterator(lua_State *L) {
+    ShardedDB *sdb = check_sharded(L, 1);
+    auto ropt = lvldb_ropt(L, 2);
+    push_iter(L, sdb->NewIterator(ropt), ropt);
+    return 1;
+}
@@ -0,0 +1,41 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "utils.hpp"
+#include <vector>
+
+#define SHARDED_REGISTER_PREFIX "sharded:"
+
+class ShardedDB {
+public:
+    ShardedDB();
+    ~ShardedDB();
+
+    Status Open(const MyOptions &opt, const string &path, size_t n);
+    size_t Route(const Slice &key) const;
+    // the routing as persisted in the SHARDS file
+    string RouteSpec() const;
+    DB *Shard(const Slice &key) const { return m_shards[Route(key)]; }
+    Status Write(const WriteOptions &opt, WriteBatch *batch);
+    Iterator *NewIterator(const ReadOptions &opt);
+
+    vector<DB *> m_shards;
+    // keys are routed by the hash of their first m_prefix_len bytes, or of the
+    // part before m_separator; the whole key is hashed when neither is set
+    size_t m_prefix_len;
+    string m_separator;
+};
+
+// merges the ordered iterators of all shards, takes ownership of children
+Iterator *new_merged_iterator(const vector<Iterator *> &children);
+
+ShardedDB *check_sharded(lua_State *L, int index);
+
+int lvldb_open_sharded(lua_State *L);
+int lvldb_sharded_close(lua_State *L);
+int lvldb_sharded_put(lua_State *L);
+int lvldb_sharded_get(lua_State *L);
+int lvldb_sharded_has(lua_State *L);
+int lvldb_sharded_del(lua_State *L);
+int lvldb_sharded_write(lua_State *L);
+int lvldb_sharded_batch(lua_State *L);
+int lvldb_sharded_iterator(lua_State *L);
@@ -0,0 +1,173 @@
+﻿#include "stall.hpp"
+#include "db.hpp"
+#include "state.hpp"
+#include <leveldb/cache.h>
+#include <stdlib.h>
+
+int DbState::Level0Files(DB *db) {
+    string v;
+    return db->GetProperty("leveldb.num-files-at-level0", &v) ? atoi(v.c_str()) : 0;
+}
+
+uint64_t DbState::MemtableBytes(DB *db) {
+    string v;
+    if (!db->GetProperty("leveldb.approximate-memory-usage", &v)) {
+        return 0;
+    }
+    // the property also counts the block cache
+    uint64_t total = strtoull(v.c_str(), nullptr, 10);
+    uint64_t cache = m_block_cache ? m_block_cache->TotalCharge() : 0;
+    return total > cache ? total - cache : 0;
+}
+
+const char *DbState::StallCause(DB *db) {
+    int l0 = Level0Files(db);
+    if (l0 >= L0_STOP_WRITES_TRIGGER) {
+        return "level0-stop";
+    }
+    if (l0 >= L0_SLOWDOWN_WRITES_TRIGGER) {
+        return "level0-slowdown";
+    }
+    // a full memtable while the previous one is still being flushed blocks the writer
+    if (MemtableBytes(db) * 4 >= (uint64_t)m_write_buffer_size * 7) {
+        return "memtable-full";
+    }
+    return nullptr;
+}
+
+bool WriteStats::Record(uint64_t micros) {
+    writes++;
+    this->micros += micros;
+    uint64_t max = max_micros;
+    while (micros > max && !max_micros.compare_exchange_weak(max, micros)) {
+    }
+    int64_t threshold = slow_threshold;
+    if (threshold <= 0 || micros < (uint64_t)threshold) {
+        return false;
+    }
+    slow_writes++;
+    return true;
+}
+
+void l_record_write(lua_State *L, int index, uint64_t micros, bool sync) {
+    LuaDB *ud = (LuaDB *)luaL_checkudata(L, index, LVLDB_MT_DB);
+    l_record_write(L, ud->db, ud->state, micros, sync);
+}
+
+void l_record_write(lua_State *L, DB *db, DbState *state, uint64_t micros, bool sync) {
+    if (!state) {
+        return;
+    }
+    if (!state->m_write_stats.Record(micros)) {
+        return;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LVLDB_SLOW_WRITE_CB);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pushinteger(L, (lua_Integer)state->m_id);
+    lua_rawget(L, -2);
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 2);
+        return;
+    }
+    const char *cause = state->StallCause(db);
+    lua_pushinteger(L, micros);
+    lua_pushstring(L, cause ? cause : (sync ? "sync" : "unknown"));
+    if (lua_pcall(L, 2, 0, 0)) {
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+void l_forget_slow_write(lua_State *L, uint64_t id) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LVLDB_SLOW_WRITE_CB);
+    if (lua_istable(L, -1)) {
+        lua_pushinteger(L, (lua_Integer)id);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+    }
+    lua_pop(L, 1);
+}
+
+static int push_busy(lua_State *L, DbState *state, DB *db) {
+    const char *cause = state->StallCause(db);
+    if (!cause) {
+        return 0;
+    }
+    state->m_write_stats.busy++;
+    lua_pushliteral(L, "busy");
+    lua_pushstring(L, cause);
+    return 2;
+}
+
+// ldb:tryPut(key, val, [writeopts]), returns "busy", cause instead of stalling
+int lvldb_database_try_put(lua_State *L) {
+    DB *db = check_database(L, 1);
+    int n = push_busy(L, check_db_state(L, 1), db);
+    return n ? n : lvldb_database_put(L);
+}
+
+int lvldb_database_try_write(lua_State *L) {
+    DB *db = check_database(L, 1);
+    int n = push_busy(L, check_db_state(L, 1), db);
+    if (n) {
+        return n;
+    }
+    lvldb_database_write(L);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+int lvldb_database_write_stats(lua_State *L) {
+    DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    WriteStats &stats = state->m_write_stats;
+    lua_newtable(L);
+    lua_pushinteger(L, stats.writes);
+    lua_setfield(L, -2, "writes");
+    lua_pushinteger(L, stats.micros);
+    lua_setfield(L, -2, "micros");
+    lua_pushinteger(L, stats.max_micros);
+    lua_setfield(L, -2, "maxMicros");
+    lua_pushinteger(L, stats.slow_writes);
+    lua_setfield(L, -2, "slowWrites");
+    lua_pushinteger(L, stats.busy);
+    lua_setfield(L, -2, "busy");
+    lua_pushinteger(L, state->Level0Files(db));
+    lua_setfield(L, -2, "level0Files");
+    lua_pushinteger(L, state->MemtableBytes(db));
+    lua_setfield(L, -2, "memtableBytes");
+    const char *cause = state->StallCause(db);
+    if (cause) {
+        lua_pushstring(L, cause);
+        lua_setfield(L, -2, "stallRisk");
+    }
+    return 1;
+}
+
+// ldb:onSlowWrite(thresholdMicros, [fn]), fn(micros, cause) runs in the writing VM
+int lvldb_database_on_slow_write(lua_State *L) {
+    DbState *state = check_db_state(L, 1);
+    lua_Integer threshold = luaL_checkinteger(L, 2);
+    lua_settop(L, 3);
+    if (!lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, LVLDB_SLOW_WRITE_CB);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LVLDB_SLOW_WRITE_CB);
+    }
+    // keyed by the state's id, a later db can get a freed state's address
+    lua_pushinteger(L, (lua_Integer)state->m_id);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    state->m_write_stats.slow_threshold = threshold;
+    return 0;
+}
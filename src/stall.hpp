@@ -0,0 +1,37 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "utils.hpp"
+#include <atomic>
+
+// leveldb's kL0_SlowdownWritesTrigger and kL0_StopWritesTrigger
+#define L0_SLOWDOWN_WRITES_TRIGGER 8
+#define L0_STOP_WRITES_TRIGGER 12
+
+#define LVLDB_SLOW_WRITE_CB "leveldb.slowwrite"
+
+class DbState;
+
+struct WriteStats {
+    WriteStats() : writes(0), micros(0), max_micros(0), slow_writes(0), busy(0), slow_threshold(0) {}
+
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> micros;
+    std::atomic<uint64_t> max_micros;
+    std::atomic<uint64_t> slow_writes;
+    std::atomic<uint64_t> busy;
+    std::atomic<int64_t> slow_threshold;
+
+    // counts a finished write, returns true when it was slow
+    bool Record(uint64_t micros);
+};
+
+// records a finished write of the db at `index` and fires the slow write callback
+void l_record_write(lua_State *L, int index, uint64_t micros, bool sync);
+void l_record_write(lua_State *L, DB *db, DbState *state, uint64_t micros, bool sync);
+// drops the slow write callback this VM registered for the db state with id, once the db is closed
+void l_forget_slow_write(lua_State *L, uint64_t id);
+
+int lvldb_database_try_put(lua_State *L);
+int lvldb_database_try_write(lua_State *L);
+int lvldb_database_write_stats(lua_State *L);
+int lvldb_database_on_slow_write(lua_State *L);
@@ -0,0 +1,401 @@
+﻿#include "state.hpp"
+#include "db.hpp"
+#include <leveldb/cache.h>
+#include <leveldb/helpers/memenv.h>
+#include <memory>
+
+#define PERSIST_BATCH_SIZE (4 * 1024 * 1024)
+// same as leveldb's internal default, owned here so its usage can be reported
+#define DEFAULT_BLOCK_CACHE_SIZE (8 * 1024 * 1024)
+#define DEFAULT_VALUE_LOG_FILE_SIZE (64 * 1024 * 1024)
+
+static std::atomic<uint64_t> g_next_state_id(0);
+
+DbState::DbState() : m_id(++g_next_state_id), m_db(nullptr), m_block_cache(nullptr), m_write_buffer_size(0), m_mem_env(nullptr), m_io_stats(nullptr), m_rate_limiter(nullptr), m_rate_limit_env(nullptr), m_event_log(nullptr), m_env(nullptr), m_vlog(nullptr), m_counters(nullptr), m_key_filter(nullptr), m_hot_keys(nullptr) {}
+
+DbState::~DbState() {
+    delete m_hot_keys;
+    delete m_counters;
+    if (m_key_filter) {
+        m_key_filter->Save(m_path);
+        delete m_key_filter;
+    }
+    delete m_vlog;
+    delete m_event_log;
+    delete m_rate_limit_env;
+    delete m_rate_limiter;
+    delete m_io_stats;
+    delete m_mem_env;
+    delete m_block_cache;
+}
+
+Options DbState::Setup(const MyOptions &opt, const string &path) {
+    m_path = path;
+    Options options = opt;
+    if (!options.block_cache) {
+        m_block_cache = NewLRUCache(DEFAULT_BLOCK_CACHE_SIZE);
+        options.block_cache = m_block_cache;
+    }
+    m_write_buffer_size = options.write_buffer_size;
+    if (opt.EventLog > 0 && !options.info_log) {
+        m_event_log = new EventLogger(opt.EventLog);
+        options.info_log = m_event_log;
+    }
+    Env *env = options.env ? options.env : Env::Default();
+    if (opt.InMemory) {
+        m_mem_env = NewMemEnv(env);
+        env = m_mem_env;
+    }
+    if (opt.IoStats) {
+        m_io_stats = new IoStatsEnv(env);
+        env = m_io_stats;
+    }
+    // stacked above the stats env so throttling sleeps are not counted as I/O latency
+    if (opt.RateLimit > 0) {
+        m_rate_limiter = new RateLimiter(opt.RateLimit, opt.RateLimitAuto, opt.RateLimitLatency);
+        m_rate_limit_env = new RateLimitEnv(env, m_rate_limiter);
+        env = m_rate_limit_env;
+    }
+    options.env = env;
+    m_env = env;
+    if (opt.KeyFilter > 0) {
+        // memenv dbs do not survive a restart, so their filter is not saved
+        m_key_filter = new KeyFilter(env, opt.InMemory ? string() : path + ".keyfilter", opt.KeyFilter);
+        m_key_filter->Load(path);
+    }
+    if (opt.HotRanges > 0) {
+        m_hot_keys = new HotKeys(env, opt.InMemory ? string() : path + ".hotkeys", opt.HotRanges);
+    }
+    return options;
+}
+
+Status DbState::Open(const MyOptions &opt, const string &path, DB *db) {
+    m_db = db;
+    if (opt.ValueLog > 0) {
+        size_t segmentSize = opt.ValueLogFileSize > 0 ? opt.ValueLogFileSize : DEFAULT_VALUE_LOG_FILE_SIZE;
+        m_vlog = new ValueLog(m_env, path + ".vlog", opt.ValueLog, segmentSize);
+        Status s = m_vlog->Open(db);
+        if (!s.ok()) {
+            return s;
+        }
+    }
+    m_counters = new Counters(this, db, opt.CounterFlush);
+    if (m_key_filter) {
+        m_key_filter->Start(this, db);
+    }
+    m_warmup.Attach(db, opt.block_size);
+    if (m_hot_keys) {
+        m_hot_keys->Replay(m_warmup, BlockCacheCapacity());
+    }
+    MemoryAccountant::Instance().Register(this, path, true);
+    return Status::OK();
+}
+
+void DbState::Close() {
+    // no more polling once the db is going away
+    MemoryAccountant::Instance().Unregister(this);
+    m_warmup.Stop();
+    m_range_deleter.Stop();
+    if (m_hot_keys) {
+        m_hot_keys->Save();
+    }
+    // written back through the value log, so stopped first
+    if (m_counters) {
+        m_counters->Close();
+    }
+    if (m_key_filter) {
+        m_key_filter->Close();
+    }
+    if (m_vlog) {
+        m_vlog->Close();
+    }
+}
+
+class KeyHashes : public WriteBatch::Handler {
+public:
+    virtual void Put(const Slice &key, const Slice &value) {
+        m_hashes.push_back(key_hash(key));
+        m_puts.push_back(m_hashes.back());
+    }
+    virtual void Delete(const Slice &key) { m_hashes.push_back(key_hash(key)); }
+
+    vector<uint64_t> m_hashes;
+    vector<uint64_t> m_puts;
+};
+
+// the stripes of every key in keys are held by the caller
+static Status write_keys(DbState *state, DB *db, const WriteOptions &opt, WriteBatch *batch, const KeyHashes &keys) {
+    // filtered before the write, so a reader never finds the key in leveldb but not in the filter
+    if (state->m_key_filter) {
+        for (auto hash : keys.m_puts) {
+            state->m_key_filter->Add(hash);
+        }
+    }
+    Status s = state->m_vlog ? state->m_vlog->Write(opt, batch) : db->Write(opt, batch);
+    if (s.ok()) {
+        if (state->m_counters) {
+            state->m_counters->Forget(batch);
+        }
+        for (auto hash : keys.m_hashes) {
+            state->m_versions.Bump(hash);
+        }
+        state->m_watchers.Publish(batch);
+    }
+    return s;
+}
+
+Status DbState::Put(DB *db, const WriteOptions &opt, const Slice &key, const Slice &value) {
+    StripeGuard guard(m_key_locks, m_key_locks.Mask(key));
+    return PutLocked(db, opt, key, value);
+}
+
+Status DbState::PutLocked(DB *db, const WriteOptions &opt, const Slice &key, const Slice &value) {
+    uint64_t hash = key_hash(key);
+    if (m_key_filter) {
+        m_key_filter->Add(hash);
+    }
+    Status s = m_vlog ? m_vlog->Put(opt, key, value) : db->Put(opt, key, value);
+    if (s.ok()) {
+        if (m_counters) {
+            m_counters->Forget(key);
+        }
+        m_versions.Bump(hash);
+        m_watchers.Publish(false, key, value);
+    }
+    return s;
+}
+
+Status DbState::Delete(DB *db, const WriteOptions &opt, const Slice &key) {
+    uint64_t hash = key_hash(key);
+    StripeGuard guard(m_key_locks, m_key_locks.MaskOf(hash));
+    Status s = m_vlog ? m_vlog->Delete(opt, key) : db->Delete(opt, key);
+    if (s.ok()) {
+        if (m_counters) {
+            m_counters->Forget(key);
+        }
+        m_versions.Bump(hash);
+        m_watchers.Publish(true, key, Slice());
+    }
+    return s;
+}
+
+Status DbState::Write(DB *db, const WriteOptions &opt, WriteBatch *batch) {
+    KeyHashes keys;
+    batch->Iterate(&keys);
+    uint64_t mask = 0;
+    for (auto hash : keys.m_hashes) {
+        mask |= m_key_locks.MaskOf(hash);
+    }
+    StripeGuard guard(m_key_locks, mask);
+    return write_keys(this, db, opt, batch, keys);
+}
+
+Status DbState::WriteLocked(DB *db, const WriteOptions &opt, WriteBatch *batch) {
+    KeyHashes keys;
+    batch->Iterate(&keys);
+    return write_keys(this, db, opt, batch, keys);
+}
+
+uint64_t DbState::KeyMask(WriteBatch *batch) {
+    KeyHashes keys;
+    batch->Iterate(&keys);
+    uint64_t mask = 0;
+    for (auto hash : keys.m_hashes) {
+        mask |= m_key_locks.MaskOf(hash);
+    }
+    return mask;
+}
+
+Status DbState::DeleteRange(DB *db, const WriteOptions &opt, const string &from, const string &to, size_t batchKeys, uint64_t *deleted,
+                            const std::atomic<bool> *stop) {
+    ReadOptions ropt;
+    ropt.fill_cache = false;
+    // only keys are needed, the raw iterator does not touch the value log
+    std::unique_ptr<Iterator> it(db->NewIterator(ropt));
+    WriteBatch batch;
+    size_t pending = 0;
+    Status s;
+    *deleted = 0;
+    for (it->Seek(from); it->Valid() && s.ok() && !(stop && *stop); it->Next()) {
+        Slice key = it->key();
+        if (!to.empty() && key.compare(to) >= 0) {
+            break;
+        }
+        batch.Delete(key);
+        pending++;
+        if (pending >= batchKeys || batch.ApproximateSize() >= DELETE_RANGE_BATCH_BYTES) {
+            s = Write(db, opt, &batch);
+            *deleted += s.ok() ? pending : 0;
+            batch.Clear();
+            pending = 0;
+        }
+    }
+    if (s.ok()) {
+        s = it->status();
+    }
+    if (s.ok() && pending > 0) {
+        s = Write(db, opt, &batch);
+        *deleted += s.ok() ? pending : 0;
+    }
+    return s;
+}
+
+Status DbState::Get(DB *db, const ReadOptions &opt, const Slice &key, string *value) {
+    if (m_hot_keys) {
+        m_hot_keys->Record(key);
+    }
+    if (!MayExist(opt, key)) {
+        return Status::NotFound(Slice());
+    }
+    Status s = m_vlog ? m_vlog->Get(opt, key, value) : db->Get(opt, key, value);
+    if (s.IsNotFound()) {
+        RecordMiss(opt);
+    }
+    return s;
+}
+
+// snapshot reads bypass the filter, a rebuilt filter no longer has keys deleted after the snapshot
+bool DbState::MayExist(const ReadOptions &opt, const Slice &key) {
+    return !m_key_filter || opt.snapshot || m_key_filter->MayContain(key_hash(key));
+}
+
+void DbState::RecordMiss(const ReadOptions &opt) {
+    if (m_key_filter && !opt.snapshot && m_key_filter->Ready()) {
+        m_key_filter->RecordFalsePositive();
+    }
+}
+
+Iterator *DbState::NewIterator(DB *db, const ReadOptions &opt) {
+    return m_vlog ? m_vlog->NewIterator(opt) : db->NewIterator(opt);
+}
+
+const Snapshot *DbState::GetSnapshot(DB *db) {
+    return m_vlog ? m_vlog->GetSnapshot() : db->GetSnapshot();
+}
+
+void DbState::ReleaseSnapshot(DB *db, const Snapshot *snapshot) {
+    if (m_vlog) {
+        m_vlog->ReleaseSnapshot(snapshot);
+    } else {
+        db->ReleaseSnapshot(snapshot);
+    }
+}
+
+void DbState::MemoryUsage(int64_t *bytes) {
+    if (m_db) {
+        bytes[MEM_MEMTABLE] += MemtableBytes(m_db);
+    }
+    if (m_block_cache) {
+        bytes[MEM_BLOCK_CACHE] += m_block_cache->TotalCharge();
+    }
+    if (m_key_filter) {
+        bytes[MEM_KEY_FILTER] += m_key_filter->Bytes();
+    }
+    if (m_counters) {
+        bytes[MEM_COUNTERS] += m_counters->MemoryBytes();
+    }
+}
+
+size_t DbState::BlockCacheCapacity() const {
+    // the cache is always the default sized one, no option replaces it
+    return DEFAULT_BLOCK_CACHE_SIZE;
+}
+
+DbState *check_db_state(lua_State *L, int index) {
+    LuaDB *ud = (LuaDB *)luaL_checkudata(L, index, LVLDB_MT_DB);
+    if (!ud->db) {
+        luaL_error(L, "database is closed");
+    }
+    return ud->state;
+}
+
+int lvldb_database_io_stats(lua_State *L) {
+    DbState *state = check_db_state(L, 1);
+    if (!state->m_io_stats) {
+        lua_pushnil(L);
+        return 1;
+    }
+    state->m_io_stats->Push(L);
+    if (lua_toboolean(L, 2)) {
+        state->m_io_stats->Reset();
+    }
+    return 1;
+}
+
+int lvldb_database_reset_io_stats(lua_State *L) {
+    DbState *state = check_db_state(L, 1);
+    if (state->m_io_stats) {
+        state->m_io_stats->Reset();
+    }
+    return 0;
+}
+
+// ldb:setRateLimit(bytesPerSec, [autoTune]), 0 disables throttling
+int lvldb_database_set_rate_limit(lua_State *L) {
+    DbState *state = check_db_state(L, 1);
+    lua_Integer rate = luaL_checkinteger(L, 2);
+    if (!state->m_rate_limiter) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    state->m_rate_limiter->SetRate(rate, lua_toboolean(L, 3) != 0);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+int lvldb_database_rate_limit_stats(lua_State *L) {
+    DbState *state = check_db_state(L, 1);
+    if (!state->m_rate_limiter) {
+        lua_pushnil(L);
+        return 1;
+    }
+    state->m_rate_limiter->Push(L);
+    return 1;
+}
+
+// ldb:persistTo(path), copies a snapshot into a new on-disk database
+int lvldb_database_persist_to(lua_State *L) {
+    DB *db = check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    Options opt;
+    opt.create_if_missing = true;
+    opt.error_if_exists = true;
+    DB *out = nullptr;
+    Status s = DB::Open(opt, path, &out);
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_persist_to: %s", s.ToString().c_str());
+    }
+
+    ReadOptions ropt;
+    ropt.fill_cache = false;
+    ropt.snapshot = state->GetSnapshot(db);
+    lua_Integer count = 0;
+    {
+        std::unique_ptr<Iterator> it(state->NewIterator(db, ropt));
+        WriteBatch batch;
+        for (it->SeekToFirst(); it->Valid() && s.ok(); it->Next()) {
+            batch.Put(it->key(), it->value());
+            count++;
+            if (batch.ApproximateSize() >= PERSIST_BATCH_SIZE) {
+                s = out->Write(WriteOptions(), &batch);
+                batch.Clear();
+            }
+        }
+        if (s.ok()) {
+            s = it->status();
+        }
+        if (s.ok()) {
+            WriteOptions wopt;
+            wopt.sync = true;
+            s = out->Write(wopt, &batch);
+        }
+    }
+    state->ReleaseSnapshot(db, ropt.snapshot);
+    delete out;
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_persist_to: %s", s.ToString().c_str());
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
@@ -0,0 +1,105 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "utils.hpp"
+#include "env.hpp"
+#include "logger.hpp"
+#include "stall.hpp"
+#include "vlog.hpp"
+#include "locks.hpp"
+#include "counter.hpp"
+#include "txn.hpp"
+#include "keyfilter.hpp"
+#include "memory.hpp"
+#include "watch.hpp"
+#include "warmup.hpp"
+#include "delrange.hpp"
+
+// per-database extensions, shared by every handle opened on the same path
+// and destroyed by l_unregister_db after the DB itself
+class DbState : public MemoryOwner {
+public:
+    DbState();
+    ~DbState();
+
+    // returns the options to open the db with, installing the env wrappers requested by opt
+    Options Setup(const MyOptions &opt, const string &path);
+    // attaches the extensions that need the opened db
+    Status Open(const MyOptions &opt, const string &path, DB *db);
+    // stops background work, called before the db is deleted
+    void Close();
+
+    // writes and reads that go through the value log when it is enabled,
+    // writes lock the stripes of their keys and bump the key versions
+    Status Put(DB *db, const WriteOptions &opt, const Slice &key, const Slice &value);
+    Status Delete(DB *db, const WriteOptions &opt, const Slice &key);
+    Status Write(DB *db, const WriteOptions &opt, WriteBatch *batch);
+    // for callers already holding the stripes of every key written
+    Status PutLocked(DB *db, const WriteOptions &opt, const Slice &key, const Slice &value);
+    Status WriteLocked(DB *db, const WriteOptions &opt, WriteBatch *batch);
+    uint64_t KeyMask(WriteBatch *batch);
+    // deletes every key in [from, to) through Write, at most batchKeys keys and DELETE_RANGE_BATCH_BYTES
+    // per batch; an empty to means the end of the db
+    Status DeleteRange(DB *db, const WriteOptions &opt, const string &from, const string &to, size_t batchKeys, uint64_t *deleted,
+                       const std::atomic<bool> *stop = nullptr);
+    Status Get(DB *db, const ReadOptions &opt, const Slice &key, string *value);
+    // false when the key filter proves the key absent
+    bool MayExist(const ReadOptions &opt, const Slice &key);
+    // a lookup the key filter let through found nothing
+    void RecordMiss(const ReadOptions &opt);
+    Iterator *NewIterator(DB *db, const ReadOptions &opt);
+    // snapshots taken by the binding itself, the value log keeps every segment they point into until released
+    const Snapshot *GetSnapshot(DB *db);
+    void ReleaseSnapshot(DB *db, const Snapshot *snapshot);
+
+    int Level0Files(DB *db);
+    uint64_t MemtableBytes(DB *db);
+    // why a write would block right now, nullptr when it would not
+    const char *StallCause(DB *db);
+    virtual void MemoryUsage(int64_t *bytes);
+    size_t BlockCacheCapacity() const;
+
+    string m_path;
+    // never reused within the process, unlike the address of a closed db's state
+    uint64_t m_id;
+    DB *m_db;
+    Cache *m_block_cache;
+    size_t m_write_buffer_size;
+    WriteStats m_write_stats;
+    Env *m_mem_env;
+    IoStatsEnv *m_io_stats;
+    RateLimiter *m_rate_limiter;
+    RateLimitEnv *m_rate_limit_env;
+    EventLogger *m_event_log;
+    Env *m_env;
+    ValueLog *m_vlog;
+    // serializes read-modify-write of single keys
+    StripedLocks m_key_locks;
+    KeyVersions m_versions;
+    TxnStats m_txn_stats;
+    Counters *m_counters;
+    KeyFilter *m_key_filter;
+    // published with the key stripes held, so subscribers see a key's writes in commit order
+    WatchList m_watchers;
+    Warmup m_warmup;
+    RangeDeleter m_range_deleter;
+    // sampled get keys, nullptr unless hotRanges is set
+    HotKeys *m_hot_keys;
+};
+
+// layout of the leveldb.db userdata, db must stay the first member
+struct LuaDB {
+    DB *db;
+    DbState *state;
+};
+
+DbState *check_db_state(lua_State *L, int index);
+DbState *l_get_db_state(void *db);
+
+// opens path or references the already opened instance, the db is registered either way
+Status l_open_db(const MyOptions &opt, const string &path, DB **db, DbState **state = nullptr);
+
+int lvldb_database_io_stats(lua_State *L);
+int lvldb_database_reset_io_stats(lua_State *L);
+int lvldb_database_set_rate_limit(lua_State *L);
+int lvldb_database_rate_limit_stats(lua_State *L);
+int lvldb_database_persist_to(lua_State *L);
@@ -0,0 +1,211 @@
+﻿#include "txn.hpp"
+#include "db.hpp"
+#include "state.hpp"
+
+KeyVersions::KeyVersions() {
+    for (int i = 0; i < KEY_VERSION_SLOTS; i++) {
+        m_slots[i] = 0;
+    }
+}
+
+void TxnStats::Push(lua_State *L) {
+    uint64_t s = started, c = committed, x = conflicts, a = aborted;
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, (lua_Integer)s);
+    lua_setfield(L, -2, "started");
+    lua_pushinteger(L, (lua_Integer)c);
+    lua_setfield(L, -2, "committed");
+    lua_pushinteger(L, (lua_Integer)x);
+    lua_setfield(L, -2, "conflicts");
+    lua_pushinteger(L, (lua_Integer)a);
+    lua_setfield(L, -2, "aborted");
+    // share of commit attempts that hit a conflict, and of finished transactions that did not commit
+    lua_pushnumber(L, c + x > 0 ? (lua_Number)x / (c + x) : 0);
+    lua_setfield(L, -2, "conflictRate");
+    lua_pushnumber(L, c + x + a > 0 ? (lua_Number)(x + a) / (c + x + a) : 0);
+    lua_setfield(L, -2, "abortRate");
+}
+
+Transaction::Transaction(DB *db) : m_db(db), m_done(false) {
+    m_state = l_get_db_state(db);
+    l_ref_db(db);
+    m_state->m_txn_stats.started++;
+}
+
+Transaction::~Transaction() {
+    Rollback();
+    l_unregister_db(m_db, [](void *db) {
+        delete (DB *)db;
+    });
+}
+
+Status Transaction::Get(const ReadOptions &opt, const Slice &key, string *value) {
+    auto key_ = key.ToString();
+    auto it = m_writes.find(key_);
+    if (it != m_writes.end()) {
+        if (it->second.del) {
+            return Status::NotFound(key);
+        }
+        *value = it->second.value;
+        return Status::OK();
+    }
+    // taken before the read: a write racing with it bumps the version after its data is visible,
+    // so a stale value always fails validation at commit
+    uint64_t version = m_state->m_versions.Get(key_hash(key));
+    Status s = m_state->Get(m_db, opt, key, value);
+    // the first read of a key is the one the transaction depends on
+    m_reads.emplace(key_, version);
+    return s;
+}
+
+void Transaction::Put(const Slice &key, const Slice &value) {
+    auto &w = m_writes[key.ToString()];
+    w.value.assign(value.data(), value.size());
+    w.del = false;
+}
+
+void Transaction::Delete(const Slice &key) {
+    auto &w = m_writes[key.ToString()];
+    w.value.clear();
+    w.del = true;
+}
+
+Status Transaction::Commit(const WriteOptions &opt, bool *conflict) {
+    *conflict = false;
+    m_done = true;
+    StripedLocks &locks = m_state->m_key_locks;
+    uint64_t mask = 0;
+    WriteBatch batch;
+    for (auto &it : m_writes) {
+        mask |= locks.Mask(it.first);
+        if (it.second.del) {
+            batch.Delete(it.first);
+        } else {
+            batch.Put(it.first, it.second.value);
+        }
+    }
+    for (auto &it : m_reads) {
+        mask |= locks.Mask(it.first);
+    }
+    Status s;
+    {
+        StripeGuard stripes(locks, mask);
+        for (auto &it : m_reads) {
+            if (m_state->m_versions.Get(key_hash(it.first)) != it.second) {
+                *conflict = true;
+                break;
+            }
+        }
+        if (!*conflict && !m_writes.empty()) {
+            s = m_state->WriteLocked(m_db, opt, &batch);
+        }
+    }
+    if (*conflict) {
+        m_state->m_txn_stats.conflicts++;
+    } else if (s.ok()) {
+        m_state->m_txn_stats.committed++;
+    } else {
+        m_state->m_txn_stats.aborted++;
+    }
+    m_reads.clear();
+    m_writes.clear();
+    return s;
+}
+
+void Transaction::Rollback() {
+    if (!m_done) {
+        m_done = true;
+        m_state->m_txn_stats.aborted++;
+    }
+    m_reads.clear();
+    m_writes.clear();
+}
+
+static Transaction *check_txn(lua_State *L, int index) {
+    Transaction *txn = *(Transaction **)luaL_checkudata(L, index, LVLDB_MT_TXN);
+    luaL_argcheck(L, txn != nullptr && !txn->m_done, index, "transaction is finished");
+    return txn;
+}
+
+// ldb:transaction()
+int lvldb_database_transaction(lua_State *L) {
+    DB *db = check_database(L, 1);
+    Transaction **txn = (Transaction **)lua_newuserdata(L, sizeof(Transaction *));
+    *txn = nullptr;
+    luaL_getmetatable(L, LVLDB_MT_TXN);
+    lua_setmetatable(L, -2);
+    *txn = new Transaction(db);
+    return 1;
+}
+
+int lvldb_database_transaction_stats(lua_State *L) {
+    check_database(L, 1);
+    check_db_state(L, 1)->m_txn_stats.Push(L);
+    return 1;
+}
+
+// txn:get(key, [readopts]), sees the transaction's own writes
+int lvldb_txn_get(lua_State *L) {
+    Transaction *txn = check_txn(L, 1);
+    Slice key = lua_to_slice(L, 2);
+    auto ropt = lvldb_ropt(L, 3);
+    string value;
+    Status s = txn->Get(ropt, key, &value);
+    if (s.IsNotFound()) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_txn_get: %s", s.ToString().c_str());
+    }
+    if (ropt.UnCompress) {
+        if (!miniz_uncompress(L, value.c_str(), value.size(), ropt.InflateLimit)) {
+            lua_pushliteral(L, "inflateLimit exceeded");
+            return 2;
+        }
+    } else {
+        lua_pushlstring(L, value.c_str(), value.size());
+    }
+    return 1;
+}
+
+int lvldb_txn_put(lua_State *L) {
+    Transaction *txn = check_txn(L, 1);
+    txn->Put(lua_to_slice(L, 2), lua_to_slice(L, 3));
+    return 0;
+}
+
+int lvldb_txn_del(lua_State *L) {
+    Transaction *txn = check_txn(L, 1);
+    txn->Delete(lua_to_slice(L, 2));
+    return 0;
+}
+
+// txn:commit([writeopts]), returns true or false, "conflict"
+int lvldb_txn_commit(lua_State *L) {
+    Transaction *txn = check_txn(L, 1);
+    bool conflict = false;
+    Status s = txn->Commit(lvldb_wopt(L, 2), &conflict);
+    if (!s.ok()) {
+        return luaL_error(L, "lvldb_txn_commit: %s", s.ToString().c_str());
+    }
+    lua_pushboolean(L, !conflict);
+    if (conflict) {
+        lua_pushliteral(L, "conflict");
+        return 2;
+    }
+    return 1;
+}
+
+int lvldb_txn_rollback(lua_State *L) {
+    Transaction *txn = check_txn(L, 1);
+    txn->Rollback();
+    return 0;
+}
+
+int lvldb_txn_gc(lua_State *L) {
+    Transaction **txn = (Transaction **)luaL_checkudata(L, 1, LVLDB_MT_TXN);
+    delete *txn;
+    *txn = nullptr;
+    return 0;
+}
@@ -0,0 +1,69 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "locks.hpp"
+#include <atomic>
+#include <map>
+#include <unordered_map>
+
+class DbState;
+
+// multiple of LOCK_STRIPES, so every slot belongs to a single stripe
+#define KEY_VERSION_SLOTS 16384
+
+// write stamps of hashed key slots, bumped under the key's stripe by every write of the db.
+// Keys sharing a slot only cause false conflicts.
+class KeyVersions {
+public:
+    KeyVersions();
+    uint64_t Get(uint64_t hash) const { return m_slots[hash % KEY_VERSION_SLOTS].load(std::memory_order_acquire); }
+    void Bump(uint64_t hash) { m_slots[hash % KEY_VERSION_SLOTS].fetch_add(1, std::memory_order_release); }
+
+private:
+    std::atomic<uint64_t> m_slots[KEY_VERSION_SLOTS];
+};
+
+struct TxnStats {
+    TxnStats() : started(0), committed(0), conflicts(0), aborted(0) {}
+
+    std::atomic<uint64_t> started;
+    std::atomic<uint64_t> committed;
+    std::atomic<uint64_t> conflicts;
+    std::atomic<uint64_t> aborted;
+
+    void Push(lua_State *L);
+};
+
+struct TxnWrite {
+    string value;
+    bool del;
+};
+
+// optimistic transaction: reads remember the version of their key, writes are buffered
+// and applied in one WriteBatch by Commit if none of the read keys changed meanwhile
+class Transaction {
+public:
+    Transaction(DB *db);
+    ~Transaction();
+
+    Status Get(const ReadOptions &opt, const Slice &key, string *value);
+    void Put(const Slice &key, const Slice &value);
+    void Delete(const Slice &key);
+    // sets conflict instead of writing when a read key was written since it was read
+    Status Commit(const WriteOptions &opt, bool *conflict);
+    void Rollback();
+
+    DB *m_db;
+    DbState *m_state;
+    unordered_map<string, uint64_t> m_reads;
+    map<string, TxnWrite> m_writes;
+    bool m_done;
+};
+
+int lvldb_database_transaction(lua_State *L);
+int lvldb_database_transaction_stats(lua_State *L);
+int lvldb_txn_get(lua_State *L);
+int lvldb_txn_put(lua_State *L);
+int lvldb_txn_del(lua_State *L);
+int lvldb_txn_commit(lua_State *L);
+int lvldb_txn_rollback(lua_State *L);
+int lvldb_txn_gc(lua_State *L);
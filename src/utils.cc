@@ -1,4 +1,5 @@
 ﻿#include "utils.hpp"
+#include "zstream.hpp"
 
 Slice lua_to_slice(lua_State *L, int i) {
     size_t l = 0;
@@ -6,6 +7,41 @@ Slice lua_to_slice(lua_State *L, int i) {
     return Slice(data, l);
 }
 
+Slice lua_to_entry_key(lua_State *L, int i) {
+    if (lua_type(L, i) != LUA_TSTRING) {
+        luaL_error(L, "table keys must be strings, got %s", luaL_typename(L, i));
+    }
+    size_t l = 0;
+    const char *data = lua_tolstring(L, i, &l);
+    return Slice(data, l);
+}
+
+string opt_string_field(lua_State *L, int idx, const char *name) {
+    string s;
+    lua_getfield(L, idx, name);
+    if (!lua_isnil(L, -1)) {
+        size_t len = 0;
+        const char *p = luaL_checklstring(L, -1, &len);
+        s.assign(p, len);
+    }
+    lua_pop(L, 1);
+    return s;
+}
+
+bool opt_bool_field(lua_State *L, int idx, const char *name, bool def) {
+    lua_getfield(L, idx, name);
+    bool b = lua_isnil(L, -1) ? def : lua_toboolean(L, -1) != 0;
+    lua_pop(L, 1);
+    return b;
+}
+
+lua_Integer opt_int_field(lua_State *L, int idx, const char *name, lua_Integer def) {
+    lua_getfield(L, idx, name);
+    lua_Integer v = lua_isnil(L, -1) ? def : luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    return v;
+}
+
 string bool_tostring(int boolean) {
     return boolean == 1 ? "true" : "false";
 }
@@ -13,7 +49,7 @@ string bool_tostring(int boolean) {
 string pointer_tostring(void *p) {
     ostringstream oss(ostringstream::out);
     if (p != NULL)
-        oss << &p;
+        oss << p;
     else
         oss << "NULL";
     return oss.str().c_str();
@@ -23,8 +59,8 @@ string filter_tostring(const FilterPolicy *fp) {
     return fp == 0 ? "NULL" : fp->Name();
 }
 
-Options *check_options(lua_State *L, int index) {
-    return (Options*)luaL_checkudata(L, index, LVLDB_MT_OPT);
+MyOptions *check_options(lua_State *L, int index) {
+    return (MyOptions*)luaL_checkudata(L, index, LVLDB_MT_OPT);
 }
 
 MyReadOptions *check_read_options(lua_State *L, int index) {
@@ -36,8 +72,8 @@ MyWriteOptions *check_write_options(lua_State *L, int index) {
     return (MyWriteOptions *)luaL_checkudata(L, index, LVLDB_MT_WOPT);
 }
 
-WriteBatch *check_raw_writebatch(lua_State *L, int index) {
-    return (WriteBatch *)luaL_checkudata(L, index, LVLDB_MT_RAW_BATCH);
+RawBatch *check_raw_writebatch(lua_State *L, int index) {
+    return (RawBatch *)luaL_checkudata(L, index, LVLDB_MT_RAW_BATCH);
 }
 
 Batch *check_writebatch(lua_State *L, int index) {
@@ -55,7 +91,11 @@ void miniz_compress(lua_State *L, const char *data, size_t len) {
     }
 }
 
-void miniz_uncompress(lua_State *L, const char *data, size_t len) {
+// pushes nil for corrupt data, returns false when the output would exceed limit
+bool miniz_uncompress(lua_State *L, const char *data, size_t len, size_t limit) {
+    if (limit > 0) {
+        return inflate_limited(L, data, len, limit) != INFLATE_LIMIT;
+    }
     size_t outLen = 0;
     void *p = tinfl_decompress_mem_to_heap(data, len, &outLen, TINFL_FLAG_PARSE_ZLIB_HEADER);
     if (!p) {
@@ -64,4 +104,5 @@ void miniz_uncompress(lua_State *L, const char *data, size_t len) {
         lua_pushlstring(L, (const char *)p, outLen);
         mz_free(p);
     }
+    return true;
 }
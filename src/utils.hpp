@@ -15,11 +15,34 @@
 #define LVLDB_MT_ITER           "leveldb.iter"
 #define LVLDB_MT_RAW_BATCH      "leveldb.rawbtch"
 #define LVLDB_MT_BATCH          "leveldb.btch"
+#define LVLDB_MT_SHARDED        "leveldb.sharded"
+#define LVLDB_MT_B64_ENC        "leveldb.b64enc"
+#define LVLDB_MT_DEFLATER       "leveldb.deflater"
+#define LVLDB_MT_INFLATER       "leveldb.inflater"
+#define LVLDB_MT_TXN            "leveldb.txn"
+#define LVLDB_MT_WATCH          "leveldb.watch"
+#define LVLDB_MT_NS             "leveldb.ns"
 
 class Batch;
+class RawBatch;
+
+struct MyOptions : public Options {
+    bool IoStats;
+    lua_Integer RateLimit;
+    bool RateLimitAuto;
+    int RateLimitLatency;
+    bool InMemory;
+    int EventLog;
+    size_t ValueLog;
+    size_t ValueLogFileSize;
+    int CounterFlush;
+    int KeyFilter;
+    int HotRanges;
+};
 
 struct MyReadOptions : public ReadOptions {
     bool UnCompress;
+    size_t InflateLimit;
 };
 
 struct MyWriteOptions : public WriteOptions {
@@ -28,22 +51,41 @@ struct MyWriteOptions : public WriteOptions {
 
 
 Slice lua_to_slice(lua_State *L, int i);
+// key of a {key = value} entry during lua_next, which must not be converted in place
+Slice lua_to_entry_key(lua_State *L, int i);
+string opt_string_field(lua_State *L, int idx, const char *name);
+bool opt_bool_field(lua_State *L, int idx, const char *name, bool def);
+lua_Integer opt_int_field(lua_State *L, int idx, const char *name, lua_Integer def);
 string bool_tostring(int boolean);
 string pointer_tostring(void *p);
 string filter_tostring(const FilterPolicy *fp);
 
-Options *check_options(lua_State *L, int index);
+MyOptions *check_options(lua_State *L, int index);
 MyReadOptions *check_read_options(lua_State *L, int index);
 MyWriteOptions *check_write_options(lua_State *L, int index);
 
-WriteBatch *check_raw_writebatch(lua_State *L, int index);
+RawBatch *check_raw_writebatch(lua_State *L, int index);
 Batch *check_writebatch(lua_State *L, int index);
-void l_unregister_db(void *db, const std::function<void(void *)> &delete_cb = std::function<void(void *)>());
+void *l_get_db(const string &db_path);
+void l_register_db(const string &db_path, void *db);
+// finds and references the db registered at db_path in one step, nullptr when there is none
+void *l_acquire_db(const string &db_path);
+// registers a newly opened db with one reference; when another thread registered db_path
+// first, references and returns that one instead and the caller disposes of its own
+void *l_publish_db(const string &db_path, void *db);
+// returns true when this dropped the last reference and the db was deleted
+bool l_unregister_db(void *db, const std::function<void(void *)> &delete_cb = std::function<void(void *)>());
 void l_ref_db(void *db);
 
 void miniz_compress(lua_State *L, const char *data, size_t len);
-void miniz_uncompress(lua_State *L, const char *data, size_t len);
+bool miniz_uncompress(lua_State *L, const char *data, size_t len, size_t limit = 0);
+
+#if LUA_VERSION_NUM < 502
+#define lvldb_rawlen(L, i) lua_objlen(L, i)
+#else
+#define lvldb_rawlen(L, i) lua_rawlen(L, i)
+#endif
 
-#define lvldb_opt(L, l) ( lua_gettop(L) >= l ? *(check_options(L, l)) : Options() )
+#define lvldb_opt(L, l) ( lua_gettop(L) >= l ? *(check_options(L, l)) : MyOptions() )
 #define lvldb_ropt(L, l) ( lua_gettop(L) >= l ? *(check_read_options(L, l)) : MyReadOptions() )
 #define lvldb_wopt(L, l) ( lua_gettop(L) >= l ? *(check_write_options(L, l)) : MyWriteOptions() )
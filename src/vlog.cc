@@ -0,0 +1,740 @@
+﻿#include "vlog.hpp"
+#include "env.hpp"
+#include "state.hpp"
+#include <miniz.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+
+// Segment record: fixed32(crc32) fixed32(klen) fixed32(vlen) key value, the crc covers everything after itself.
+// Pointer stored in leveldb: magic fixed32(file) fixed64(offset) fixed32(klen) fixed32(vlen) fixed32(crc32)
+#define VLOG_HEADER_SIZE 12
+#define VLOG_POINTER_MAGIC "\xf5VLP"
+#define VLOG_POINTER_SIZE 28
+#define VLOG_GC_INTERVAL_SECONDS 30
+#define VLOG_GC_RATIO 0.5
+// relocated records per synced pointer batch, their stripes are held meanwhile
+#define VLOG_GC_BATCH_RECORDS 256
+// one write in this many looks up the record it replaces to estimate dead bytes per segment
+#define VLOG_DEAD_SAMPLE 16
+// a kept segment with a changed estimate is rescanned after this many passes, bounding sampling error
+#define VLOG_GC_RESCAN_PASSES 10
+
+static void put_fixed32(char *dst, uint32_t v) {
+    dst[0] = char(v);
+    dst[1] = char(v >> 8);
+    dst[2] = char(v >> 16);
+    dst[3] = char(v >> 24);
+}
+
+static uint32_t get_fixed32(const char *p) {
+    const uint8_t *u = (const uint8_t *)p;
+    return uint32_t(u[0]) | uint32_t(u[1]) << 8 | uint32_t(u[2]) << 16 | uint32_t(u[3]) << 24;
+}
+
+static void encode_pointer(const VlogPointer &ptr, string *dst) {
+    char buf[VLOG_POINTER_SIZE];
+    memcpy(buf, VLOG_POINTER_MAGIC, 4);
+    put_fixed32(buf + 4, ptr.file);
+    put_fixed32(buf + 8, uint32_t(ptr.offset));
+    put_fixed32(buf + 12, uint32_t(ptr.offset >> 32));
+    put_fixed32(buf + 16, ptr.key_len);
+    put_fixed32(buf + 20, ptr.value_len);
+    put_fixed32(buf + 24, (uint32_t)mz_crc32(MZ_CRC32_INIT, (const unsigned char *)buf, 24));
+    dst->assign(buf, sizeof(buf));
+}
+
+static uint32_t record_crc(const char *header, const Slice &key, const Slice &value) {
+    mz_ulong crc = mz_crc32(MZ_CRC32_INIT, (const unsigned char *)header + 4, VLOG_HEADER_SIZE - 4);
+    crc = mz_crc32(crc, (const unsigned char *)key.data(), key.size());
+    return (uint32_t)mz_crc32(crc, (const unsigned char *)value.data(), value.size());
+}
+
+bool ValueLog::DecodePointer(const Slice &value, VlogPointer *ptr) {
+    const char *p = value.data();
+    if (value.size() != VLOG_POINTER_SIZE || memcmp(p, VLOG_POINTER_MAGIC, 4) != 0 ||
+        get_fixed32(p + 24) != (uint32_t)mz_crc32(MZ_CRC32_INIT, (const unsigned char *)p, 24)) {
+        return false;
+    }
+    ptr->file = get_fixed32(p + 4);
+    ptr->offset = uint64_t(get_fixed32(p + 8)) | uint64_t(get_fixed32(p + 12)) << 32;
+    ptr->key_len = get_fixed32(p + 16);
+    ptr->value_len = get_fixed32(p + 20);
+    return true;
+}
+
+uint64_t ValueLog::ValueSize(const Slice &value) {
+    VlogPointer ptr;
+    return DecodePointer(value, &ptr) ? ptr.value_len : value.size();
+}
+
+// resolves pointers lazily, so key-only scans never touch the log
+class ValueLogIterator : public Iterator {
+public:
+    ValueLogIterator(ValueLog *vlog, Iterator *it, bool verify, uint64_t epoch) : m_vlog(vlog), m_it(it), m_verify(verify), m_epoch(epoch) {}
+    ~ValueLogIterator() {
+        delete m_it;
+        m_vlog->Unpin(m_epoch);
+    }
+
+    bool Valid() const override { return m_it->Valid(); }
+    void SeekToFirst() override { m_it->SeekToFirst(); }
+    void SeekToLast() override { m_it->SeekToLast(); }
+    void Seek(const Slice &target) override { m_it->Seek(target); }
+    void Next() override { m_it->Next(); }
+    void Prev() override { m_it->Prev(); }
+    Slice key() const override { return m_it->key(); }
+
+    Slice value() const override {
+        Slice v = m_it->value();
+        VlogPointer ptr;
+        if (!ValueLog::DecodePointer(v, &ptr)) {
+            return v;
+        }
+        Status s = m_vlog->Read(ptr, m_verify, &m_value);
+        if (!s.ok()) {
+            m_status = s;
+            return Slice();
+        }
+        return m_value;
+    }
+
+    Status status() const override {
+        Status s = m_it->status();
+        return s.ok() ? m_status : s;
+    }
+
+private:
+    ValueLog *m_vlog;
+    Iterator *m_it;
+    bool m_verify;
+    uint64_t m_epoch;
+    mutable string m_value;
+    mutable Status m_status;
+};
+
+// collects the stripes a batch touches, whether any value goes to the log and the sampled keys
+class StripeCollector : public WriteBatch::Handler {
+public:
+    StripeCollector(ValueLog *vlog) : m_vlog(vlog), m_mask(0), m_large(false) {}
+
+    void Put(const Slice &key, const Slice &value) override {
+        Delete(key);
+        m_large = m_large || value.size() >= m_vlog->m_threshold;
+    }
+    void Delete(const Slice &key) override {
+        m_mask |= m_vlog->m_locks.Mask(key);
+        if (m_vlog->m_writes++ % VLOG_DEAD_SAMPLE == 0) {
+            m_sampled.push_back(key.ToString());
+        }
+    }
+
+    ValueLog *m_vlog;
+    uint64_t m_mask;
+    bool m_large;
+    vector<string> m_sampled;
+};
+
+// copies a batch, appending large values to the log and putting their pointers instead
+class BatchRewriter : public WriteBatch::Handler {
+public:
+    BatchRewriter(ValueLog *vlog) : m_vlog(vlog) {}
+
+    void Put(const Slice &key, const Slice &value) override {
+        if (!m_status.ok()) {
+            return;
+        }
+        if (value.size() < m_vlog->m_threshold) {
+            m_batch.Put(key, value);
+            return;
+        }
+        string ptr;
+        m_status = m_vlog->Append(key, value, &ptr);
+        m_batch.Put(key, ptr);
+    }
+    void Delete(const Slice &key) override {
+        m_batch.Delete(key);
+    }
+
+    ValueLog *m_vlog;
+    WriteBatch m_batch;
+    Status m_status;
+};
+
+ValueLog::ValueLog(Env *env, const string &dir, size_t threshold, size_t segmentSize)
+    : m_threshold(threshold), m_writes(0), m_env(env), m_dir(dir), m_segment_size(segmentSize), m_db(nullptr),
+      m_head(nullptr), m_head_file(0), m_head_size(0), m_epoch(0), m_gc_passes(0), m_stop(false) {}
+
+ValueLog::~ValueLog() {
+    Close();
+}
+
+string ValueLog::SegmentName(uint32_t file) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/%06u.vlog", file);
+    return m_dir + name;
+}
+
+Status ValueLog::Open(DB *db) {
+    m_db = db;
+    m_env->CreateDir(m_dir);
+    vector<string> children;
+    Status s = m_env->GetChildren(m_dir, &children);
+    if (!s.ok()) {
+        return s;
+    }
+    uint32_t last = 0;
+    for (auto &name : children) {
+        unsigned int file = 0;
+        char suffix[8] = { 0 };
+        if (sscanf(name.c_str(), "%u.%7s", &file, suffix) != 2 || strcmp(suffix, "vlog") != 0) {
+            continue;
+        }
+        uint64_t size = 0;
+        s = m_env->GetFileSize(SegmentName(file), &size);
+        if (!s.ok()) {
+            return s;
+        }
+        m_segments[file].size = size;
+        last = std::max(last, (uint32_t)file);
+    }
+    // a new head every time, older segments are only ever read or collected
+    m_head_file = last;
+    s = OpenHead();
+    if (s.ok()) {
+        m_gc_thread = std::thread(&ValueLog::GcLoop, this);
+    }
+    return s;
+}
+
+Status ValueLog::OpenHead() {
+    if (m_head) {
+        Status s = m_head->Sync();
+        if (s.ok()) {
+            s = m_head->Close();
+        }
+        delete m_head;
+        m_head = nullptr;
+        if (!s.ok()) {
+            return s;
+        }
+    }
+    uint32_t file = m_head_file + 1;
+    Status s = m_env->NewWritableFile(SegmentName(file), &m_head);
+    if (!s.ok()) {
+        return s;
+    }
+    m_head_file = file;
+    m_head_size = 0;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_segments[file];
+    return s;
+}
+
+void ValueLog::Close() {
+    {
+        std::lock_guard<std::mutex> guard(m_gc_wait_mutex);
+        m_stop = true;
+    }
+    m_gc_cond.notify_all();
+    if (m_gc_thread.joinable()) {
+        m_gc_thread.join();
+    }
+    std::lock_guard<std::mutex> guard(m_append_mutex);
+    if (m_head) {
+        m_head->Sync();
+        m_head->Close();
+        delete m_head;
+        m_head = nullptr;
+    }
+    DeleteObsolete();
+}
+
+Status ValueLog::Append(const Slice &key, const Slice &value, string *ptr) {
+    char header[VLOG_HEADER_SIZE];
+    put_fixed32(header + 4, (uint32_t)key.size());
+    put_fixed32(header + 8, (uint32_t)value.size());
+    put_fixed32(header, record_crc(header, key, value));
+
+    std::lock_guard<std::mutex> guard(m_append_mutex);
+    if (!m_head) {
+        return Status::IOError("value log is closed");
+    }
+    VlogPointer p = { m_head_file, m_head_size, (uint32_t)key.size(), (uint32_t)value.size() };
+    Status s = m_head->Append(Slice(header, sizeof(header)));
+    if (s.ok()) {
+        s = m_head->Append(key);
+    }
+    if (s.ok()) {
+        s = m_head->Append(value);
+    }
+    // readers go through a separate handle, the bytes must reach the OS before the pointer is visible
+    if (s.ok()) {
+        s = m_head->Flush();
+    }
+    if (!s.ok()) {
+        return s;
+    }
+    m_head_size += sizeof(header) + key.size() + value.size();
+    {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_segments[m_head_file].size = m_head_size;
+    }
+    m_stats.values++;
+    m_stats.bytes += sizeof(header) + key.size() + value.size();
+    encode_pointer(p, ptr);
+    if (m_head_size >= m_segment_size) {
+        s = OpenHead();
+    }
+    return s;
+}
+
+Status ValueLog::SyncHead() {
+    std::lock_guard<std::mutex> guard(m_append_mutex);
+    return m_head ? m_head->Sync() : Status::IOError("value log is closed");
+}
+
+// charges the record key points to now, about to be replaced, to its segment, caller holds the key's stripe
+void ValueLog::NoteReplaced(const Slice &key) {
+    ReadOptions ropt;
+    ropt.fill_cache = false;
+    string current;
+    VlogPointer ptr;
+    if (!m_db->Get(ropt, key, &current).ok() || !DecodePointer(current, &ptr)) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto it = m_segments.find(ptr.file);
+    if (it != m_segments.end()) {
+        it->second.dead += uint64_t(VLOG_HEADER_SIZE + ptr.key_len + ptr.value_len) * VLOG_DEAD_SAMPLE;
+    }
+}
+
+Status ValueLog::Put(const WriteOptions &opt, const Slice &key, const Slice &value) {
+    uint64_t mask = m_locks.Mask(key);
+    m_locks.Lock(mask);
+    if (m_writes++ % VLOG_DEAD_SAMPLE == 0) {
+        NoteReplaced(key);
+    }
+    Status s;
+    if (value.size() < m_threshold) {
+        s = m_db->Put(opt, key, value);
+    } else {
+        string ptr;
+        s = Append(key, value, &ptr);
+        if (s.ok() && opt.sync) {
+            s = SyncHead();
+        }
+        if (s.ok()) {
+            s = m_db->Put(opt, key, ptr);
+        }
+    }
+    m_locks.Unlock(mask);
+    return s;
+}
+
+Status ValueLog::Delete(const WriteOptions &opt, const Slice &key) {
+    uint64_t mask = m_locks.Mask(key);
+    m_locks.Lock(mask);
+    if (m_writes++ % VLOG_DEAD_SAMPLE == 0) {
+        NoteReplaced(key);
+    }
+    Status s = m_db->Delete(opt, key);
+    m_locks.Unlock(mask);
+    return s;
+}
+
+Status ValueLog::Write(const WriteOptions &opt, WriteBatch *batch) {
+    StripeCollector collector(this);
+    Status s = batch->Iterate(&collector);
+    if (!s.ok()) {
+        return s;
+    }
+    m_locks.Lock(collector.m_mask);
+    for (auto &key : collector.m_sampled) {
+        NoteReplaced(key);
+    }
+    if (!collector.m_large) {
+        s = m_db->Write(opt, batch);
+    } else {
+        BatchRewriter rewriter(this);
+        s = batch->Iterate(&rewriter);
+        if (s.ok()) {
+            s = rewriter.m_status;
+        }
+        if (s.ok() && opt.sync) {
+            s = SyncHead();
+        }
+        if (s.ok()) {
+            s = m_db->Write(opt, &rewriter.m_batch);
+        }
+    }
+    m_locks.Unlock(collector.m_mask);
+    return s;
+}
+
+Status ValueLog::Read(const VlogPointer &ptr, bool verify, string *value) {
+    std::shared_ptr<RandomAccessFile> file;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto it = m_segments.find(ptr.file);
+        if (it == m_segments.end()) {
+            return Status::NotFound("value log segment was collected");
+        }
+        VlogSegment &seg = it->second;
+        if (!seg.file || ptr.offset + VLOG_HEADER_SIZE + ptr.key_len + ptr.value_len > seg.file_size) {
+            RandomAccessFile *f = nullptr;
+            Status s = m_env->NewRandomAccessFile(SegmentName(ptr.file), &f);
+            if (!s.ok()) {
+                return s;
+            }
+            seg.file.reset(f);
+            seg.file_size = seg.size;
+        }
+        file = seg.file;
+    }
+    Slice result;
+    if (!verify) {
+        value->resize(ptr.value_len);
+        Status s = file->Read(ptr.offset + VLOG_HEADER_SIZE + ptr.key_len, ptr.value_len, &result, &(*value)[0]);
+        if (!s.ok()) {
+            return s;
+        }
+        if (result.size() != ptr.value_len) {
+            return Status::Corruption("truncated value log record");
+        }
+        // mmap'ed files hand back their own memory
+        if (result.data() != value->data()) {
+            value->assign(result.data(), result.size());
+        }
+        return s;
+    }
+    size_t n = VLOG_HEADER_SIZE + ptr.key_len + ptr.value_len;
+    std::unique_ptr<char[]> scratch(new char[n]);
+    Status s = file->Read(ptr.offset, n, &result, scratch.get());
+    if (!s.ok()) {
+        return s;
+    }
+    const char *p = result.data();
+    if (result.size() != n || get_fixed32(p + 4) != ptr.key_len || get_fixed32(p + 8) != ptr.value_len) {
+        return Status::Corruption("truncated value log record");
+    }
+    Slice v(p + VLOG_HEADER_SIZE + ptr.key_len, ptr.value_len);
+    if (get_fixed32(p) != record_crc(p, Slice(p + VLOG_HEADER_SIZE, ptr.key_len), v)) {
+        return Status::Corruption("value log checksum mismatch");
+    }
+    value->assign(v.data(), v.size());
+    return s;
+}
+
+Status ValueLog::Get(const ReadOptions &opt, const Slice &key, string *value) {
+    // a pointer read just before GC relocated the value is retried once against the new location
+    for (int attempt = 0;; attempt++) {
+        Status s = m_db->Get(opt, key, value);
+        VlogPointer ptr;
+        if (!s.ok() || !DecodePointer(*value, &ptr)) {
+            return s;
+        }
+        uint64_t epoch = Pin();
+        s = Read(ptr, opt.verify_checksums, value);
+        Unpin(epoch);
+        if (!s.IsNotFound() || attempt > 0 || opt.snapshot) {
+            return s.IsNotFound() ? Status::Corruption("value log segment was collected") : s;
+        }
+    }
+}
+
+Iterator *ValueLog::NewIterator(const ReadOptions &opt) {
+    // pinned before the DB snapshot is taken, so GC keeps every segment it may point into
+    uint64_t epoch = Pin();
+    return new ValueLogIterator(this, m_db->NewIterator(opt), opt.verify_checksums, epoch);
+}
+
+const Snapshot *ValueLog::GetSnapshot() {
+    uint64_t epoch = Pin();
+    const Snapshot *snapshot = m_db->GetSnapshot();
+    std::lock_guard<std::mutex> guard(m_epoch_mutex);
+    m_snapshot_pins[snapshot] = epoch;
+    return snapshot;
+}
+
+void ValueLog::ReleaseSnapshot(const Snapshot *snapshot) {
+    m_db->ReleaseSnapshot(snapshot);
+    std::lock_guard<std::mutex> guard(m_epoch_mutex);
+    auto it = m_snapshot_pins.find(snapshot);
+    if (it != m_snapshot_pins.end()) {
+        m_pins.erase(m_pins.find(it->second));
+        m_snapshot_pins.erase(it);
+    }
+}
+
+uint64_t ValueLog::Pin() {
+    std::lock_guard<std::mutex> guard(m_epoch_mutex);
+    m_pins.insert(m_epoch);
+    return m_epoch;
+}
+
+void ValueLog::Unpin(uint64_t epoch) {
+    std::lock_guard<std::mutex> guard(m_epoch_mutex);
+    m_pins.erase(m_pins.find(epoch));
+}
+
+Status ValueLog::Scan(uint32_t file, vector<std::pair<VlogPointer, string>> *live, uint64_t *liveBytes) {
+    SequentialFile *raw = nullptr;
+    Status s = m_env->NewSequentialFile(SegmentName(file), &raw);
+    if (!s.ok()) {
+        return s;
+    }
+    std::unique_ptr<SequentialFile> in(raw);
+    uint64_t offset = 0;
+    *liveBytes = 0;
+    string key, current;
+    ReadOptions ropt;
+    ropt.fill_cache = false;
+    for (;;) {
+        char header[VLOG_HEADER_SIZE];
+        Slice result;
+        s = in->Read(sizeof(header), &result, header);
+        // a torn tail from a crash ends the segment
+        if (!s.ok() || result.size() < sizeof(header)) {
+            break;
+        }
+        uint32_t klen = get_fixed32(result.data() + 4);
+        uint32_t vlen = get_fixed32(result.data() + 8);
+        key.resize(klen);
+        s = in->Read(klen, &result, &key[0]);
+        if (!s.ok() || result.size() < klen) {
+            break;
+        }
+        key.assign(result.data(), result.size());
+        s = in->Skip(vlen);
+        if (!s.ok()) {
+            break;
+        }
+        m_stats.gc_scanned += sizeof(header) + klen + vlen;
+        VlogPointer ptr;
+        if (m_db->Get(ropt, key, &current).ok() && DecodePointer(current, &ptr) && ptr.file == file && ptr.offset == offset) {
+            *liveBytes += sizeof(header) + klen + vlen;
+            live->push_back(std::make_pair(ptr, key));
+        }
+        offset += sizeof(header) + klen + vlen;
+    }
+    return Status::OK();
+}
+
+// copies one live record to the head, unless a writer replaced the key meanwhile
+VlogRelocate ValueLog::Relocate(const VlogPointer &old, const string &key, WriteBatch *batch) {
+    string current, value, ptr;
+    VlogPointer cur;
+    Status s = m_db->Get(ReadOptions(), key, &current);
+    if (s.IsNotFound() || (s.ok() && !(DecodePointer(current, &cur) && cur.file == old.file && cur.offset == old.offset))) {
+        return VLOG_REPLACED;
+    }
+    if (s.ok()) {
+        s = Read(old, true, &value);
+    }
+    if (s.ok()) {
+        s = Append(key, value, &ptr);
+    }
+    if (!s.ok()) {
+        return VLOG_RELOCATE_FAILED;
+    }
+    batch->Put(key, ptr);
+    m_stats.gc_rewritten += VLOG_HEADER_SIZE + key.size() + value.size();
+    return VLOG_RELOCATED;
+}
+
+// relocates live records a chunk at a time, false when the segment must be kept
+bool ValueLog::RelocateAll(const vector<std::pair<VlogPointer, string>> &live) {
+    for (size_t i = 0; i < live.size(); i += VLOG_GC_BATCH_RECORDS) {
+        size_t end = std::min(live.size(), i + VLOG_GC_BATCH_RECORDS);
+        uint64_t mask = 0;
+        for (size_t j = i; j < end; j++) {
+            mask |= m_locks.Mask(live[j].second);
+        }
+        StripeGuard guard(m_locks, mask);
+        WriteBatch batch;
+        size_t moved = 0;
+        for (size_t j = i; j < end; j++) {
+            VlogRelocate r = Relocate(live[j].first, live[j].second, &batch);
+            if (r == VLOG_RELOCATE_FAILED) {
+                return false;
+            }
+            moved += r == VLOG_RELOCATED;
+        }
+        if (moved == 0) {
+            continue;
+        }
+        // the new records and then the pointers to them are durable before the old segment can go
+        Status s = SyncHead();
+        if (s.ok()) {
+            WriteOptions wopt;
+            wopt.sync = true;
+            s = m_db->Write(wopt, &batch);
+        }
+        if (!s.ok()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a reader pinned at epoch e may follow pointers into segments stamped after e, older stamps are unreachable
+void ValueLog::DeleteObsolete() {
+    uint64_t oldest = UINT64_MAX;
+    {
+        std::lock_guard<std::mutex> guard(m_epoch_mutex);
+        if (!m_pins.empty()) {
+            oldest = *m_pins.begin();
+        }
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto it = m_segments.begin(); it != m_segments.end();) {
+        if (!it->second.obsolete || it->second.obsolete_epoch > oldest) {
+            ++it;
+            continue;
+        }
+        it->second.file.reset();
+        m_env->DeleteFile(SegmentName(it->first));
+        m_stats.gc_reclaimed += it->second.size;
+        m_stats.gc_segments++;
+        it = m_segments.erase(it);
+    }
+}
+
+uint64_t ValueLog::Gc(double ratio) {
+    std::lock_guard<std::mutex> gc(m_gc_mutex);
+    uint64_t pass = ++m_gc_passes;
+    uint64_t start = now_micros();
+    uint64_t reclaimed = m_stats.gc_reclaimed;
+    vector<uint32_t> candidates;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        uint32_t head = m_head_file;
+        for (auto &it : m_segments) {
+            if (it.first != head && !it.second.obsolete) {
+                candidates.push_back(it.first);
+            }
+        }
+    }
+    for (uint32_t file : candidates) {
+        uint64_t size = 0, dead = 0;
+        {
+            // a sealed segment only loses live bytes, so one still above ratio by the estimate is skipped
+            std::lock_guard<std::mutex> guard(m_mutex);
+            VlogSegment &seg = m_segments[file];
+            size = seg.size;
+            dead = seg.dead;
+            bool stale = dead > 0 && pass - seg.scanned_pass >= VLOG_GC_RESCAN_PASSES;
+            if (seg.scanned && !stale && size > 0 && seg.live > dead && seg.live - dead >= size * ratio) {
+                continue;
+            }
+        }
+        vector<std::pair<VlogPointer, string>> live;
+        uint64_t liveBytes = 0;
+        Status s = Scan(file, &live, &liveBytes);
+        bool collect = s.ok() && (size == 0 || liveBytes < size * ratio);
+        if (collect) {
+            collect = RelocateAll(live);
+        }
+        std::lock_guard<std::mutex> guard(m_mutex);
+        VlogSegment &seg = m_segments[file];
+        seg.scanned = s.ok();
+        seg.scanned_pass = pass;
+        seg.live = liveBytes;
+        // the scan already saw what died before it started
+        seg.dead -= std::min(seg.dead, dead);
+        seg.obsolete = collect;
+        if (collect) {
+            // the relocated pointers are durable, readers pinned from now on never see the old ones
+            std::lock_guard<std::mutex> epoch(m_epoch_mutex);
+            seg.obsolete_epoch = ++m_epoch;
+        }
+    }
+    DeleteObsolete();
+    m_stats.gc_runs++;
+    m_stats.gc_micros += now_micros() - start;
+    return m_stats.gc_reclaimed - reclaimed;
+}
+
+void ValueLog::GcLoop() {
+    std::unique_lock<std::mutex> lock(m_gc_wait_mutex);
+    while (!m_stop) {
+        m_gc_cond.wait_for(lock, std::chrono::seconds(VLOG_GC_INTERVAL_SECONDS));
+        if (m_stop) {
+            break;
+        }
+        lock.unlock();
+        Gc(VLOG_GC_RATIO);
+        lock.lock();
+    }
+}
+
+void ValueLog::Push(lua_State *L) {
+    uint64_t disk = 0, live = 0;
+    int segments = 0;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for (auto &it : m_segments) {
+            const VlogSegment &seg = it.second;
+            disk += seg.size;
+            segments++;
+            if (!seg.obsolete) {
+                live += seg.scanned ? seg.live - std::min(seg.live, seg.dead) : seg.size;
+            }
+        }
+    }
+    lua_newtable(L);
+    lua_pushinteger(L, segments);
+    lua_setfield(L, -2, "segments");
+    lua_pushinteger(L, disk);
+    lua_setfield(L, -2, "diskBytes");
+    lua_pushinteger(L, live);
+    lua_setfield(L, -2, "liveBytes");
+    lua_pushnumber(L, live ? (double)disk / live : 1.0);
+    lua_setfield(L, -2, "spaceAmp");
+    lua_pushinteger(L, m_stats.values);
+    lua_setfield(L, -2, "values");
+    lua_pushinteger(L, m_stats.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, m_stats.gc_runs);
+    lua_setfield(L, -2, "gcRuns");
+    lua_pushinteger(L, m_stats.gc_scanned);
+    lua_setfield(L, -2, "gcScannedBytes");
+    lua_pushinteger(L, m_stats.gc_rewritten);
+    lua_setfield(L, -2, "gcRewrittenBytes");
+    lua_pushinteger(L, m_stats.gc_reclaimed);
+    lua_setfield(L, -2, "gcReclaimedBytes");
+    lua_pushinteger(L, m_stats.gc_segments);
+    lua_setfield(L, -2, "gcSegments");
+    lua_pushinteger(L, m_stats.gc_micros);
+    lua_setfield(L, -2, "gcMicros");
+    uint64_t micros = m_stats.gc_micros;
+    lua_pushnumber(L, micros ? m_stats.gc_scanned * 1e6 / micros : 0.0);
+    lua_setfield(L, -2, "gcThroughput");
+}
+
+int lvldb_database_value_log_stats(lua_State *L) {
+    DbState *state = check_db_state(L, 1);
+    if (!state->m_vlog) {
+        lua_pushnil(L);
+        return 1;
+    }
+    state->m_vlog->Push(L);
+    return 1;
+}
+
+// ldb:valueLogGc([ratio]), collects segments with less than ratio of live data, returns bytes reclaimed
+int lvldb_database_value_log_gc(lua_State *L) {
+    DbState *state = check_db_state(L, 1);
+    lua_Number ratio = luaL_optnumber(L, 2, VLOG_GC_RATIO);
+    luaL_argcheck(L, ratio > 0 && ratio <= 1, 2, "ratio must be in (0, 1]");
+    if (!state->m_vlog) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushinteger(L, state->m_vlog->Gc(ratio));
+    return 1;
+}
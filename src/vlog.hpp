@@ -0,0 +1,140 @@
+﻿#pragma once
+#include "lib.hpp"
+#include "locks.hpp"
+#include <leveldb/env.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+// where a separated value lives, leveldb stores the encoded form instead of the value
+struct VlogPointer {
+    uint32_t file;
+    uint64_t offset;
+    uint32_t key_len;
+    uint32_t value_len;
+};
+
+struct VlogSegment {
+    VlogSegment() : size(0), live(0), dead(0), scanned_pass(0), scanned(false), obsolete(false), obsolete_epoch(0), file_size(0) {}
+
+    uint64_t size;
+    // live bytes as of the last GC scan
+    uint64_t live;
+    // sampled estimate of the bytes overwritten or deleted since that scan
+    uint64_t dead;
+    uint64_t scanned_pass;
+    bool scanned;
+    // rewritten by GC, deleted once every reader pinned before obsolete_epoch is gone
+    bool obsolete;
+    uint64_t obsolete_epoch;
+    // read handle and the segment size when it was opened, mmap'ed handles can't see later appends
+    std::shared_ptr<RandomAccessFile> file;
+    uint64_t file_size;
+};
+
+struct VlogStats {
+    VlogStats() : values(0), bytes(0), gc_runs(0), gc_scanned(0), gc_rewritten(0), gc_reclaimed(0), gc_segments(0), gc_micros(0) {}
+
+    std::atomic<uint64_t> values;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> gc_runs;
+    std::atomic<uint64_t> gc_scanned;
+    std::atomic<uint64_t> gc_rewritten;
+    std::atomic<uint64_t> gc_reclaimed;
+    std::atomic<uint64_t> gc_segments;
+    std::atomic<uint64_t> gc_micros;
+};
+
+enum VlogRelocate { VLOG_RELOCATED, VLOG_REPLACED, VLOG_RELOCATE_FAILED };
+
+// WiscKey-style value log: values of at least m_threshold bytes are appended to
+// <path>.vlog/NNNNNN.vlog segments and leveldb keeps a small pointer to them
+class ValueLog {
+public:
+    ValueLog(Env *env, const string &dir, size_t threshold, size_t segmentSize);
+    ~ValueLog();
+
+    Status Open(DB *db);
+    // stops the GC thread, must run before the DB is deleted
+    void Close();
+
+    static bool DecodePointer(const Slice &value, VlogPointer *ptr);
+    // size of the user value, without reading it from the log
+    static uint64_t ValueSize(const Slice &value);
+
+    Status Put(const WriteOptions &opt, const Slice &key, const Slice &value);
+    Status Delete(const WriteOptions &opt, const Slice &key);
+    Status Write(const WriteOptions &opt, WriteBatch *batch);
+    Status Get(const ReadOptions &opt, const Slice &key, string *value);
+    // wraps a new DB iterator so value() returns the separated values
+    Iterator *NewIterator(const ReadOptions &opt);
+    // DB snapshot pinning the segments its pointers may lead into
+    const Snapshot *GetSnapshot();
+    void ReleaseSnapshot(const Snapshot *snapshot);
+    // registers a reader, segments made obsolete from now on outlive it, returns the token for Unpin
+    uint64_t Pin();
+    void Unpin(uint64_t epoch);
+    Status Read(const VlogPointer &ptr, bool verify, string *value);
+
+    // rewrites sealed segments whose live ratio is below ratio, returns the bytes reclaimed
+    uint64_t Gc(double ratio);
+    void Push(lua_State *L);
+
+    // appends one record and encodes its pointer, used by the batch rewriter
+    Status Append(const Slice &key, const Slice &value, string *ptr);
+    Status SyncHead();
+
+    size_t m_threshold;
+    // keys written so far, every VLOG_DEAD_SAMPLE-th one charges its old record to the dead estimate
+    std::atomic<uint64_t> m_writes;
+    VlogStats m_stats;
+    // writers and GC relocation lock the stripes of the keys they touch
+    StripedLocks m_locks;
+
+private:
+    string SegmentName(uint32_t file) const;
+    Status OpenHead();
+    Status Scan(uint32_t file, vector<std::pair<VlogPointer, string>> *live, uint64_t *liveBytes);
+    // caller holds the key's stripe, the new pointer is staged in batch
+    VlogRelocate Relocate(const VlogPointer &old, const string &key, WriteBatch *batch);
+    bool RelocateAll(const vector<std::pair<VlogPointer, string>> &live);
+    void NoteReplaced(const Slice &key);
+    void DeleteObsolete();
+    void GcLoop();
+
+    Env *m_env;
+    string m_dir;
+    size_t m_segment_size;
+    DB *m_db;
+
+    // guards m_segments
+    std::mutex m_mutex;
+    std::map<uint32_t, VlogSegment> m_segments;
+
+    std::mutex m_append_mutex;
+    WritableFile *m_head;
+    std::atomic<uint32_t> m_head_file;
+    uint64_t m_head_size;
+
+    // guards m_epoch, m_pins and m_snapshot_pins
+    std::mutex m_epoch_mutex;
+    uint64_t m_epoch;
+    // start epochs of open iterators, snapshots and reads in flight
+    std::multiset<uint64_t> m_pins;
+    std::map<const Snapshot *, uint64_t> m_snapshot_pins;
+
+    // guards m_gc_passes
+    std::mutex m_gc_mutex;
+    uint64_t m_gc_passes;
+    std::mutex m_gc_wait_mutex;
+    std::condition_variable m_gc_cond;
+    bool m_stop;
+    std::thread m_gc_thread;
+};
+
+int lvldb_database_value_log_stats(lua_State *L);
+int lvldb_database_value_log_gc(lua_State *L);
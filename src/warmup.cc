@@ -0,0 +1,276 @@
+﻿#include "warmup.hpp"
+#include "db.hpp"
+#include "env.hpp"
+#include "range.hpp"
+#include "state.hpp"
+#include <algorithm>
+#include <memory>
+#include <string.h>
+
+#define WARMUP_DEFAULT_THREADS 2
+#define WARMUP_MAX_THREADS 16
+// file: magic fixed32(count), then fixed32(len) key for each key
+#define HOT_KEYS_MAGIC "LHK1"
+// one get in HOT_KEYS_SAMPLE_RATE is counted
+#define HOT_KEYS_SAMPLE_RATE 16
+// tracked keys before the counts are halved
+#define HOT_KEYS_TRACK_FACTOR 4
+
+static void put_fixed32(string &dst, uint32_t v) {
+    char buf[4];
+    for (int i = 0; i < 4; i++) {
+        buf[i] = char(v >> (i * 8));
+    }
+    dst.append(buf, sizeof(buf));
+}
+
+static uint32_t get_fixed32(const char *p) {
+    const uint8_t *u = (const uint8_t *)p;
+    return uint32_t(u[0]) | uint32_t(u[1]) << 8 | uint32_t(u[2]) << 16 | uint32_t(u[3]) << 24;
+}
+
+Warmup::Warmup()
+    : m_db(nullptr), m_block_size(0), m_source(nullptr), m_budget(0), m_start(0), m_next(0), m_active(0), m_stop(false), m_exhausted(false), m_ranges_done(0), m_keys(0),
+      m_bytes(0), m_micros(0) {}
+
+Warmup::~Warmup() {
+    Stop();
+}
+
+void Warmup::Attach(DB *db, size_t blockSize) {
+    m_db = db;
+    m_block_size = blockSize;
+}
+
+bool Warmup::Start(vector<WarmRange> &ranges, uint64_t budget, int threads, const char *source) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_active > 0 || m_stop || !m_db) {
+        return false;
+    }
+    for (auto &t : m_threads) {
+        t.join();
+    }
+    m_threads.clear();
+    m_ranges.swap(ranges);
+    m_source = source;
+    m_budget = budget;
+    m_start = now_micros();
+    m_next = 0;
+    m_exhausted = false;
+    m_ranges_done = 0;
+    m_keys = 0;
+    m_bytes = 0;
+    m_micros = 0;
+    threads = (int)std::max<size_t>(1, std::min<size_t>(threads, m_ranges.size()));
+    m_active = threads;
+    for (int i = 0; i < threads; i++) {
+        m_threads.push_back(std::thread(&Warmup::Run, this));
+    }
+    return true;
+}
+
+void Warmup::Stop() {
+    m_stop = true;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto &t : m_threads) {
+        t.join();
+    }
+    m_threads.clear();
+}
+
+void Warmup::Run() {
+    for (size_t i = m_next++; i < m_ranges.size() && !m_stop && !m_exhausted; i = m_next++) {
+        WarmRangeAt(m_ranges[i]);
+        m_ranges_done++;
+    }
+    // the last thread out marks the warmup complete
+    if (--m_active == 0) {
+        m_micros = now_micros() - m_start;
+    }
+}
+
+void Warmup::WarmRangeAt(const WarmRange &r) {
+    ReadOptions ropt;
+    ropt.fill_cache = true;
+    // only the blocks are wanted, separated values stay in the value log
+    std::unique_ptr<Iterator> it(m_db->NewIterator(ropt));
+    for (it->Seek(r.from); it->Valid() && !m_stop; it->Next()) {
+        Slice key = it->key();
+        if (!r.to.empty() && key.compare(r.to) >= 0) {
+            break;
+        }
+        uint64_t n = key.size() + it->value().size();
+        // a point loads a whole block into the cache for a single entry
+        if (r.point) {
+            n = std::max<uint64_t>(n, m_block_size);
+        }
+        if (m_budget > 0 && m_bytes.fetch_add(n) + n > m_budget) {
+            m_exhausted = true;
+            return;
+        }
+        m_keys++;
+        if (r.point) {
+            break;
+        }
+    }
+}
+
+void Warmup::Push(lua_State *L) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_source) {
+        lua_pushnil(L);
+        return;
+    }
+    bool running = m_active > 0;
+    lua_createtable(L, 0, 10);
+    lua_pushboolean(L, running);
+    lua_setfield(L, -2, "running");
+    lua_pushboolean(L, !running);
+    lua_setfield(L, -2, "done");
+    lua_pushstring(L, m_source);
+    lua_setfield(L, -2, "source");
+    lua_pushinteger(L, (lua_Integer)m_ranges.size());
+    lua_setfield(L, -2, "ranges");
+    lua_pushinteger(L, (lua_Integer)m_ranges_done.load());
+    lua_setfield(L, -2, "rangesDone");
+    lua_pushinteger(L, (lua_Integer)m_keys.load());
+    lua_setfield(L, -2, "keys");
+    lua_pushinteger(L, (lua_Integer)std::min(m_bytes.load(), m_budget > 0 ? m_budget : m_bytes.load()));
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)m_budget);
+    lua_setfield(L, -2, "budgetBytes");
+    lua_pushboolean(L, m_exhausted.load());
+    lua_setfield(L, -2, "budgetExhausted");
+    lua_pushinteger(L, (lua_Integer)(running ? now_micros() - m_start : m_micros.load()));
+    lua_setfield(L, -2, "micros");
+}
+
+HotKeys::HotKeys(Env *env, const string &file, size_t limit) : m_env(env), m_file(file), m_limit(limit) {}
+
+void HotKeys::Record(const Slice &key) {
+    static thread_local uint32_t tick = 0;
+    if (++tick % HOT_KEYS_SAMPLE_RATE != 0) {
+        return;
+    }
+    // a busy recorder drops the sample rather than stall the read
+    std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    m_counts[key.ToString()]++;
+    if (m_counts.size() > m_limit * HOT_KEYS_TRACK_FACTOR) {
+        for (auto it = m_counts.begin(); it != m_counts.end();) {
+            if ((it->second >>= 1) == 0) {
+                it = m_counts.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+vector<string> HotKeys::Load() {
+    vector<string> keys;
+    string data;
+    if (m_file.empty() || !m_env->FileExists(m_file) || !ReadFileToString(m_env, m_file, &data).ok()) {
+        return keys;
+    }
+    if (data.size() < 8 || memcmp(data.data(), HOT_KEYS_MAGIC, 4) != 0) {
+        return keys;
+    }
+    uint32_t count = get_fixed32(data.data() + 4);
+    size_t pos = 8;
+    for (uint32_t i = 0; i < count && pos + 4 <= data.size(); i++) {
+        uint32_t len = get_fixed32(data.data() + pos);
+        pos += 4;
+        if (pos + len > data.size()) {
+            break;
+        }
+        keys.push_back(data.substr(pos, len));
+        pos += len;
+    }
+    return keys;
+}
+
+bool HotKeys::Replay(Warmup &warmup, uint64_t budget) {
+    vector<string> keys = Load();
+    if (keys.empty()) {
+        return false;
+    }
+    vector<WarmRange> ranges;
+    ranges.reserve(keys.size());
+    for (auto &key : keys) {
+        ranges.push_back(WarmRange(key, string(), true));
+    }
+    return warmup.Start(ranges, budget, WARMUP_DEFAULT_THREADS, "replay");
+}
+
+void HotKeys::Save() {
+    if (m_file.empty()) {
+        return;
+    }
+    vector<std::pair<uint32_t, const string *>> hot;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_counts.empty()) {
+        return;
+    }
+    hot.reserve(m_counts.size());
+    for (auto &kv : m_counts) {
+        hot.push_back(std::make_pair(kv.second, &kv.first));
+    }
+    size_t n = std::min(hot.size(), m_limit);
+    std::partial_sort(hot.begin(), hot.begin() + n, hot.end(), [](const std::pair<uint32_t, const string *> &a, const std::pair<uint32_t, const string *> &b) {
+        return a.first > b.first;
+    });
+    // replayed in key order so neighbouring keys share their block reads
+    std::sort(hot.begin(), hot.begin() + n, [](const std::pair<uint32_t, const string *> &a, const std::pair<uint32_t, const string *> &b) {
+        return *a.second < *b.second;
+    });
+    string data(HOT_KEYS_MAGIC);
+    put_fixed32(data, (uint32_t)n);
+    for (size_t i = 0; i < n; i++) {
+        put_fixed32(data, (uint32_t)hot[i].second->size());
+        data.append(*hot[i].second);
+    }
+    WriteStringToFile(m_env, data, m_file);
+}
+
+// ldb:warmup{ranges={{from=, to=} | {prefix=}, ...}, budgetBytes=, threads=}
+int lvldb_database_warmup(lua_State *L) {
+    check_database(L, 1);
+    DbState *state = check_db_state(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    vector<WarmRange> ranges;
+    lua_getfield(L, 2, "ranges");
+    luaL_argcheck(L, lua_istable(L, -1), 2, "ranges must be a table");
+    int idx = lua_gettop(L);
+    for (int i = 1;; i++) {
+        lua_rawgeti(L, idx, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        luaL_argcheck(L, lua_istable(L, -1), 2, "each range must be a table");
+        int r = lua_gettop(L);
+        string prefix = opt_string_field(L, r, "prefix");
+        if (!prefix.empty()) {
+            ranges.push_back(WarmRange(prefix, prefix_successor(prefix), false));
+        } else {
+            ranges.push_back(WarmRange(opt_string_field(L, r, "from"), opt_string_field(L, r, "to"), false));
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    // reading past the cache capacity only evicts what was just loaded
+    lua_Integer budget = opt_int_field(L, 2, "budgetBytes", (lua_Integer)state->BlockCacheCapacity());
+    lua_Integer threads = opt_int_field(L, 2, "threads", WARMUP_DEFAULT_THREADS);
+    luaL_argcheck(L, budget >= 0, 2, "budgetBytes must not be negative");
+    threads = std::max<lua_Integer>(1, std::min<lua_Integer>(threads, WARMUP_MAX_THREADS));
+    lua_pushboolean(L, state->m_warmup.Start(ranges, (uint64_t)budget, (int)threads, "warmup"));
+    return 1;
+}
+
+int lvldb_database_warmup_progress(lua_State *L) {
+    check_db_state(L, 1)->m_warmup.Push(L);
+    return 1;
+}
@@ -0,0 +1,76 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <leveldb/env.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+struct WarmRange {
+    WarmRange(const string &from, const string &to, bool point) : from(from), to(to), point(point) {}
+
+    string from;
+    // empty means to the end of the db
+    string to;
+    // only the block holding from is loaded
+    bool point;
+};
+
+// reads ranges on background threads with fill_cache so later reads hit the block cache
+class Warmup {
+public:
+    Warmup();
+    ~Warmup();
+
+    void Attach(DB *db, size_t blockSize);
+    // false while a previous warmup is still running
+    bool Start(vector<WarmRange> &ranges, uint64_t budget, int threads, const char *source);
+    void Stop();
+
+    // nothing is pushed before the first warmup
+    void Push(lua_State *L);
+
+private:
+    void Run();
+    void WarmRangeAt(const WarmRange &r);
+
+    DB *m_db;
+    size_t m_block_size;
+    std::mutex m_mutex;
+    vector<std::thread> m_threads;
+    vector<WarmRange> m_ranges;
+    const char *m_source;
+    uint64_t m_budget;
+    uint64_t m_start;
+    std::atomic<size_t> m_next;
+    std::atomic<int> m_active;
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_exhausted;
+    std::atomic<uint64_t> m_ranges_done;
+    std::atomic<uint64_t> m_keys;
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<uint64_t> m_micros;
+};
+
+// sampled get keys with decaying hit counts, the hottest are saved at close
+// and replayed as point warmups on the next open
+class HotKeys {
+public:
+    HotKeys(Env *env, const string &file, size_t limit);
+
+    void Record(const Slice &key);
+    vector<string> Load();
+    // starts a point warmup over the keys saved by the last close
+    bool Replay(Warmup &warmup, uint64_t budget);
+    void Save();
+
+private:
+    Env *m_env;
+    string m_file;
+    size_t m_limit;
+    std::mutex m_mutex;
+    std::unordered_map<string, uint32_t> m_counts;
+};
+
+int lvldb_database_warmup(lua_State *L);
+int lvldb_database_warmup_progress(lua_State *L);
@@ -0,0 +1,227 @@
+﻿#include "watch.hpp"
+#include "db.hpp"
+#include "state.hpp"
+
+WatchRing::WatchRing(size_t capacity) : m_head(0), m_tail(0) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_slots.reset(new Slot[size]);
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool WatchRing::Push(bool del, const Slice &key, const Slice &value) {
+    uint64_t pos = m_head.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+        slot = &m_slots[pos & m_mask];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+    slot->ev.del = del;
+    slot->ev.key.assign(key.data(), key.size());
+    slot->ev.value.assign(value.data(), value.size());
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool WatchRing::Pop(WatchEvent *ev) {
+    uint64_t pos = m_tail.load(std::memory_order_relaxed);
+    Slot *slot = &m_slots[pos & m_mask];
+    if (slot->seq.load(std::memory_order_acquire) != pos + 1) {
+        return false;
+    }
+    ev->del = slot->ev.del;
+    ev->key.swap(slot->ev.key);
+    ev->value.swap(slot->ev.value);
+    slot->seq.store(pos + m_mask + 1, std::memory_order_release);
+    m_tail.store(pos + 1, std::memory_order_relaxed);
+    return true;
+}
+
+size_t WatchRing::Size() const {
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    return head > tail ? size_t(head - tail) : 0;
+}
+
+void Watcher::Publish(bool del, const Slice &key, const Slice &value) {
+    if (m_ring.Push(del, key, value)) {
+        m_delivered++;
+    } else {
+        m_dropped++;
+    }
+}
+
+void WatchList::Add(const std::shared_ptr<Watcher> &watcher) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    std::shared_ptr<Watchers> next(m_watchers ? new Watchers(*m_watchers) : new Watchers());
+    next->push_back(watcher);
+    m_watchers = next;
+    m_count = (int)next->size();
+}
+
+void WatchList::Remove(Watcher *watcher) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_watchers) {
+        return;
+    }
+    std::shared_ptr<Watchers> next(new Watchers());
+    for (auto &w : *m_watchers) {
+        if (w.get() != watcher) {
+            next->push_back(w);
+        }
+    }
+    m_watchers = next;
+    m_count = (int)next->size();
+}
+
+std::shared_ptr<const WatchList::Watchers> WatchList::Snapshot() {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_watchers;
+}
+
+void WatchList::Publish(bool del, const Slice &key, const Slice &value) {
+    if (Empty()) {
+        return;
+    }
+    auto watchers = Snapshot();
+    for (auto &w : *watchers) {
+        if (w->Matches(key)) {
+            w->Publish(del, key, value);
+        }
+    }
+}
+
+class WatchPublisher : public WriteBatch::Handler {
+public:
+    WatchPublisher(const vector<std::shared_ptr<Watcher>> &watchers) : m_watchers(watchers) {}
+
+    virtual void Put(const Slice &key, const Slice &value) {
+        for (auto &w : m_watchers) {
+            if (w->Matches(key)) {
+                w->Publish(false, key, value);
+            }
+        }
+    }
+
+    virtual void Delete(const Slice &key) {
+        for (auto &w : m_watchers) {
+            if (w->Matches(key)) {
+                w->Publish(true, key, Slice());
+            }
+        }
+    }
+
+    const vector<std::shared_ptr<Watcher>> &m_watchers;
+};
+
+void WatchList::Publish(WriteBatch *batch) {
+    if (Empty()) {
+        return;
+    }
+    auto watchers = Snapshot();
+    WatchPublisher publisher(*watchers);
+    batch->Iterate(&publisher);
+}
+
+class Subscription {
+public:
+    Subscription(DB *db, const std::shared_ptr<Watcher> &watcher) : m_db(db), m_state(l_get_db_state(db)), m_watcher(watcher) {
+        l_ref_db(db);
+        m_state->m_watchers.Add(m_watcher);
+    }
+
+    ~Subscription() {
+        m_state->m_watchers.Remove(m_watcher.get());
+        l_unregister_db(m_db, [](void *db) {
+            delete (DB *)db;
+        });
+    }
+
+    DB *m_db;
+    DbState *m_state;
+    std::shared_ptr<Watcher> m_watcher;
+};
+
+static Subscription *check_watch(lua_State *L, int index) {
+    Subscription *sub = *(Subscription **)luaL_checkudata(L, index, LVLDB_MT_WATCH);
+    luaL_argcheck(L, sub != nullptr, index, "subscription is closed");
+    return sub;
+}
+
+// ldb:watch(prefix, [capacity])
+int lvldb_database_watch(lua_State *L) {
+    DB *db = check_database(L, 1);
+    Slice prefix = lua_to_slice(L, 2);
+    lua_Integer capacity = luaL_optinteger(L, 3, WATCH_DEFAULT_CAPACITY);
+    luaL_argcheck(L, capacity > 0, 3, "capacity must be positive");
+    Subscription **sub = (Subscription **)lua_newuserdata(L, sizeof(Subscription *));
+    *sub = nullptr;
+    luaL_getmetatable(L, LVLDB_MT_WATCH);
+    lua_setmetatable(L, -2);
+    *sub = new Subscription(db, std::make_shared<Watcher>(prefix, (size_t)capacity));
+    return 1;
+}
+
+// sub:poll([max]), returns the pending events and how many were dropped since the last poll
+int lvldb_watch_poll(lua_State *L) {
+    Subscription *sub = check_watch(L, 1);
+    lua_Integer max = luaL_optinteger(L, 2, WATCH_DEFAULT_POLL);
+    Watcher *w = sub->m_watcher.get();
+    lua_newtable(L);
+    WatchEvent ev;
+    for (lua_Integer i = 1; i <= max && w->m_ring.Pop(&ev); i++) {
+        lua_createtable(L, 0, 3);
+        lua_pushstring(L, ev.del ? "delete" : "put");
+        lua_setfield(L, -2, "type");
+        lua_pushlstring(L, ev.key.data(), ev.key.size());
+        lua_setfield(L, -2, "key");
+        if (!ev.del) {
+            lua_pushlstring(L, ev.value.data(), ev.value.size());
+            lua_setfield(L, -2, "value");
+        }
+        lua_rawseti(L, -2, (int)i);
+    }
+    uint64_t dropped = w->m_dropped;
+    lua_pushinteger(L, (lua_Integer)(dropped - w->m_reported));
+    w->m_reported = dropped;
+    return 2;
+}
+
+int lvldb_watch_stats(lua_State *L) {
+    Subscription *sub = check_watch(L, 1);
+    Watcher *w = sub->m_watcher.get();
+    lua_createtable(L, 0, 5);
+    lua_pushlstring(L, w->m_prefix.data(), w->m_prefix.size());
+    lua_setfield(L, -2, "prefix");
+    lua_pushinteger(L, (lua_Integer)w->m_ring.Capacity());
+    lua_setfield(L, -2, "capacity");
+    lua_pushinteger(L, (lua_Integer)w->m_ring.Size());
+    lua_setfield(L, -2, "pending");
+    lua_pushinteger(L, (lua_Integer)w->m_delivered.load());
+    lua_setfield(L, -2, "delivered");
+    lua_pushinteger(L, (lua_Integer)w->m_dropped.load());
+    lua_setfield(L, -2, "dropped");
+    return 1;
+}
+
+int lvldb_watch_close(lua_State *L) {
+    Subscription **sub = (Subscription **)luaL_checkudata(L, 1, LVLDB_MT_WATCH);
+    delete *sub;
+    *sub = nullptr;
+    return 0;
+}
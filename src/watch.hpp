@@ -0,0 +1,79 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define WATCH_DEFAULT_CAPACITY 4096
+#define WATCH_DEFAULT_POLL 1024
+
+struct WatchEvent {
+    bool del;
+    string key;
+    string value;
+};
+
+// bounded multi-producer single-consumer queue, producers never block and drop the event when it is full
+class WatchRing {
+public:
+    WatchRing(size_t capacity);
+
+    bool Push(bool del, const Slice &key, const Slice &value);
+    bool Pop(WatchEvent *ev);
+    size_t Capacity() const { return m_mask + 1; }
+    size_t Size() const;
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        WatchEvent ev;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    std::atomic<uint64_t> m_head;
+    std::atomic<uint64_t> m_tail;
+};
+
+class Watcher {
+public:
+    Watcher(const Slice &prefix, size_t capacity) : m_prefix(prefix.ToString()), m_ring(capacity), m_dropped(0), m_delivered(0), m_reported(0) {}
+
+    bool Matches(const Slice &key) const { return key.starts_with(m_prefix); }
+    void Publish(bool del, const Slice &key, const Slice &value);
+
+    string m_prefix;
+    WatchRing m_ring;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_delivered;
+    // dropped count already returned by poll
+    uint64_t m_reported;
+};
+
+// subscribers of one db, publishing is a single relaxed load while there are none
+class WatchList {
+public:
+    WatchList() : m_count(0) {}
+
+    bool Empty() const { return m_count.load(std::memory_order_relaxed) == 0; }
+    void Add(const std::shared_ptr<Watcher> &watcher);
+    void Remove(Watcher *watcher);
+    void Publish(bool del, const Slice &key, const Slice &value);
+    void Publish(WriteBatch *batch);
+
+private:
+    typedef vector<std::shared_ptr<Watcher>> Watchers;
+
+    std::shared_ptr<const Watchers> Snapshot();
+
+    std::mutex m_mutex;
+    // replaced as a whole, so publishers iterate a snapshot without holding the mutex
+    std::shared_ptr<const Watchers> m_watchers;
+    std::atomic<int> m_count;
+};
+
+int lvldb_database_watch(lua_State *L);
+int lvldb_watch_poll(lua_State *L);
+int lvldb_watch_stats(lua_State *L);
+int lvldb_watch_close(lua_State *L);
@@ -0,0 +1,220 @@
+﻿#include "zstream.hpp"
+#include "utils.hpp"
+#include "memory.hpp"
+#include <memory>
+
+// output is produced at most this many bytes at a time
+#define DEFLATE_OUT_CHUNK (64 * 1024)
+#define MZ_DEFAULT_LEVEL 6
+#define MZ_WINDOW_BITS 15
+
+static void inflater_reset(Inflater *inf) {
+    tinfl_init(inf->decomp);
+    inf->dict_ofs = 0;
+    inf->total = 0;
+    inf->done = false;
+}
+
+InflateResult inflate_chunk(Inflater *inf, const uint8_t *data, size_t len, bool more, luaL_Buffer *b) {
+    if (inf->done) {
+        return INFLATE_DONE;
+    }
+    mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER | (more ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+    size_t consumed = 0;
+    for (;;) {
+        size_t in_size = len - consumed;
+        size_t out_size = TINFL_LZ_DICT_SIZE - inf->dict_ofs;
+        tinfl_status status = tinfl_decompress(inf->decomp, data + consumed, &in_size, inf->dict, inf->dict + inf->dict_ofs, &out_size, flags);
+        consumed += in_size;
+        inf->total += out_size;
+        if (inf->limit && inf->total > inf->limit) {
+            return INFLATE_LIMIT;
+        }
+        luaL_addlstring(b, (const char *)inf->dict + inf->dict_ofs, out_size);
+        inf->dict_ofs = (inf->dict_ofs + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+        if (status < TINFL_STATUS_DONE) {
+            return INFLATE_CORRUPT;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            inf->done = true;
+            return INFLATE_DONE;
+        }
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            return INFLATE_OK;
+        }
+    }
+}
+
+// reused by the read path so limited gets don't allocate the 40KB of inflate state each time
+struct InflateScratch {
+    InflateScratch() { MemoryAccountant::Instance().Account(MEM_COMPRESSION, sizeof(InflateScratch)); }
+    ~InflateScratch() { MemoryAccountant::Instance().Account(MEM_COMPRESSION, -(int64_t)sizeof(InflateScratch)); }
+
+    tinfl_decompressor decomp;
+    mz_uint8 dict[TINFL_LZ_DICT_SIZE];
+};
+
+InflateResult inflate_limited(lua_State *L, const char *data, size_t len, size_t limit) {
+    static thread_local std::unique_ptr<InflateScratch> scratch;
+    if (!scratch) {
+        scratch.reset(new InflateScratch);
+    }
+    Inflater inf;
+    inf.decomp = &scratch->decomp;
+    inf.dict = scratch->dict;
+    inf.limit = limit;
+    inflater_reset(&inf);
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    InflateResult res = inflate_chunk(&inf, (const uint8_t *)data, len, false, &b);
+    luaL_pushresult(&b);
+    if (res != INFLATE_DONE) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    return res;
+}
+
+static Deflater *check_deflater(lua_State *L, int index) {
+    Deflater *def = (Deflater *)luaL_checkudata(L, index, LVLDB_MT_DEFLATER);
+    luaL_argcheck(L, def->comp != nullptr, index, "deflater is closed");
+    return def;
+}
+
+static Inflater *check_inflater(lua_State *L, int index) {
+    Inflater *inf = (Inflater *)luaL_checkudata(L, index, LVLDB_MT_INFLATER);
+    luaL_argcheck(L, inf->decomp != nullptr, index, "inflater is closed");
+    return inf;
+}
+
+// lualeveldb.deflater([level]), output is compatible with mz_decompress
+int lvldb_deflater(lua_State *L) {
+    int level = (int)luaL_optinteger(L, 1, MZ_DEFAULT_LEVEL);
+    luaL_argcheck(L, level >= 0 && level <= 10, 1, "level must be between 0 and 10");
+    Deflater *def = (Deflater *)lua_newuserdata(L, sizeof(Deflater));
+    def->comp = nullptr;
+    luaL_getmetatable(L, LVLDB_MT_DEFLATER);
+    lua_setmetatable(L, -2);
+    def->flags = (int)tdefl_create_comp_flags_from_zip_params(level, MZ_WINDOW_BITS, 0);
+    def->comp = new tdefl_compressor;
+    MemoryAccountant::Instance().Account(MEM_COMPRESSION, sizeof(tdefl_compressor));
+    tdefl_init(def->comp, nullptr, nullptr, def->flags);
+    return 1;
+}
+
+static int deflate_push(lua_State *L, Deflater *def, const char *data, size_t len, tdefl_flush flush) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    size_t consumed = 0;
+    tdefl_status status;
+    size_t out_size;
+    do {
+        size_t in_size = len - consumed;
+        out_size = DEFLATE_OUT_CHUNK;
+        char *out = luaL_prepbuffsize(&b, out_size);
+        status = tdefl_compress(def->comp, data + consumed, &in_size, out, &out_size, flush);
+        consumed += in_size;
+        luaL_addsize(&b, out_size);
+        if (status < TDEFL_STATUS_OKAY) {
+            return luaL_error(L, "deflate failed: %d", (int)status);
+        }
+    } while (flush == TDEFL_FINISH ? status != TDEFL_STATUS_DONE : (consumed < len || out_size == DEFLATE_OUT_CHUNK));
+    luaL_pushresult(&b);
+    return 1;
+}
+
+// def:update(chunk), returns the compressed bytes that are ready, possibly empty
+int lvldb_deflater_update(lua_State *L) {
+    Deflater *def = check_deflater(L, 1);
+    size_t len = 0;
+    const char *data = luaL_checklstring(L, 2, &len);
+    return deflate_push(L, def, data, len, TDEFL_NO_FLUSH);
+}
+
+// def:finish([chunk]), returns the rest of the stream, the deflater can be reused afterwards
+int lvldb_deflater_finish(lua_State *L) {
+    Deflater *def = check_deflater(L, 1);
+    size_t len = 0;
+    const char *data = luaL_optlstring(L, 2, "", &len);
+    deflate_push(L, def, data, len, TDEFL_FINISH);
+    tdefl_init(def->comp, nullptr, nullptr, def->flags);
+    return 1;
+}
+
+int lvldb_deflater_gc(lua_State *L) {
+    Deflater *def = (Deflater *)luaL_checkudata(L, 1, LVLDB_MT_DEFLATER);
+    if (def->comp) {
+        MemoryAccountant::Instance().Account(MEM_COMPRESSION, -(int64_t)sizeof(tdefl_compressor));
+    }
+    delete def->comp;
+    def->comp = nullptr;
+    return 0;
+}
+
+// lualeveldb.inflater([limit]), limit caps the total output in bytes
+int lvldb_inflater(lua_State *L) {
+    lua_Integer limit = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, limit >= 0, 1, "limit must not be negative");
+    Inflater *inf = (Inflater *)lua_newuserdata(L, sizeof(Inflater));
+    inf->decomp = nullptr;
+    inf->dict = nullptr;
+    luaL_getmetatable(L, LVLDB_MT_INFLATER);
+    lua_setmetatable(L, -2);
+    inf->limit = (size_t)limit;
+    inf->decomp = new tinfl_decompressor;
+    inf->dict = new mz_uint8[TINFL_LZ_DICT_SIZE];
+    MemoryAccountant::Instance().Account(MEM_COMPRESSION, sizeof(tinfl_decompressor) + TINFL_LZ_DICT_SIZE);
+    inflater_reset(inf);
+    return 1;
+}
+
+static int inflate_push(lua_State *L, Inflater *inf, const char *data, size_t len, bool more) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    InflateResult res = inflate_chunk(inf, (const uint8_t *)data, len, more, &b);
+    if (res == INFLATE_LIMIT || res == INFLATE_CORRUPT) {
+        inflater_reset(inf);
+    }
+    if (res == INFLATE_LIMIT) {
+        return luaL_error(L, "inflated size exceeds limit of %llu bytes", (unsigned long long)inf->limit);
+    }
+    if (res == INFLATE_CORRUPT) {
+        return luaL_error(L, "corrupt deflate stream");
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+// inf:update(chunk), returns the decompressed bytes that are ready, possibly empty
+int lvldb_inflater_update(lua_State *L) {
+    Inflater *inf = check_inflater(L, 1);
+    size_t len = 0;
+    const char *data = luaL_checklstring(L, 2, &len);
+    return inflate_push(L, inf, data, len, true);
+}
+
+// inf:finish([chunk]), fails if the stream is incomplete, the inflater can be reused afterwards
+int lvldb_inflater_finish(lua_State *L) {
+    Inflater *inf = check_inflater(L, 1);
+    size_t len = 0;
+    const char *data = luaL_optlstring(L, 2, "", &len);
+    inflate_push(L, inf, data, len, false);
+    bool done = inf->done;
+    inflater_reset(inf);
+    if (!done) {
+        return luaL_error(L, "truncated deflate stream");
+    }
+    return 1;
+}
+
+int lvldb_inflater_gc(lua_State *L) {
+    Inflater *inf = (Inflater *)luaL_checkudata(L, 1, LVLDB_MT_INFLATER);
+    if (inf->decomp) {
+        MemoryAccountant::Instance().Account(MEM_COMPRESSION, -(int64_t)(sizeof(tinfl_decompressor) + TINFL_LZ_DICT_SIZE));
+    }
+    delete inf->decomp;
+    delete[] inf->dict;
+    inf->decomp = nullptr;
+    inf->dict = nullptr;
+    return 0;
+}
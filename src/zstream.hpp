@@ -0,0 +1,35 @@
+﻿#pragma once
+#include "lib.hpp"
+#include <miniz.h>
+
+enum InflateResult { INFLATE_OK, INFLATE_DONE, INFLATE_LIMIT, INFLATE_CORRUPT };
+
+// streaming deflate state, lives inside the leveldb.deflater userdata
+struct Deflater {
+    tdefl_compressor *comp;
+    int flags;
+};
+
+// streaming inflate state, output wraps around the 32KB dictionary
+struct Inflater {
+    tinfl_decompressor *decomp;
+    mz_uint8 *dict;
+    size_t dict_ofs;
+    size_t total;
+    size_t limit;
+    bool done;
+};
+
+// inflates one chunk into the buffer, more is false for the last chunk
+InflateResult inflate_chunk(Inflater *inf, const uint8_t *data, size_t len, bool more, luaL_Buffer *b);
+// one-shot inflate that gives up once the output exceeds limit
+InflateResult inflate_limited(lua_State *L, const char *data, size_t len, size_t limit);
+
+int lvldb_deflater(lua_State *L);
+int lvldb_deflater_update(lua_State *L);
+int lvldb_deflater_finish(lua_State *L);
+int lvldb_deflater_gc(lua_State *L);
+int lvldb_inflater(lua_State *L);
+int lvldb_inflater_update(lua_State *L);
+int lvldb_inflater_finish(lua_State *L);
+int lvldb_inflater_gc(lua_State *L);